@@ -0,0 +1,149 @@
+"""asyncio support for pyisomd5sum.
+
+Checks run on native threads started by the library. The event loop only
+watches a descriptor that becomes readable when a check is done and samples
+its progress on a timer, so no executor thread is tied up per image:
+
+    result = await aioisomd5sum.check_async("image.iso")
+
+    check = aioisomd5sum.check_async("image.iso")
+    async for offset, total in check:
+        print(offset, total)
+    result = await check
+
+At most `concurrency` checks run at once, further ones wait for a slot.
+Cancelling the task awaiting a check stops its thread.
+"""
+
+import asyncio
+import weakref
+
+import pyisomd5sum
+
+# isomd5sum_status values returned by checks.
+FILE_NOT_FOUND = -2
+CHECK_NOT_FOUND = -1
+CHECK_FAILED = 0
+CHECK_PASSED = 1
+CHECK_ABORTED = 2
+
+DEFAULT_CONCURRENCY = 4
+
+_semaphores = weakref.WeakKeyDictionary()
+_concurrency = DEFAULT_CONCURRENCY
+
+
+def set_concurrency(limit):
+    """Set how many checks may run at once on each event loop."""
+    global _concurrency
+    if limit < 1:
+        raise ValueError("limit must be at least 1")
+    _concurrency = limit
+    _semaphores.clear()
+
+
+def _semaphore(loop):
+    semaphore = _semaphores.get(loop)
+    if semaphore is None:
+        semaphore = _semaphores[loop] = asyncio.Semaphore(_concurrency)
+    return semaphore
+
+
+class AsyncCheck:
+    """A check of one image, awaitable for its result and iterable for its progress."""
+
+    def __init__(self, isofile=None, fd=None, interval=0.1, semaphore=None):
+        if (isofile is None) == (fd is None):
+            raise TypeError("pass either isofile or fd")
+        self._isofile = isofile
+        self._fd = fd
+        self._interval = interval
+        self._semaphore = semaphore
+        self._task = None
+        self._progress = None
+
+    def _start(self):
+        if self._task is None:
+            loop = asyncio.get_running_loop()
+            self._progress = asyncio.Queue()
+            self._task = loop.create_task(self._run(loop))
+        return self._task
+
+    async def _run(self, loop):
+        semaphore = self._semaphore or _semaphore(loop)
+        try:
+            async with semaphore:
+                return await self._check(loop)
+        finally:
+            self._progress.put_nowait(None)
+
+    async def _check(self, loop):
+        if self._isofile is not None:
+            check = pyisomd5sum.Check(self._isofile)
+        else:
+            check = pyisomd5sum.Check(fd=self._fd)
+        done = loop.create_future()
+        fd = check.fileno()
+
+        def ready():
+            loop.remove_reader(fd)
+            if not done.done():
+                done.set_result(None)
+
+        loop.add_reader(fd, ready)
+        try:
+            last = None
+            while True:
+                try:
+                    await asyncio.wait_for(asyncio.shield(done), self._interval)
+                except asyncio.TimeoutError:
+                    pass
+                offset, total, running = check.progress()
+                if (offset, total) != last and total:
+                    self._progress.put_nowait((offset, total))
+                    last = (offset, total)
+                if not running:
+                    break
+        except asyncio.CancelledError:
+            check.cancel()
+            # The thread stops within a read, release it without blocking the
+            # loop, even if the task is cancelled again meanwhile.
+            while not done.done():
+                try:
+                    await asyncio.shield(done)
+                except asyncio.CancelledError:
+                    pass
+            raise
+        finally:
+            loop.remove_reader(fd)
+            result = check.release()
+        return result
+
+    def cancel(self):
+        """Stop the check, awaiting it raises CancelledError."""
+        if self._task is not None:
+            self._task.cancel()
+
+    def __await__(self):
+        return self._start().__await__()
+
+    def __aiter__(self):
+        self._start()
+        return self
+
+    async def __anext__(self):
+        progress = await self._progress.get()
+        if progress is None:
+            # Keep ending the iteration for later calls.
+            self._progress.put_nowait(None)
+            raise StopAsyncIteration
+        return progress
+
+
+def check_async(isofile=None, fd=None, interval=0.1, semaphore=None):
+    """Check isofile, or the open descriptor fd, on a native thread.
+
+    Progress is sampled every interval seconds. semaphore limits the checks
+    running at once instead of the shared limit set with set_concurrency.
+    """
+    return AsyncCheck(isofile, fd=fd, interval=interval, semaphore=semaphore)
@@ -0,0 +1,222 @@
+#!/bin/bash
+#
+# End-to-end throughput of implantisomd5 and checkisomd5 on synthetic CD,
+# DVD and BD sized images, read at full speed or through the slowmedia
+# shim emulating a slower device.
+#
+
+set -e
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+TEST_DIR="${SCRIPT_DIR}/../test"
+SIZES=()
+PROFILES=()
+TOOLS_DIR=""
+OUTPUT="bench_e2e.json"
+CLEANUP=true
+
+# Emulated devices: request latency in microseconds and rate in MB/s.
+# "local" runs without the shim. Sparse images are mostly holes, which
+# the kernel serves from memory, so "local" measures the CPU side.
+declare -A PROFILE_LATENCY=(
+    [local]=0 [ssd]=100 [hdd]=4000 [usb2]=200 [nfs]=500 [dvd]=1000 [bd]=800
+)
+declare -A PROFILE_RATE=(
+    [local]=0 [ssd]=500 [hdd]=120 [usb2]=30 [nfs]=100 [dvd]=11 [bd]=18
+)
+
+IMPLANT_TOOL=""
+CHECK_TOOL=""
+SHIM=""
+
+usage() {
+    cat << EOF
+Usage: $0 [OPTIONS]
+
+Measure wall time, throughput, CPU use and syscalls of implantisomd5 and
+checkisomd5 for synthetic images on emulated devices.
+
+Options:
+    -h, --help          Show this help message
+    -s, --size SIZE     Image size (tiny|small|cd|dvd|dvd_dl|bd), repeatable [cd]
+    -p, --profile NAME  Emulated device, repeatable [local, usb2]
+                        (${!PROFILE_RATE[*]})
+    -o, --output FILE   Append JSON results to FILE [bench_e2e.json]
+    --tools-dir DIR     Directory containing implantisomd5, checkisomd5 and slowmedia.so
+    --no-cleanup        Keep the images after the run
+
+Examples:
+    $0                          # CD image, full speed and USB 2
+    $0 -s dvd -p dvd            # DVD image on an emulated DVD drive
+    $0 -s cd -s bd -p local -p hdd
+
+slowmedia.so is built from bench/slowmedia.c if it isn't found.
+Syscall counts need strace; without it only the read calls are counted.
+EOF
+}
+
+log_info() {
+    echo "[INFO] $*" >&2
+}
+
+log_error() {
+    echo "[FAIL] $*" >&2
+}
+
+find_tools() {
+    local search_paths=("${SCRIPT_DIR}/.." "$(pwd)" "/usr/local/bin" "/usr/bin")
+    if [ -n "$TOOLS_DIR" ]; then
+        search_paths=("$TOOLS_DIR" "${search_paths[@]}")
+    fi
+
+    for path in "${search_paths[@]}"; do
+        if [ -z "$IMPLANT_TOOL" ] && [ -x "$path/implantisomd5" ]; then
+            IMPLANT_TOOL="$path/implantisomd5"
+        fi
+        if [ -z "$CHECK_TOOL" ] && [ -x "$path/checkisomd5" ]; then
+            CHECK_TOOL="$path/checkisomd5"
+        fi
+        if [ -z "$SHIM" ] && [ -f "$path/slowmedia.so" ]; then
+            SHIM="$path/slowmedia.so"
+        fi
+    done
+
+    if [ -z "$IMPLANT_TOOL" ] || [ -z "$CHECK_TOOL" ]; then
+        log_error "Could not find isomd5sum tools, build them first or pass --tools-dir"
+        exit 1
+    fi
+    if [ -z "$SHIM" ]; then
+        SHIM="${WORK_DIR}/slowmedia.so"
+        log_info "Building $SHIM"
+        ${CC:-cc} -O2 -shared -fPIC -o "$SHIM" "${SCRIPT_DIR}/slowmedia.c" -ldl -pthread
+    fi
+}
+
+# Run a tool on an image, storing its exit status in $WORK_DIR/status, its
+# times in $WORK_DIR/time, its statistics in $WORK_DIR/stats and its syscall
+# count in $WORK_DIR/syscalls.
+run_tool() {
+    local profile=$1
+    local iso=$2
+    shift 2
+
+    local env=()
+    if [ "$profile" != "local" ]; then
+        env=(env LD_PRELOAD="$SHIM" SLOWMEDIA_PATH="$iso"
+             SLOWMEDIA_LATENCY_US="${PROFILE_LATENCY[$profile]}" SLOWMEDIA_RATE="${PROFILE_RATE[$profile]}")
+    fi
+    local trace=()
+    if command -v strace > /dev/null; then
+        trace=(strace -f -c -o "$WORK_DIR/strace")
+    fi
+
+    local TIMEFORMAT='%R %U %S'
+    local status=0
+    { time "${env[@]}" "${trace[@]}" "$@" "$iso" < /dev/null > "$WORK_DIR/out" 2> /dev/null; } 2> "$WORK_DIR/time" || status=$?
+    echo "$status" > "$WORK_DIR/status"
+    grep '^{"engine"' "$WORK_DIR/out" > "$WORK_DIR/stats" || echo '{}' > "$WORK_DIR/stats"
+    if [ ${#trace[@]} -gt 0 ]; then
+        awk '$NF == "total" { print $(NF - 1) }' "$WORK_DIR/strace" > "$WORK_DIR/syscalls"
+    else
+        echo null > "$WORK_DIR/syscalls"
+    fi
+}
+
+# Print the result of the last run and append it to the JSON output.
+report() {
+    local tool=$1
+    local size=$2
+    local profile=$3
+    local bytes=$4
+
+    local wall user sys
+    read -r wall user sys < "$WORK_DIR/time"
+    local status syscalls stats read_calls engine buffer
+    status=$(cat "$WORK_DIR/status")
+    syscalls=$(cat "$WORK_DIR/syscalls")
+    stats=$(cat "$WORK_DIR/stats")
+    read_calls=$(echo "$stats" | sed -n 's/.*"read_calls": \([0-9]*\).*/\1/p')
+    engine=$(echo "$stats" | sed -n 's/.*"engine": "\([^"]*\)".*/\1/p')
+    buffer=$(echo "$stats" | sed -n 's/.*"peak_buffer": \([0-9]*\).*/\1/p')
+
+    local rate cpu
+    rate=$(awk -v b="$bytes" -v t="$wall" 'BEGIN { printf "%.1f", (t > 0 ? b / t / 1e6 : 0) }')
+    cpu=$(awk -v u="$user" -v s="$sys" -v t="$wall" 'BEGIN { printf "%.1f", (t > 0 ? (u + s) / t * 100 : 0) }')
+
+    printf "%-14s %-6s %-6s %8.2f s %8s MB/s %6s%% CPU %8s reads %8s syscalls  %s, %s byte buffer  exit %s\n" \
+           "$tool" "$size" "$profile" "$wall" "$rate" "$cpu" "${read_calls:-?}" "$syscalls" \
+           "${engine:-?}" "${buffer:-?}" "$status"
+    echo "{\"tool\": \"$tool\", \"size\": \"$size\", \"profile\": \"$profile\", \"bytes\": $bytes, \"exit_status\": $status," \
+         "\"wall_seconds\": $wall, \"user_seconds\": $user, \"system_seconds\": $sys," \
+         "\"mb_per_s\": $rate, \"cpu_percent\": $cpu, \"syscalls\": $syscalls," \
+         "\"read_calls\": ${read_calls:-null}, \"engine\": \"${engine}\", \"buffer_size\": ${buffer:-null}}" >> "$OUTPUT"
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -h|--help)
+            usage
+            exit 0
+            ;;
+        -s|--size)
+            SIZES+=("$2")
+            shift
+            ;;
+        -p|--profile)
+            if [ -z "${PROFILE_RATE[$2]+set}" ]; then
+                log_error "Unknown profile $2"
+                exit 1
+            fi
+            PROFILES+=("$2")
+            shift
+            ;;
+        -o|--output)
+            OUTPUT="$2"
+            shift
+            ;;
+        --tools-dir)
+            TOOLS_DIR="$2"
+            shift
+            ;;
+        --no-cleanup)
+            CLEANUP=false
+            ;;
+        *)
+            usage
+            exit 1
+            ;;
+    esac
+    shift
+done
+
+if [ ${#SIZES[@]} -eq 0 ]; then
+    SIZES=(cd)
+fi
+if [ ${#PROFILES[@]} -eq 0 ]; then
+    PROFILES=(local usb2)
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5bench-XXXXXX")
+if [ "$CLEANUP" = true ]; then
+    trap 'rm -rf "$WORK_DIR"' EXIT
+else
+    log_info "Keeping images in $WORK_DIR"
+fi
+find_tools
+
+for size in "${SIZES[@]}"; do
+    iso="$WORK_DIR/bench_${size}.iso"
+    log_info "Creating $size image"
+    python3 "${TEST_DIR}/create_synthetic_iso.py" "$size" "$iso" > /dev/null
+    bytes=$(stat -c%s "$iso" 2>/dev/null || stat -f%z "$iso")
+
+    for profile in "${PROFILES[@]}"; do
+        run_tool "$profile" "$iso" "$IMPLANT_TOOL" --force --stats=json
+        report implantisomd5 "$size" "$profile" "$bytes"
+        run_tool "$profile" "$iso" "$CHECK_TOOL" --stats=json
+        report checkisomd5 "$size" "$profile" "$bytes"
+    done
+    if [ "$CLEANUP" = true ]; then
+        rm -f "$iso"
+    fi
+done
@@ -0,0 +1,293 @@
+/*
+ * bench_md5 - measure MD5_Update throughput and compare it to a baseline
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "md5.h"
+
+/* Inputs streamed for cold cache runs, larger than any CPU cache. */
+#define COLD_POOL_SIZE (256UL * 1024 * 1024)
+/* Space between two cold inputs, so no input shares a page with another. */
+#define COLD_STRIDE_ALIGN 4096UL
+
+static const size_t sizes[] = { 64, 512, 4096, 32768, 1048576 };
+static const size_t alignments[] = { 0, 1, 4 };
+
+/* The MD5 transforms this build can run, the library picks the first one. */
+static const char *const kernels[] = { MD5_ENGINE };
+
+struct result {
+    const char *kernel;
+    size_t size;
+    size_t alignment;
+    bool cold;
+    double mb_per_s;
+};
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Hash inputs of size bytes starting alignment bytes into 64 byte aligned
+ * memory for at least seconds. Warm runs hash the same input again and
+ * again, cold runs walk through a pool larger than the caches.
+ */
+static double measure(unsigned char *const pool, const size_t size, const size_t alignment,
+                      const bool cold, const double seconds) {
+    const size_t stride = (size + alignment + COLD_STRIDE_ALIGN - 1) / COLD_STRIDE_ALIGN * COLD_STRIDE_ALIGN;
+    const size_t count = cold ? COLD_POOL_SIZE / stride : 1;
+    MD5_CTX hashctx;
+    MD5_Init(&hashctx);
+
+    size_t done = 0;
+    size_t next = 0;
+    const double start = now();
+    double elapsed;
+    do {
+        /* Check the clock only every few MB to keep it out of the numbers. */
+        for (size_t n = 0; n < 1 + (4U << 20) / size; n++) {
+            MD5_Update(&hashctx, pool + next * stride + alignment, (unsigned) size);
+            next = next + 1 == count ? 0 : next + 1;
+            done += size;
+        }
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    unsigned char digest[16];
+    MD5_Final(digest, &hashctx);
+    return (double) done / elapsed / 1e6;
+}
+
+/*
+ * Name of the CPU model, from /proc/cpuinfo where there is one. Quotes and
+ * backslashes are left out, so it can go into the JSON as it is.
+ */
+static void cpu_model(char *const model, const size_t size) {
+    snprintf(model, size, "unknown");
+    FILE *const input = fopen("/proc/cpuinfo", "r");
+    if (input == NULL)
+        return;
+    char line[256];
+    while (fgets(line, sizeof(line), input)) {
+        char *value = strchr(line, ':');
+        if (value == NULL || (strncmp(line, "model name", 10) && strncmp(line, "Model", 5)))
+            continue;
+        while (*++value == ' ') {
+        }
+        size_t n = 0;
+        for (; *value && *value != '\n' && n + 1 < size; value++) {
+            if (*value != '"' && *value != '\\')
+                model[n++] = *value;
+        }
+        model[n] = '\0';
+        break;
+    }
+    fclose(input);
+}
+
+/* The baseline of model in dir: its name in lower case with dashes for the rest. */
+static void baseline_path(char *const path, const size_t size, const char *const dir, const char *const model) {
+    size_t n = (size_t) snprintf(path, size, "%s/", dir);
+    if (n + 6 > size)
+        n = size - 6;
+    bool dash = false;
+    for (const char *c = model; *c && n + 6 < size; c++) {
+        if (isalnum((unsigned char) *c)) {
+            if (dash && path[n - 1] != '/')
+                path[n++] = '-';
+            path[n++] = (char) tolower((unsigned char) *c);
+            dash = false;
+        } else {
+            dash = true;
+        }
+    }
+    snprintf(path + n, size - n, ".json");
+}
+
+static void write_results(FILE *const output, const char *const model, const struct result *const results,
+                          const size_t count) {
+    fprintf(output, "{\"cpu\": \"%s\", \"results\": [\n", model);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(output, "  {\"kernel\": \"%s\", \"size\": %zu, \"alignment\": %zu, \"cache\": \"%s\", \"mb_per_s\": %.1f}%s\n",
+                results[i].kernel, results[i].size, results[i].alignment, results[i].cold ? "cold" : "warm",
+                results[i].mb_per_s, i + 1 < count ? "," : "");
+    }
+    fprintf(output, "]}\n");
+}
+
+/**
+ * Compare results to a baseline written by an earlier run, one result per
+ * line. Return the number of results slower than the tolerance allows.
+ */
+static int compare_baseline(const char *const path, const struct result *const results,
+                            const size_t count, const double tolerance) {
+    FILE *const input = fopen(path, "r");
+    if (input == NULL) {
+        perror(path);
+        return -1;
+    }
+    int regressions = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), input)) {
+        char kernel[64], cache[8];
+        size_t size, alignment;
+        double baseline;
+        if (sscanf(line, " {\"kernel\": \"%63[^\"]\", \"size\": %zu, \"alignment\": %zu, \"cache\": \"%7[a-z]\", \"mb_per_s\": %lf",
+                   kernel, &size, &alignment, cache, &baseline) != 5)
+            continue;
+        for (size_t i = 0; i < count; i++) {
+            const struct result *const r = results + i;
+            if (strcmp(r->kernel, kernel) || r->size != size || r->alignment != alignment ||
+                strcmp(r->cold ? "cold" : "warm", cache))
+                continue;
+            const double change = r->mb_per_s / baseline - 1.0;
+            const char *verdict = "";
+            if (change < -tolerance) {
+                verdict = "  REGRESSION";
+                regressions++;
+            } else if (change > tolerance) {
+                verdict = "  faster";
+            }
+            fprintf(stderr, "%-8s %8zu bytes +%zu %s: %9.1f MB/s, baseline %9.1f MB/s (%+.0f%%)%s\n",
+                    kernel, size, alignment, cache, r->mb_per_s, baseline, change * 100.0, verdict);
+        }
+    }
+    fclose(input);
+    return regressions;
+}
+
+static int usage(void) {
+    fprintf(stderr, "Usage: bench_md5 [--output <file>] [--baseline <file> | --baseline-dir <dir> [--update-baseline]]\n"
+                    "                 [--tolerance <fraction>] [--seconds <per case>]\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    const char *output_path = NULL;
+    const char *baseline = NULL;
+    const char *baseline_dir = NULL;
+    bool update = false;
+    double tolerance = 0.25;
+    double seconds = 0.2;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "--output") == 0)
+            output_path = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--baseline") == 0)
+            baseline = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--baseline-dir") == 0)
+            baseline_dir = argv[++i];
+        else if (strcmp(argv[i], "--update-baseline") == 0)
+            update = true;
+        else if (i + 1 < argc && strcmp(argv[i], "--tolerance") == 0)
+            tolerance = atof(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--seconds") == 0)
+            seconds = atof(argv[++i]);
+        else
+            return usage();
+    }
+    if ((baseline && baseline_dir) || (update && !baseline_dir))
+        return usage();
+
+    char model[128];
+    cpu_model(model, sizeof(model));
+    /* Throughput depends on the CPU, so each model has a baseline of its own. */
+    char path[1024];
+    if (baseline_dir) {
+        baseline_path(path, sizeof(path), baseline_dir, model);
+        baseline = path;
+    }
+
+    /* Alignment 0 means the start of a cache line. */
+    unsigned char *const pool = aligned_alloc(64, COLD_POOL_SIZE + COLD_STRIDE_ALIGN);
+    if (pool == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+    /* Touch every page, so cold runs don't measure page faults. */
+    for (size_t i = 0; i < COLD_POOL_SIZE + COLD_STRIDE_ALIGN; i++)
+        pool[i] = (unsigned char) (i * 131);
+
+    const size_t nkernels = sizeof(kernels) / sizeof(*kernels);
+    const size_t nsizes = sizeof(sizes) / sizeof(*sizes);
+    const size_t nalignments = sizeof(alignments) / sizeof(*alignments);
+    const size_t count = nkernels * nsizes * nalignments * 2;
+    struct result *const results = calloc(count, sizeof(*results));
+    if (results == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        free(pool);
+        return 2;
+    }
+
+    size_t n = 0;
+    for (size_t k = 0; k < nkernels; k++)
+        for (size_t s = 0; s < nsizes; s++)
+            for (size_t a = 0; a < nalignments; a++)
+                for (int cold = 0; cold < 2; cold++) {
+                    struct result *const r = results + n++;
+                    r->kernel = kernels[k];
+                    r->size = sizes[s];
+                    r->alignment = alignments[a];
+                    r->cold = cold;
+                    r->mb_per_s = measure(pool, sizes[s], alignments[a], cold, seconds);
+                }
+    free(pool);
+
+    FILE *output = stdout;
+    if (output_path && (output = fopen(output_path, "w")) == NULL) {
+        perror(output_path);
+        free(results);
+        return 2;
+    }
+    write_results(output, model, results, count);
+    if (output != stdout)
+        fclose(output);
+
+    int rc = 0;
+    if (update) {
+        FILE *const file = fopen(baseline, "w");
+        if (file == NULL) {
+            perror(baseline);
+            rc = 2;
+        } else {
+            write_results(file, model, results, count);
+            fclose(file);
+            fprintf(stderr, "Stored the baseline of %s in %s\n", model, baseline);
+        }
+    } else if (baseline) {
+        const int regressions = compare_baseline(baseline, results, count, tolerance);
+        if (regressions) {
+            if (regressions > 0)
+                fprintf(stderr, "%d results more than %.0f%% below the baseline\n", regressions, tolerance * 100.0);
+            else if (baseline_dir)
+                fprintf(stderr, "No baseline for %s, take one with --update-baseline and check it in\n", model);
+            rc = 1;
+        }
+    }
+    free(results);
+    return rc;
+}
@@ -0,0 +1,137 @@
+/*
+ * slowmedia - LD_PRELOAD shim making reads of an image as slow as a drive
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Reads of files whose path contains SLOWMEDIA_PATH are delayed as if they
+ * were served one after another by a device that needs SLOWMEDIA_LATENCY_US
+ * microseconds per request and transfers SLOWMEDIA_RATE megabytes per
+ * second. Other files are read at full speed.
+ *
+ *   SLOWMEDIA_PATH=image.iso SLOWMEDIA_LATENCY_US=1000 SLOWMEDIA_RATE=11 \
+ *       LD_PRELOAD=./slowmedia.so checkisomd5 image.iso
+ */
+
+/* The wrappers below define pread and pread64 themselves. */
+#undef _FILE_OFFSET_BITS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define MAX_FDS 4096
+
+enum { UNKNOWN = 0, SLOW, FAST };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char kinds[MAX_FDS];
+/* Time the emulated device finishes the requests queued so far. */
+static long long busy_until;
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int is_slow(const int fd) {
+    const char *const match = getenv("SLOWMEDIA_PATH");
+    if (match == NULL || fd < 0 || fd >= MAX_FDS)
+        return 0;
+    if (kinds[fd] == UNKNOWN) {
+        char link[64], path[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        const ssize_t len = readlink(link, path, sizeof(path) - 1);
+        if (len < 0)
+            return 0;
+        path[len] = '\0';
+        kinds[fd] = strstr(path, match) ? SLOW : FAST;
+    }
+    return kinds[fd] == SLOW;
+}
+
+/* Queue a request of nbyte on the device and wait until it is served. */
+static void delay(const size_t nbyte) {
+    const char *const latency = getenv("SLOWMEDIA_LATENCY_US");
+    const char *const rate = getenv("SLOWMEDIA_RATE");
+    long long cost = latency ? atoll(latency) * 1000LL : 0LL;
+    if (rate && atof(rate) > 0.0)
+        cost += (long long) ((double) nbyte / (atof(rate) * 1e6) * 1e9);
+
+    pthread_mutex_lock(&lock);
+    const long long start = now_ns();
+    if (busy_until < start)
+        busy_until = start;
+    busy_until += cost;
+    const long long until = busy_until;
+    pthread_mutex_unlock(&lock);
+
+    struct timespec wake = { .tv_sec = until / 1000000000LL, .tv_nsec = until % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+    }
+}
+
+ssize_t read(int fd, void *buffer, size_t nbyte) {
+    static ssize_t (*real)(int, void *, size_t);
+    if (real == NULL)
+        real = (ssize_t (*)(int, void *, size_t)) dlsym(RTLD_NEXT, "read");
+    if (is_slow(fd))
+        delay(nbyte);
+    return real(fd, buffer, nbyte);
+}
+
+ssize_t __read_chk(int fd, void *buffer, size_t nbyte, size_t size) {
+    (void) size;
+    return read(fd, buffer, nbyte);
+}
+
+ssize_t pread(int fd, void *buffer, size_t nbyte, off_t offset) {
+    static ssize_t (*real)(int, void *, size_t, off_t);
+    if (real == NULL)
+        real = (ssize_t (*)(int, void *, size_t, off_t)) dlsym(RTLD_NEXT, "pread");
+    if (is_slow(fd))
+        delay(nbyte);
+    return real(fd, buffer, nbyte, offset);
+}
+
+ssize_t pread64(int fd, void *buffer, size_t nbyte, off64_t offset) {
+    static ssize_t (*real)(int, void *, size_t, off64_t);
+    if (real == NULL)
+        real = (ssize_t (*)(int, void *, size_t, off64_t)) dlsym(RTLD_NEXT, "pread64");
+    if (is_slow(fd))
+        delay(nbyte);
+    return real(fd, buffer, nbyte, offset);
+}
+
+int close(int fd) {
+    static int (*real)(int);
+    if (real == NULL)
+        real = (int (*)(int)) dlsym(RTLD_NEXT, "close");
+    if (fd >= 0 && fd < MAX_FDS)
+        kinds[fd] = UNKNOWN;
+    return real(fd);
+}
@@ -18,9 +18,13 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include "win32_compat.h"
@@ -28,8 +32,14 @@
 /* Windows doesn't have termios, we'll provide simplified version */
 #include <conio.h>
 #else
+#include <fcntl.h>
 #include <popt.h>
 #include <termios.h>
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
 #endif
 
 #include "md5.h"
@@ -39,8 +49,21 @@ struct progressCBData {
     int verbose;
     int gauge;
     int gaugeat;
+    int diagnose;
+    int stream;         /* The image comes from stdin, which can't be read for keys */
+    double start;
 };
 
+static double now_seconds(void) {
+#ifdef _WIN32
+    return (double) GetTickCount64() / 1e3;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+#endif
+}
+
 int user_bailing_out(void) {
 #ifdef _WIN32
     /* Windows implementation using _kbhit() and _getch() */
@@ -76,7 +99,14 @@ static int outputCB(void *const co, const long long offset, const long long tota
     if (pct > 100.0) pct = 100.0;
 
     if (data->verbose) {
+        /* The library calls back a few times per second, not for every read. */
+        const double elapsed = now_seconds() - data->start;
         printf("\rChecking: %05.1f%%", pct);
+        if (offset > 0 && elapsed > 0.0) {
+            const double rate = (double) offset / elapsed;
+            const long long left = offset < total ? (long long) ((double) (total - offset) / rate) : 0LL;
+            printf(" %7.1f MB/s, %lld:%02lld left ", rate / 1e6, left / 60, left % 60);
+        }
         fflush(stdout);
     }
     if (data->gauge) {
@@ -88,14 +118,224 @@ static int outputCB(void *const co, const long long offset, const long long tota
             data->gaugeat = gaugeval;
         }
     }
+    return data->stream ? 0 : user_bailing_out();
+}
+
+static int diagnoseCB(void *const co, const struct isomd5sum_region *const region) {
+    static const char *const status[] = {
+        [ISOMD5SUM_REGION_OK] = "ok",
+        [ISOMD5SUM_REGION_BAD_SUM] = "BAD CHECKSUM",
+        [ISOMD5SUM_REGION_READ_ERROR] = "READ ERROR",
+        [ISOMD5SUM_REGION_UNVERIFIED] = "not verifiable"
+    };
+    (void) co;
+
+    if (region->fragment == 0) {
+        printf("Read error: sectors %lld-%lld (offset %lld, %lld bytes)\n",
+               region->offset / 2048, (region->offset + region->length - 1) / 2048,
+               region->offset, region->length);
+    } else {
+        const double rate = region->seconds > 0.0 ? (double) region->length / region->seconds / 1e6 : 0.0;
+        printf("Fragment %2d: offset %lld, %lld bytes, %.1f MB/s: %s\n", region->fragment,
+               region->offset, region->length, rate, status[region->status]);
+    }
+    fflush(stdout);
     return user_bailing_out();
 }
 
+/* The read sizes learned by --auto-tune are kept in the user's cache directory. */
+static const char *defaultTuneProfiles(char *const path, const size_t size) {
+    const char *const cache = getenv("XDG_CACHE_HOME");
+    const char *const home = getenv("HOME");
+    if (cache && *cache)
+        snprintf(path, size, "%s/isomd5sum-io-profiles", cache);
+    else if (home && *home)
+        snprintf(path, size, "%s/.cache/isomd5sum-io-profiles", home);
+    else
+        return NULL;
+    return path;
+}
+
+static const char *const ioSources[] = { "default", "page cache", "stored", "sampled" };
+
 static int usage(void) {
-    fprintf(stderr, "Usage: checkisomd5 [--md5sumonly] [--verbose] [--gauge] <isofilename>|<blockdevice>\n\n");
+    fprintf(stderr, "Usage: checkisomd5 [--md5sumonly] [--verbose] [--gauge] [--diagnose] [--files <patterns> [--manifest <file>]]\n"
+                    "                   [--max-rate <MB/s>] [--idle] [--adaptive] [--stats=json]\n"
+                    "                   [--profile=json|csv [--profile-region <MiB>]] [--auto-tune [--tune-profiles <file>]]\n"
+                    "                   [--metrics <file>] [--checksum-file <file> [--checksum-name <name>]]\n"
+                    "                   <isofilename>|<blockdevice>|-\n");
+    fprintf(stderr, "       checkisomd5 --verity-setup [--verity-file <file>] [--verity-name <name>] <blockdevice>\n");
+    fprintf(stderr, "       checkisomd5 [--verbose] [--gauge] [--connections <count>] <http(s) URL>\n");
+    fprintf(stderr, "       checkisomd5 --scan <directory> [--jobs <count>] [--metrics <file>]\n\n");
+    fprintf(stderr, "--auto-tune only picks the read size, the image is still read through the page cache.\n\n");
     return 1;
 }
 
+static void printJSONString(const char *string) {
+    putchar('"');
+    for (; *string; string++) {
+        const unsigned char c = (unsigned char) *string;
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+/* Print one JSON object per line for every image below dir. */
+static int scanDirectory(const char *const dir, const int jobs, struct isomd5sum_metrics *const metrics) {
+    struct isomd5sum_scan *const scan = mediaScanOpen(dir, jobs);
+    if (scan == NULL) {
+        fprintf(stderr, "Unable to scan %s\n", dir);
+        return 1;
+    }
+    const struct isomd5sum_scan_result *result;
+    while ((result = mediaScanNext(scan)) != NULL) {
+        if (metrics)
+            isomd5sumMetricsRecordScan(metrics, result->error ? "error" : result->implanted ? "implanted" : "not_implanted");
+        printf("{\"path\": ");
+        printJSONString(result->path);
+        if (result->error)
+            printf(", \"error\": \"%s\"}\n", strerror(result->error));
+        else if (!result->implanted)
+            printf(", \"hashsum\": null}\n");
+        else
+            printf(", \"hashsum\": \"%s\", \"fragmentcount\": %lld, \"size\": %lld, \"supported\": %s}\n",
+                   result->hashsum, result->fragmentcount, result->size,
+                   result->supported ? "true" : "false");
+    }
+    mediaScanClose(scan);
+    fflush(stdout);
+    return 0;
+}
+
+/*
+ * Print the dmsetup commands mapping the image on device with dm-verity: the
+ * blocks under the tree as <name>-data, and <name> as the whole image with
+ * the head before them passed through, so it can be mounted as usual.
+ */
+static int printVeritySetup(const char *const device, const char *const hashdevice, const char *const name) {
+    const int isofd = open(device, O_RDONLY | O_BINARY);
+    if (isofd < 0) {
+        fprintf(stderr, "Unable to open %s\n", device);
+        return 1;
+    }
+    struct isomd5sum_verity verity;
+    const int rc = mediaVerityInfo(isofd, &verity);
+    close(isofd);
+    if (rc) {
+        fprintf(stderr, "No dm-verity hash tree implanted in %s\n", device);
+        return 1;
+    }
+    if (hashdevice == NULL && verity.hash_offset == 0) {
+        fprintf(stderr, "The hash tree of %s is kept apart, pass it with --verity-file\n", device);
+        return 1;
+    }
+
+    /* Sizes and offsets of device mapper tables are in 512 byte sectors. */
+    const long long head = verity.data_offset / 512;
+    const long long sectors = verity.data_blocks * verity.data_block_size / 512;
+    printf("dmsetup create --concise '%s-data,,,ro,0 %lld linear %s %lld'\n", name, sectors, device, head);
+    printf("dmsetup create --concise '%s,,,ro,0 %lld linear %s 0,%lld %lld verity 1 /dev/mapper/%s-data %s %d %d "
+           "%lld %lld sha256 %s %s'\n",
+           name, head, device, head, sectors, name, hashdevice ? hashdevice : device, verity.data_block_size,
+           verity.hash_block_size, verity.data_blocks, hashdevice ? 0LL : verity.hash_offset / verity.hash_block_size,
+           verity.root, verity.salt);
+    return 0;
+}
+
+static const char *baseName(const char *const path) {
+    const char *const slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static bool isSha256(const char *const hex, const size_t length) {
+    if (length != 64)
+        return false;
+    for (size_t i = 0; i < length; i++)
+        if (strchr("0123456789abcdefABCDEF", hex[i]) == NULL)
+            return false;
+    return true;
+}
+
+/*
+ * Find the SHA-256 of image in a CHECKSUM file, in the BSD format
+ * "SHA256 (name) = hash" used by Fedora or the GNU format "hash  name" of
+ * sha256sum. Entries match on their file name without directories; a single
+ * entry also matches an image with another name, like a block device or -.
+ */
+static int readChecksumFile(const char *const path, const char *const image, char *const hashsum) {
+    FILE *const f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    char line[4096];
+    int entries = 0;
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *name;
+        const char *hex;
+        size_t namelen;
+        if (strncmp(line, "SHA256 (", 8) == 0) {
+            char *const end = strstr(line, ") = ");
+            if (end == NULL)
+                continue;
+            name = line + 8;
+            namelen = (size_t) (end - name);
+            hex = end + 4;
+            if (!isSha256(hex, strlen(hex)))
+                continue;
+        } else if (isSha256(line, strspn(line, "0123456789abcdefABCDEF")) && line[64] == ' ' &&
+                   (line[65] == ' ' || line[65] == '*')) {
+            hex = line;
+            name = line + 66;
+            namelen = strlen(name);
+        } else {
+            continue;
+        }
+        char entry[sizeof(line)];
+        snprintf(entry, sizeof(entry), "%.*s", (int) namelen, name);
+        if (entries++ == 0 || strcmp(baseName(entry), baseName(image)) == 0) {
+            for (size_t i = 0; i < 64; i++)
+                hashsum[i] = (char) tolower((unsigned char) hex[i]);
+            hashsum[64] = '\0';
+            found = strcmp(baseName(entry), baseName(image)) == 0;
+        }
+    }
+    fclose(f);
+    /* Only fall back to the first entry if it was the only one. */
+    return found || entries == 1 ? 0 : -1;
+}
+
+static bool isURL(const char *const file) {
+    return strncmp(file, "http://", 7) == 0 || strncmp(file, "https://", 8) == 0;
+}
+
+/* Check the whole image or, if patterns are given, only the matching files. */
+static int runCheck(struct isomd5sum_context *const ctx, const int isofd, const char *const file,
+                    const char *const files, const char *manifest, const int connections,
+                    struct progressCBData *const data) {
+    if (isURL(file))
+        return mediaCheckURL(file, connections, outputCB, data);
+    if (isofd < 0)
+        return ISOMD5SUM_FILE_NOT_FOUND;
+    if (data->diagnose)
+        return mediaDiagnoseContext(ctx, isofd, diagnoseCB, data);
+    if (files == NULL)
+        return mediaCheckContext(ctx, isofd, outputCB, data);
+
+    char sidecar[4096];
+    if (manifest == NULL) {
+        snprintf(sidecar, sizeof(sidecar), "%s.manifest", file);
+        manifest = sidecar;
+    }
+    return mediaCheckManifestContext(ctx, isofd, manifest, files, outputCB, data);
+}
+
 /* Process the result code and return the proper exit status value
  *
  * return 1 for failures, 0 for good checksum and 2 if aborted.
@@ -152,11 +392,50 @@ int main(int argc, const char **argv) {
 
     int md5only = 0;
     int help = 0;
+    const char *files = NULL;
+    const char *manifest = NULL;
+    const char *scan = NULL;
+    int jobs = 16;
+    int connections = 4;
+    long max_rate = 0;
+    int idle = 0;
+    int adaptive = 0;
+    const char *stats = NULL;
+    const char *profile = NULL;
+    int profile_region = 16;
+    int auto_tune = 0;
+    const char *tune_profiles = NULL;
+    const char *metrics_file = NULL;
+    int verity_setup = 0;
+    const char *verity_file = NULL;
+    const char *verity_name = "iso";
+    const char *checksum_file = NULL;
+    const char *checksum_name = NULL;
 
     struct poptOption options[] = {
         { "md5sumonly", 'o', POPT_ARG_NONE, &md5only, 0 },
+        { "files", 0, POPT_ARG_STRING, &files, 0 },
+        { "manifest", 0, POPT_ARG_STRING, &manifest, 0 },
+        { "scan", 0, POPT_ARG_STRING, &scan, 0 },
+        { "jobs", 'j', POPT_ARG_INT, &jobs, 0 },
+        { "connections", 'c', POPT_ARG_INT, &connections, 0 },
         { "verbose", 'v', POPT_ARG_NONE, &data.verbose, 0 },
         { "gauge", 'g', POPT_ARG_NONE, &data.gauge, 0 },
+        { "diagnose", 'd', POPT_ARG_NONE, &data.diagnose, 0 },
+        { "max-rate", 0, POPT_ARG_LONG, &max_rate, 0 },
+        { "idle", 0, POPT_ARG_NONE, &idle, 0 },
+        { "adaptive", 0, POPT_ARG_NONE, &adaptive, 0 },
+        { "stats", 0, POPT_ARG_STRING, &stats, 0 },
+        { "profile", 0, POPT_ARG_STRING, &profile, 0 },
+        { "profile-region", 0, POPT_ARG_INT, &profile_region, 0 },
+        { "auto-tune", 0, POPT_ARG_NONE, &auto_tune, 0 },
+        { "tune-profiles", 0, POPT_ARG_STRING, &tune_profiles, 0 },
+        { "metrics", 0, POPT_ARG_STRING, &metrics_file, 0 },
+        { "verity-setup", 0, POPT_ARG_NONE, &verity_setup, 0 },
+        { "verity-file", 0, POPT_ARG_STRING, &verity_file, 0 },
+        { "verity-name", 0, POPT_ARG_STRING, &verity_name, 0 },
+        { "checksum-file", 0, POPT_ARG_STRING, &checksum_file, 0 },
+        { "checksum-name", 0, POPT_ARG_STRING, &checksum_name, 0 },
         { "help", 'h', POPT_ARG_NONE, &help, 0 },
         { 0, 0, 0, 0, 0 }
     };
@@ -172,51 +451,173 @@ int main(int argc, const char **argv) {
         return 1;
     }
 
-    if (help) {
+    if (help || max_rate < 0 || connections < 1 || profile_region < 1 || (stats && strcmp(stats, "json")) ||
+        (profile && strcmp(profile, "json") && strcmp(profile, "csv"))) {
         poptFreeContext(optCon);
         return usage();
     }
 
+    /* Only prints how to map the image, nothing is read past the PVD. */
+    if (verity_setup) {
+        const char **args = poptGetArgs(optCon);
+        rc = args && args[0] && args[0][0] ? printVeritySetup(args[0], verity_file, verity_name) : usage();
+        poptFreeContext(optCon);
+        return rc;
+    }
+
+    /* Written every 15 seconds, so long checks show up while they run. */
+    struct isomd5sum_metrics *metrics = NULL;
+    if (metrics_file && (metrics = isomd5sumMetricsOpen(metrics_file, "checkisomd5", 15)) == NULL)
+        fprintf(stderr, "Not writing metrics to %s: %s\n", metrics_file, strerror(errno));
+
+    if (scan) {
+        rc = scanDirectory(scan, jobs, metrics);
+        isomd5sumMetricsClose(metrics);
+        poptFreeContext(optCon);
+        return rc;
+    }
+
     const char **args = poptGetArgs(optCon);
     if (!args || !args[0] || !args[0][0]) {
+        isomd5sumMetricsClose(metrics);
         poptFreeContext(optCon);
         return usage();
     }
+    /* Images at URLs are only checked as a whole. */
+    const bool url = isURL(args[0]);
+    if (url && (md5only || files || data.diagnose || max_rate || idle || adaptive || stats || profile || auto_tune ||
+                metrics || checksum_file)) {
+        fprintf(stderr, "Checks of URLs only support --verbose, --gauge and --connections\n");
+        isomd5sumMetricsClose(metrics);
+        poptFreeContext(optCon);
+        return 1;
+    }
+    /* "-" reads the image from stdin, which may be a pipe. */
+    data.stream = strcmp(args[0], "-") == 0;
+    if (data.stream && (md5only || files || data.diagnose)) {
+        fprintf(stderr, "--md5sumonly, --files and --diagnose need a file or block device\n");
+        isomd5sumMetricsClose(metrics);
+        poptFreeContext(optCon);
+        return 1;
+    }
+
+    /* The SHA-256 is only complete when the whole image is read. */
+    char sha256[65];
+    if (checksum_file && (md5only || files || data.diagnose)) {
+        fprintf(stderr, "--checksum-file can't be used with --md5sumonly, --files or --diagnose\n");
+        isomd5sumMetricsClose(metrics);
+        poptFreeContext(optCon);
+        return 1;
+    }
+    /* Images without a name of their own, like stdin, can name their entry. */
+    const char *const entry = checksum_name ? checksum_name : args[0];
+    if (checksum_file && readChecksumFile(checksum_file, entry, sha256)) {
+        fprintf(stderr, "No SHA-256 checksum for %s in %s\n", entry, checksum_file);
+        isomd5sumMetricsClose(metrics);
+        poptFreeContext(optCon);
+        return 1;
+    }
+
+    struct isomd5sum_context *const ctx = isomd5sumContextNew();
+    if (ctx == NULL || (checksum_file && isomd5sumContextEnableSha256(ctx, 1))) {
+        fprintf(stderr, "Out of memory\n");
+        isomd5sumContextFree(ctx);
+        isomd5sumMetricsClose(metrics);
+        poptFreeContext(optCon);
+        return 1;
+    }
+    isomd5sumContextSetThrottle(ctx, max_rate * 1000000LL,
+                                (idle ? ISOMD5SUM_THROTTLE_IDLE : 0) | (adaptive ? ISOMD5SUM_THROTTLE_ADAPTIVE : 0));
+    isomd5sumContextEnableStats(ctx, stats != NULL);
+    if (profile)
+        isomd5sumContextEnableProfile(ctx, profile_region * 1024LL * 1024LL);
+    isomd5sumContextSetMetrics(ctx, metrics);
+    /* The image is opened and its volume info parsed only once. */
+    int isofd = -1;
+    if (data.stream) {
+        isofd = 0;
+#ifdef _WIN32
+        _setmode(isofd, _O_BINARY);
+#endif
+    } else if (!url) {
+        isofd = open(args[0], O_RDONLY | O_BINARY);
+    }
 
-    if (md5only | data.verbose) {
-        rc = printMD5SUM(args[0]);
-        if (rc < 0) {
+    /* Reading the volume info first would consume a stream. */
+    if ((md5only | data.verbose) && !url && !data.stream) {
+        rc = isofd < 0 ? ISOMD5SUM_FILE_NOT_FOUND : mediaLoadContext(ctx, isofd);
+        if (rc == 0)
+            printMD5SUMContext(ctx, args[0]);
+        if (rc < 0 || md5only) {
+            if (isofd >= 0)
+                close(isofd);
+            isomd5sumContextFree(ctx);
+            isomd5sumMetricsClose(metrics);
             poptFreeContext(optCon);
-            return processExitStatus(rc);
+            return rc < 0 ? processExitStatus(rc) : 0;
         }
     }
 
-    if (md5only) {
-        poptFreeContext(optCon);
-        return 0;
+    /* Streams are read as they come, there is nothing to tune. */
+    if (auto_tune && isofd >= 0 && !data.stream) {
+        char path[4096];
+        const char *const profiles = tune_profiles ? tune_profiles : defaultTuneProfiles(path, sizeof(path));
+        struct isomd5sum_io_profile io;
+        if (isomd5sumContextAutoTune(ctx, isofd, profiles, &io) == 0 && data.verbose)
+            printf("Reading %lld KiB at a time from %s (%s)\n", io.read_size / 1024, io.device, ioSources[io.source]);
     }
 
-    printf("Press [Esc] to abort check.\n");
+    if (!data.stream)
+        printf("Press [Esc] to abort check.\n");
+    data.start = now_seconds();
 
 #ifdef _WIN32
     /* Windows doesn't need terminal configuration for _kbhit() */
-    rc = mediaCheckFile(args[0], outputCB, &data);
+    rc = runCheck(ctx, isofd, args[0], files, manifest, connections, &data);
 #else
-    static struct termios oldt;
-    struct termios newt;
-    tcgetattr(0, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO | ECHONL | ISIG | IEXTEN);
-    tcsetattr(0, TCSANOW, &newt);
-    rc = mediaCheckFile(args[0], outputCB, &data);
-    tcsetattr(0, TCSANOW, &oldt);
+    if (data.stream) {
+        rc = runCheck(ctx, isofd, args[0], files, manifest, connections, &data);
+    } else {
+        static struct termios oldt;
+        struct termios newt;
+        tcgetattr(0, &oldt);
+        newt = oldt;
+        newt.c_lflag &= ~(ICANON | ECHO | ECHONL | ISIG | IEXTEN);
+        tcsetattr(0, TCSANOW, &newt);
+        rc = runCheck(ctx, isofd, args[0], files, manifest, connections, &data);
+        tcsetattr(0, TCSANOW, &oldt);
+    }
 #endif
 
     if (data.verbose) {
         printf("\n");
         fflush(stdout);
     }
+    /* Only plain checks of the whole image collect statistics. */
+    if (stats && files == NULL && !data.diagnose)
+        isomd5sumContextPrintStats(ctx);
+    if (profile && files == NULL && !data.diagnose)
+        isomd5sumContextPrintProfile(ctx, strcmp(profile, "csv") ? ISOMD5SUM_PROFILE_JSON : ISOMD5SUM_PROFILE_CSV);
+
+    /* The SHA-256 is reported apart from the md5sum, only a wrong one changes
+     * the exit status. */
+    bool sha256_failed = false;
+    if (checksum_file && rc != ISOMD5SUM_CHECK_ABORTED) {
+        char computed[65];
+        if (!isomd5sumContextSha256(ctx, computed)) {
+            printf("%s: SHA-256 not computed\n", args[0]);
+        } else {
+            sha256_failed = strcmp(computed, sha256) != 0;
+            printf("%s: SHA-256 %s\n", args[0], sha256_failed ? "FAILED" : "OK");
+        }
+        fflush(stdout);
+    }
 
+    if (isofd >= 0 && !data.stream)
+        close(isofd);
+    isomd5sumContextFree(ctx);
+    isomd5sumMetricsClose(metrics);
     poptFreeContext(optCon);
-    return processExitStatus(rc);
+    const int exit_rc = processExitStatus(rc);
+    return sha256_failed ? 1 : exit_rc;
 }
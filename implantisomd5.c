@@ -18,20 +18,32 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
+#include "win32_compat.h"
 #include "simple_popt.h"
 #else
+#include <fcntl.h>
 #include <popt.h>
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
 #endif
 
 #include "md5.h"
 #include "libimplantisomd5.h"
 
 static int usage(void) {
-    fprintf(stderr, "implantisomd5:         implantisomd5 [--force] [--supported-iso] <isofilename>\n");
+    fprintf(stderr, "implantisomd5:         implantisomd5 [--force] [--supported-iso] [--manifest [<file>]]\n"
+                    "                                     [--max-rate <MB/s>] [--idle] [--adaptive] [--stats=json]\n"
+                    "                                     [--cache <file>] [--metrics <file>]\n"
+                    "                                     [--verity] [--verity-file <file>] <isofilename>\n");
     return 1;
 }
 
@@ -41,10 +53,28 @@ int main(int argc, const char **argv) {
     int forceit = 0;
     int supported = 0;
     int help = 0;
+    const char *manifest = NULL;
+    long max_rate = 0;
+    int idle = 0;
+    int adaptive = 0;
+    const char *stats = NULL;
+    const char *cache = NULL;
+    const char *metrics_file = NULL;
+    int verity = 0;
+    const char *verity_file = NULL;
 
     struct poptOption options[] = {
         { "force", 'f', POPT_ARG_NONE, &forceit, 0 },
         { "supported-iso", 'S', POPT_ARG_NONE, &supported, 0 },
+        { "manifest", 'm', POPT_ARG_STRING, &manifest, 0 },
+        { "max-rate", 0, POPT_ARG_LONG, &max_rate, 0 },
+        { "idle", 0, POPT_ARG_NONE, &idle, 0 },
+        { "adaptive", 0, POPT_ARG_NONE, &adaptive, 0 },
+        { "stats", 0, POPT_ARG_STRING, &stats, 0 },
+        { "cache", 0, POPT_ARG_STRING, &cache, 0 },
+        { "metrics", 0, POPT_ARG_STRING, &metrics_file, 0 },
+        { "verity", 0, POPT_ARG_NONE, &verity, 0 },
+        { "verity-file", 0, POPT_ARG_STRING, &verity_file, 0 },
         { "help", 'h', POPT_ARG_NONE, &help, 0 },
         { 0, 0, 0, 0, 0 }
     };
@@ -60,18 +90,69 @@ int main(int argc, const char **argv) {
         return 1;
     }
 
-    if (help) {
+    if (help || max_rate < 0 || (stats && strcmp(stats, "json"))) {
         poptFreeContext(optCon);
         return usage();
     }
 
     const char **args = poptGetArgs(optCon);
+    /* "--manifest image.iso" writes the manifest next to the image, where
+     * checkisomd5 --files looks for it. */
+    const char *image[] = { manifest, NULL };
+    char sidecar[4096];
+    if ((!args || !args[0]) && manifest) {
+        args = image;
+        snprintf(sidecar, sizeof(sidecar), "%s.manifest", manifest);
+        manifest = sidecar;
+    }
     if (!args || !args[0] || !args[0][0]) {
         poptFreeContext(optCon);
         return usage();
     }
 
-    rc = implantISOFile(args[0], supported, forceit, 0, &errstr);
+    struct isomd5sum_context *const ctx = isomd5sumContextNew();
+    if (ctx == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        poptFreeContext(optCon);
+        return 1;
+    }
+    isomd5sumContextSetThrottle(ctx, max_rate * 1000000LL,
+                                (idle ? ISOMD5SUM_THROTTLE_IDLE : 0) | (adaptive ? ISOMD5SUM_THROTTLE_ADAPTIVE : 0));
+    isomd5sumContextEnableStats(ctx, stats != NULL);
+    if (cache && isomd5sumContextSetCache(ctx, cache))
+        fprintf(stderr, "Not using cache %s: %s\n", cache, strerror(errno));
+    /* Written every 15 seconds, so long implants show up while they run. */
+    struct isomd5sum_metrics *metrics = NULL;
+    if (metrics_file && (metrics = isomd5sumMetricsOpen(metrics_file, "implantisomd5", 15)) == NULL)
+        fprintf(stderr, "Not writing metrics to %s: %s\n", metrics_file, strerror(errno));
+    isomd5sumContextSetMetrics(ctx, metrics);
+    const int isofd = open(args[0], O_RDWR | O_BINARY);
+    /* The hash tree goes to its own file with --verity-file. */
+    const int hashfd = verity_file ? open(verity_file, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644) : -1;
+    if (isofd < 0) {
+        errstr = "Error - Unable to open file %s";
+        rc = -1;
+    } else if (verity_file && hashfd < 0) {
+        errstr = "Error - Unable to create the hash tree file for %s";
+        rc = -1;
+    } else {
+        if (verity || verity_file)
+            rc = implantISOVerity(ctx, isofd, hashfd, supported, forceit, 0, &errstr);
+        else
+            rc = implantISOContext(ctx, isofd, supported, forceit, 0, &errstr);
+        if (stats)
+            isomd5sumContextPrintStats(ctx);
+    }
+    if (isofd >= 0)
+        close(isofd);
+    if (hashfd >= 0 && close(hashfd) && rc == 0) {
+        errstr = "Error - Failed to write the hash tree file for %s";
+        rc = -1;
+    }
+    isomd5sumContextFree(ctx);
+    isomd5sumMetricsClose(metrics);
+    if (rc == 0 && manifest)
+        rc = implantManifestFile(args[0], manifest, 0, &errstr);
     if (rc) {
         fprintf(stderr, "ERROR: ");
         fprintf(stderr, errstr, args[0]);
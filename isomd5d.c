@@ -0,0 +1,439 @@
+/*
+ * isomd5d - check and implant md5sums on behalf of local clients
+ * Copyright (C) 2001-2013 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <grp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <popt.h>
+
+#include "libcheckisomd5.h"
+#include "libimplantisomd5.h"
+#include "protocol.h"
+
+/* Interval between progress lines sent to a client. */
+#define PROGRESS_INTERVAL_MS 100
+/* Time a client has to send its request after connecting. */
+#define REQUEST_TIMEOUT_S 10
+
+enum job_type { JOB_CHECK,
+                JOB_IMPLANT };
+
+/**
+ * A check or implant of one image. Clients asking for the same job on the
+ * same image while it is queued or running subscribe to it instead of
+ * starting another one.
+ */
+struct job {
+    struct job *next_queued;
+    struct job *next_active;
+    enum job_type type;
+    int supported;
+    int forceit;
+    dev_t device;
+    ino_t inode;
+    int isofd;
+    int subscribers;
+    bool running;
+    bool done;
+    int result;
+    char *errstr;
+    long long offset;
+    long long total;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static struct job *queue_head = NULL;
+static struct job **queue_tail = &queue_head;
+/* Jobs queued or running, searched for duplicates. */
+static struct job *active = NULL;
+/* Connections being served, and signalled when one of them ends. */
+static int clients = 0;
+static pthread_cond_t client_left = PTHREAD_COND_INITIALIZER;
+/* Removed again when the daemon is told to stop. */
+static const char *socket_path = NULL;
+
+/* Called with lock held. */
+static void release_job(struct job *const job) {
+    if (job->subscribers == 0 && job->done)
+        free(job);
+}
+
+static void finish_job(struct job *const job, const int result, char *const errstr) {
+    for (struct job **p = &active; *p; p = &(*p)->next_active) {
+        if (*p == job) {
+            *p = job->next_active;
+            break;
+        }
+    }
+    close(job->isofd);
+    job->result = result;
+    job->errstr = errstr;
+    job->done = true;
+    pthread_cond_broadcast(&changed);
+    release_job(job);
+}
+
+static int jobCB(void *const co, const long long offset, const long long total) {
+    struct job *const job = co;
+    pthread_mutex_lock(&lock);
+    job->offset = offset;
+    job->total = total;
+    /* Nobody is waiting for the result anymore. */
+    const int abort = job->subscribers == 0;
+    pthread_mutex_unlock(&lock);
+    return abort;
+}
+
+/**
+ * Run queued jobs. Every worker owns one context, so the memory used for
+ * buffers is bounded by the number of workers.
+ */
+static void *worker(void *const co) {
+    struct isomd5sum_context *const ctx = co;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (queue_head == NULL)
+            pthread_cond_wait(&changed, &lock);
+        struct job *const job = queue_head;
+        queue_head = job->next_queued;
+        if (queue_head == NULL)
+            queue_tail = &queue_head;
+        if (job->subscribers == 0) {
+            finish_job(job, ISOMD5SUM_CHECK_ABORTED, NULL);
+            continue;
+        }
+        job->running = true;
+        pthread_mutex_unlock(&lock);
+
+        int result;
+        char *errstr = NULL;
+        if (job->type == JOB_CHECK)
+            result = mediaCheckContext(ctx, job->isofd, jobCB, job);
+        else
+            result = implantISOContextCallback(ctx, job->isofd, job->supported, job->forceit, 1, jobCB, job, &errstr);
+
+        pthread_mutex_lock(&lock);
+        finish_job(job, result, errstr);
+    }
+    return NULL;
+}
+
+/* Find a job to subscribe to or queue a new one. Called with lock held. */
+static struct job *subscribe(const enum job_type type, const int supported, const int forceit,
+                             const struct stat *const st, const int isofd) {
+    for (struct job *job = active; job; job = job->next_active) {
+        if (job->type == type && job->supported == supported && job->forceit == forceit &&
+            job->device == st->st_dev && job->inode == st->st_ino) {
+            job->subscribers++;
+            close(isofd);
+            return job;
+        }
+    }
+    struct job *const job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        close(isofd);
+        return NULL;
+    }
+    job->type = type;
+    job->supported = supported;
+    job->forceit = forceit;
+    job->device = st->st_dev;
+    job->inode = st->st_ino;
+    job->isofd = isofd;
+    job->subscribers = 1;
+    job->next_active = active;
+    active = job;
+    *queue_tail = job;
+    queue_tail = &job->next_queued;
+    pthread_cond_broadcast(&changed);
+    return job;
+}
+
+static bool hung_up(const int sock) {
+    /* Clients send nothing after the request, so input means end of stream. */
+    struct pollfd event = { .fd = sock, .events = POLLIN };
+    return poll(&event, 1, 0) > 0;
+}
+
+static void *serve(void *const co) {
+    const int sock = (int) (intptr_t) co;
+    char request[PROTOCOL_LINE_SIZE];
+    int isofd;
+    enum job_type type;
+    int supported = 0;
+    int forceit = 0;
+    struct stat st;
+
+    if (!receive_request(sock, request, sizeof(request), &isofd) || isofd < 0) {
+        write_line(sock, "RESULT %d bad request", ISOMD5SUM_CHECK_NOT_FOUND);
+        goto out;
+    }
+    if (strcmp(request, "CHECK") == 0) {
+        type = JOB_CHECK;
+    } else if (sscanf(request, "IMPLANT %d %d", &supported, &forceit) == 2) {
+        type = JOB_IMPLANT;
+    } else {
+        write_line(sock, "RESULT %d bad request", ISOMD5SUM_CHECK_NOT_FOUND);
+        goto out;
+    }
+    if (fstat(isofd, &st)) {
+        write_line(sock, "RESULT %d", ISOMD5SUM_FILE_NOT_FOUND);
+        goto out;
+    }
+    /* A pipe could block a worker in read() for as long as the client likes. */
+    if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+        write_line(sock, "RESULT %d not a file or block device", ISOMD5SUM_FILE_NOT_FOUND);
+        goto out;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct job *const job = subscribe(type, supported, forceit, &st, isofd);
+    isofd = -1;
+    if (job == NULL) {
+        pthread_mutex_unlock(&lock);
+        goto out;
+    }
+    long long sent = -1LL;
+    bool attached = true;
+    while (!job->done && attached) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&changed, &lock, &until);
+        if (job->done)
+            break;
+        const long long offset = job->offset;
+        const long long total = job->total;
+        const bool running = job->running;
+        pthread_mutex_unlock(&lock);
+        if (offset != sent && running) {
+            attached = write_line(sock, "PROGRESS %lld %lld", offset, total);
+            sent = offset;
+        }
+        if (hung_up(sock))
+            attached = false;
+        pthread_mutex_lock(&lock);
+    }
+    if (job->done) {
+        const int result = job->result;
+        const char *const errstr = job->errstr;
+        pthread_mutex_unlock(&lock);
+        if (errstr)
+            write_line(sock, "RESULT %d %s", result, errstr);
+        else
+            write_line(sock, "RESULT %d", result);
+        pthread_mutex_lock(&lock);
+    }
+    job->subscribers--;
+    release_job(job);
+    pthread_mutex_unlock(&lock);
+
+out:
+    if (isofd >= 0)
+        close(isofd);
+    close(sock);
+    pthread_mutex_lock(&lock);
+    clients--;
+    pthread_cond_signal(&client_left);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* Take a connection slot, waiting while max_clients are being served. */
+static void wait_for_slot(const int max_clients) {
+    pthread_mutex_lock(&lock);
+    while (clients >= max_clients)
+        pthread_cond_wait(&client_left, &lock);
+    clients++;
+    pthread_mutex_unlock(&lock);
+}
+
+static void release_slot(void) {
+    pthread_mutex_lock(&lock);
+    clients--;
+    pthread_mutex_unlock(&lock);
+}
+
+static void stop(const int signum) {
+    (void) signum;
+    /* Only async-signal-safe calls here. */
+    unlink(socket_path);
+    _exit(0);
+}
+
+static int listen_socket(const char *const path, const mode_t mode, const gid_t group) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &address, sizeof(address)) || listen(sock, SOMAXCONN)) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+    /* Clients pass descriptors they opened, so by default any local user may connect. */
+    if ((group != (gid_t) -1 && chown(path, (uid_t) -1, group)) || chmod(path, mode)) {
+        perror(path);
+        unlink(path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int usage(void) {
+    fprintf(stderr, "Usage: isomd5d [--socket <path>] [--socket-mode <mode>] [--socket-group <group>]\n"
+                    "               [--workers <count>] [--max-clients <count>] [--max-rate <MB/s>] [--idle] [--adaptive]\n\n");
+    return 1;
+}
+
+int main(int argc, const char **argv) {
+    const char *path = daemon_socket_path();
+    const char *mode_arg = "0666";
+    const char *group_arg = NULL;
+    int workers = 2;
+    int max_clients = 64;
+    long max_rate = 0;
+    int idle = 0;
+    int adaptive = 0;
+    int help = 0;
+
+    struct poptOption options[] = {
+        { "socket", 's', POPT_ARG_STRING, &path, 0 },
+        { "socket-mode", 0, POPT_ARG_STRING, &mode_arg, 0 },
+        { "socket-group", 0, POPT_ARG_STRING, &group_arg, 0 },
+        { "workers", 'w', POPT_ARG_INT, &workers, 0 },
+        { "max-clients", 0, POPT_ARG_INT, &max_clients, 0 },
+        { "max-rate", 0, POPT_ARG_LONG, &max_rate, 0 },
+        { "idle", 0, POPT_ARG_NONE, &idle, 0 },
+        { "adaptive", 0, POPT_ARG_NONE, &adaptive, 0 },
+        { "help", 'h', POPT_ARG_NONE, &help, 0 },
+        { 0, 0, 0, 0, 0 }
+    };
+
+    poptContext optCon = poptGetContext("isomd5d", argc, argv, options, 0);
+
+    int rc = poptGetNextOpt(optCon);
+    if (rc < -1) {
+        fprintf(stderr, "bad option %s: %s\n",
+                poptBadOption(optCon, POPT_BADOPTION_NOALIAS),
+                poptStrerror(rc));
+        poptFreeContext(optCon);
+        return 1;
+    }
+    char *end;
+    const long mode = strtol(mode_arg, &end, 8);
+    if (help || workers < 1 || max_clients < 1 || max_rate < 0 || *end || end == mode_arg || mode < 0 || mode > 0777) {
+        poptFreeContext(optCon);
+        return usage();
+    }
+    gid_t group = (gid_t) -1;
+    if (group_arg != NULL) {
+        const struct group *const entry = getgrnam(group_arg);
+        if (entry == NULL) {
+            fprintf(stderr, "Unknown group: %s\n", group_arg);
+            poptFreeContext(optCon);
+            return 1;
+        }
+        group = entry->gr_gid;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    const int sock = listen_socket(path, (mode_t) mode, group);
+    if (sock < 0) {
+        poptFreeContext(optCon);
+        return 1;
+    }
+    socket_path = path;
+    struct sigaction action = { .sa_handler = stop };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        struct isomd5sum_context *const ctx = isomd5sumContextNew();
+        /* The limit applies to each worker on its own. */
+        if (ctx != NULL)
+            isomd5sumContextSetThrottle(ctx, max_rate * 1000000LL,
+                                        (idle ? ISOMD5SUM_THROTTLE_IDLE : 0) | (adaptive ? ISOMD5SUM_THROTTLE_ADAPTIVE : 0));
+        if (ctx == NULL || pthread_create(&thread, NULL, worker, ctx)) {
+            fprintf(stderr, "Unable to start worker\n");
+            poptFreeContext(optCon);
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    for (;;) {
+        /* Further clients wait in the listen backlog until a slot is free. */
+        wait_for_slot(max_clients);
+        const int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            release_slot();
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+        /* Don't let a silent client hold its slot. */
+        const struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT_S };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve, (void *) (intptr_t) client)) {
+            close(client);
+            release_slot();
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    unlink(path);
+    close(sock);
+    poptFreeContext(optCon);
+    return 1;
+}
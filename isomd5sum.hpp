@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef __ISOMD5SUM_HPP__
+#define __ISOMD5SUM_HPP__
+
+/*
+ * Header-only C++17 layer over libcheckisomd5. A Verifier is put together
+ * from a reader policy, which decides how the image is read, and a hasher
+ * policy, which decides what is verified:
+ *
+ *   isomd5sum::Verifier<isomd5sum::reader::Mmap, isomd5sum::hasher::Md5Fragments> verifier;
+ *   isomd5sum::Result result = verifier.check("image.iso");
+ *   if (result.passed()) ...
+ *
+ * Both are template parameters, as is the progress callback. Only the
+ * callback branch is resolved at compile time: a Verifier without callback
+ * has none. The md5sum policies are thin wrappers of the library's
+ * isomd5sum_hasher, which still blanks the appdata and compares the
+ * fragment sums with run-time checks on every piece, so they read no faster
+ * than mediaCheckFD. There is no io_uring reader; liburing is not a
+ * dependency of the library.
+ *
+ * A reader policy is constructed from an open descriptor and returns the
+ * image in pieces from next(), an empty piece at the end. A hasher policy
+ * takes the pieces in update(), which returns false once the image failed,
+ * and produces the Result from finish(). Several hasher policies, like the
+ * md5sum and the SHA-256 of a published CHECKSUM file, are combined into
+ * one pass through hasher::Multi:
+ *
+ *   isomd5sum::hasher::Multi<isomd5sum::hasher::Md5Fragments, isomd5sum::hasher::Sha256> hasher;
+ *   isomd5sum::Result result = verifier.check("image.iso", hasher);
+ *   if (result.passed() && hasher.get<1>().sha256() == published) ...
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "libcheckisomd5.h"
+
+namespace isomd5sum {
+
+#ifdef __cpp_lib_span
+using Bytes = std::span<const unsigned char>;
+#else
+/* The part of std::span<const unsigned char> used here, before C++20. */
+class Bytes {
+public:
+    constexpr Bytes() noexcept = default;
+    constexpr Bytes(const unsigned char *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+    constexpr const unsigned char *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr Bytes subspan(std::size_t offset, std::size_t count) const noexcept {
+        return Bytes(data_ + offset, count);
+    }
+
+private:
+    const unsigned char *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+#endif
+
+enum class Status : int {
+    FileNotFound = ISOMD5SUM_FILE_NOT_FOUND,
+    CheckNotFound = ISOMD5SUM_CHECK_NOT_FOUND,
+    Failed = ISOMD5SUM_CHECK_FAILED,
+    Passed = ISOMD5SUM_CHECK_PASSED,
+    Aborted = ISOMD5SUM_CHECK_ABORTED
+};
+
+/* Outcome of a check. Results are moved, not copied. */
+class Result {
+public:
+    Result(Status status, std::string md5sum = std::string()) : status_(status), md5sum_(std::move(md5sum)) {}
+    Result(const Result &) = delete;
+    Result &operator=(const Result &) = delete;
+    Result(Result &&) noexcept = default;
+    Result &operator=(Result &&) noexcept = default;
+
+    Status status() const noexcept { return status_; }
+    bool passed() const noexcept { return status_ == Status::Passed; }
+    explicit operator bool() const noexcept { return passed(); }
+    /* The md5sum of the bytes hashed, empty if none were. */
+    const std::string &md5sum() const noexcept { return md5sum_; }
+
+private:
+    Status status_;
+    std::string md5sum_;
+};
+
+/* Owns an open descriptor. */
+class FileDescriptor {
+public:
+    FileDescriptor() noexcept = default;
+    explicit FileDescriptor(int fd) noexcept : fd_(fd) {}
+    explicit FileDescriptor(const char *path) noexcept : fd_(::open(path, O_RDONLY | O_CLOEXEC)) {}
+    FileDescriptor(const FileDescriptor &) = delete;
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+    FileDescriptor(FileDescriptor &&other) noexcept : fd_(other.release()) {}
+    FileDescriptor &operator=(FileDescriptor &&other) noexcept {
+        reset(other.release());
+        return *this;
+    }
+    ~FileDescriptor() { reset(); }
+
+    int get() const noexcept { return fd_; }
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+    int release() noexcept { return std::exchange(fd_, -1); }
+    void reset(int fd = -1) noexcept {
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = fd;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+namespace detail {
+
+struct HasherDeleter {
+    void operator()(isomd5sum_hasher *hasher) const noexcept { isomd5sumHasherFree(hasher); }
+};
+
+using HasherHandle = std::unique_ptr<isomd5sum_hasher, HasherDeleter>;
+
+struct Sha256Deleter {
+    void operator()(isomd5sum_sha256 *sha256) const noexcept { isomd5sumSha256Free(sha256); }
+};
+
+using Sha256Handle = std::unique_ptr<isomd5sum_sha256, Sha256Deleter>;
+
+/* Size of the pieces the reader policies return. */
+constexpr std::size_t CHUNK_SIZE = 1 << 20;
+
+struct FreeDeleter {
+    void operator()(unsigned char *buffer) const noexcept { std::free(buffer); }
+};
+
+inline std::unique_ptr<unsigned char[], FreeDeleter> alloc_chunk() {
+    const std::size_t pagesize = static_cast<std::size_t>(::getpagesize());
+    return std::unique_ptr<unsigned char[], FreeDeleter>(
+        static_cast<unsigned char *>(std::aligned_alloc(pagesize, CHUNK_SIZE)));
+}
+
+} // namespace detail
+
+/* Progress callback that is never called, the default. */
+struct NoProgress {
+    constexpr bool operator()(long long, long long) const noexcept { return false; }
+};
+
+namespace reader {
+
+/* read(2) from the current position. */
+class Read {
+public:
+    explicit Read(int fd) : fd_(fd), buffer_(detail::alloc_chunk()) {}
+
+    Bytes next() {
+        if (!buffer_)
+            return Bytes();
+        ssize_t nread;
+        while ((nread = ::read(fd_, buffer_.get(), detail::CHUNK_SIZE)) < 0 && errno == EINTR) {
+        }
+        return nread > 0 ? Bytes(buffer_.get(), static_cast<std::size_t>(nread)) : Bytes();
+    }
+
+private:
+    int fd_;
+    std::unique_ptr<unsigned char[], detail::FreeDeleter> buffer_;
+};
+
+/* pread(2) from the start of the image, leaving the file position alone. */
+class Pread {
+public:
+    explicit Pread(int fd) : fd_(fd), buffer_(detail::alloc_chunk()) {}
+
+    Bytes next() {
+        if (!buffer_)
+            return Bytes();
+        ssize_t nread;
+        while ((nread = ::pread(fd_, buffer_.get(), detail::CHUNK_SIZE, offset_)) < 0 && errno == EINTR) {
+        }
+        if (nread <= 0)
+            return Bytes();
+        offset_ += nread;
+        return Bytes(buffer_.get(), static_cast<std::size_t>(nread));
+    }
+
+private:
+    int fd_;
+    off_t offset_ = 0;
+    std::unique_ptr<unsigned char[], detail::FreeDeleter> buffer_;
+};
+
+/* Map the whole image and hand out pieces of the mapping without copying. */
+class Mmap {
+public:
+    explicit Mmap(int fd) {
+        struct stat st;
+        if (::fstat(fd, &st))
+            return;
+        /* Block devices report their size through lseek only. */
+        const off_t size = S_ISREG(st.st_mode) ? st.st_size : ::lseek(fd, 0, SEEK_END);
+        if (size <= 0)
+            return;
+        void *const map = ::mmap(nullptr, static_cast<std::size_t>(size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            return;
+        ::madvise(map, static_cast<std::size_t>(size), MADV_SEQUENTIAL);
+        map_ = static_cast<const unsigned char *>(map);
+        size_ = static_cast<std::size_t>(size);
+    }
+    Mmap(const Mmap &) = delete;
+    Mmap &operator=(const Mmap &) = delete;
+    ~Mmap() {
+        if (map_)
+            ::munmap(const_cast<unsigned char *>(map_), size_);
+    }
+
+    Bytes next() {
+        const std::size_t len = std::min(detail::CHUNK_SIZE, size_ - offset_);
+        const Bytes piece(map_ + offset_, len);
+        offset_ += len;
+        return piece;
+    }
+
+private:
+    const unsigned char *map_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t offset_ = 0;
+};
+
+} // namespace reader
+
+namespace hasher {
+
+/*
+ * Common part of the policies backed by the library's hasher. Mode is only
+ * passed on to isomd5sumHasherNew; the hasher looks at it, at the fragment
+ * count and at where the appdata lies for every piece.
+ */
+template <int Mode>
+class Library {
+public:
+    Library() : hasher_(isomd5sumHasherNew(Mode)) {}
+
+    bool update(Bytes piece) {
+        return hasher_ && isomd5sumHasherUpdate(hasher_.get(), piece.data(), piece.size()) == ISOMD5SUM_CHECK_RUNNING;
+    }
+
+    /* True while more of the image is needed. */
+    bool wants_more() const { return hasher_ && isomd5sumHasherProgress(hasher_.get(), nullptr, nullptr); }
+
+    void progress(long long &offset, long long &total) const {
+        offset = total = 0;
+        if (hasher_)
+            isomd5sumHasherProgress(hasher_.get(), &offset, &total);
+    }
+
+    Result finish() {
+        if (!hasher_)
+            return Result(Status::CheckNotFound);
+        char hashsum[33];
+        isomd5sumHasherMd5sum(hasher_.get(), hashsum);
+        long long offset, total;
+        progress(offset, total);
+        return Result(static_cast<Status>(mediaCheckHasher(hasher_.get())), offset ? hashsum : "");
+    }
+
+private:
+    detail::HasherHandle hasher_;
+};
+
+/* Compare the implanted md5sum once the whole image is read. */
+using Md5 = Library<ISOMD5SUM_HASHER_CHECK | ISOMD5SUM_HASHER_NO_FRAGMENTS>;
+
+/* Also compare the fragment sums, failing at the first bad fragment. */
+using Md5Fragments = Library<ISOMD5SUM_HASHER_CHECK>;
+
+/*
+ * SHA-256 of every byte the reader returns, as sha256sum computes it for
+ * published CHECKSUM files, so it wants the image to its end. There is
+ * nothing implanted to compare it with: finish() reports CheckNotFound and
+ * sha256() is compared with the published digest.
+ */
+class Sha256 {
+public:
+    Sha256() : sha256_(isomd5sumSha256New()) {}
+
+    bool update(Bytes piece) {
+        if (sha256_)
+            isomd5sumSha256Update(sha256_.get(), piece.data(), piece.size());
+        return static_cast<bool>(sha256_);
+    }
+
+    bool wants_more() const { return static_cast<bool>(sha256_); }
+
+    Result finish() { return Result(Status::CheckNotFound); }
+
+    /* The SHA-256 of the bytes passed so far in base 16. */
+    std::string sha256() const {
+        if (!sha256_)
+            return std::string();
+        char hashsum[65];
+        isomd5sumSha256Hashsum(sha256_.get(), hashsum);
+        return hashsum;
+    }
+
+private:
+    detail::Sha256Handle sha256_;
+};
+
+/*
+ * Feed the image to several hasher policies, each until it wants no more.
+ * The first one drives progress and the result; it fails if any of them
+ * does, and the check stops at the first failure.
+ */
+template <class First, class... Rest>
+class Multi {
+public:
+    bool update(Bytes piece) {
+        return std::apply([piece](auto &...hashers) { return ((!hashers.wants_more() || hashers.update(piece)) & ...); },
+                          hashers_);
+    }
+
+    bool wants_more() const {
+        return std::apply([](const auto &...hashers) { return (hashers.wants_more() || ...); }, hashers_);
+    }
+
+    void progress(long long &offset, long long &total) const { std::get<0>(hashers_).progress(offset, total); }
+
+    Result finish() {
+        return std::apply([](auto &first, auto &...rest) {
+            Result result = first.finish();
+            const bool passed = ((rest.finish().status() != Status::Failed) & ... & true);
+            if (result.passed() && !passed)
+                return Result(Status::Failed, result.md5sum());
+            return result;
+        }, hashers_);
+    }
+
+    /* Access the policy at index I, for example to fetch its digest. */
+    template <std::size_t I>
+    auto &get() noexcept { return std::get<I>(hashers_); }
+
+private:
+    std::tuple<First, Rest...> hashers_;
+};
+
+} // namespace hasher
+
+template <class Reader, class Hasher>
+class Verifier {
+public:
+    /*
+     * Check the image open on fd. progress is called as progress(offset,
+     * total) after every piece and aborts the check by returning true.
+     */
+    template <class Progress = NoProgress>
+    Result check(int fd, Progress &&progress = Progress()) const {
+        Hasher hasher;
+        return check(fd, hasher, std::forward<Progress>(progress));
+    }
+
+    /* Check with a hasher of the caller's, to read its digests afterwards. */
+    Result check(int fd, Hasher &hasher) const { return check(fd, hasher, NoProgress()); }
+
+    template <class Progress>
+    Result check(int fd, Hasher &hasher, Progress &&progress) const {
+        Reader reader(fd);
+        for (;;) {
+            const Bytes piece = reader.next();
+            if (piece.empty())
+                break;
+            if (!hasher.update(piece))
+                break;
+            if constexpr (!std::is_same_v<std::decay_t<Progress>, NoProgress>) {
+                long long offset, total;
+                hasher.progress(offset, total);
+                if (total && progress(offset, total))
+                    return Result(Status::Aborted);
+            }
+            if (!hasher.wants_more())
+                break;
+        }
+        return hasher.finish();
+    }
+
+    template <class Progress = NoProgress>
+    Result check(const char *path, Progress &&progress = Progress()) const {
+        const FileDescriptor fd(path);
+        if (!fd)
+            return Result(Status::FileNotFound);
+        return check(fd.get(), std::forward<Progress>(progress));
+    }
+
+    Result check(const char *path, Hasher &hasher) const { return check(path, hasher, NoProgress()); }
+
+    template <class Progress>
+    Result check(const char *path, Hasher &hasher, Progress &&progress) const {
+        const FileDescriptor fd(path);
+        if (!fd)
+            return Result(Status::FileNotFound);
+        return check(fd.get(), hasher, std::forward<Progress>(progress));
+    }
+
+    /* Check an image held in memory, the reader policy is not involved. */
+    static Result check(Bytes image) {
+        Hasher hasher;
+        hasher.update(image);
+        return hasher.finish();
+    }
+};
+
+} // namespace isomd5sum
+
+#endif /* __ISOMD5SUM_HPP__ */
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2001-2013 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libcheckisomd5.h"
+
+#ifdef _WIN32
+
+/* Background checks need POSIX threads and file descriptors to poll. */
+struct isomd5sum_check *mediaCheckStartFile(const char *file, checkCallback cb, void *cbdata) {
+    (void) file;
+    (void) cb;
+    (void) cbdata;
+    return NULL;
+}
+
+struct isomd5sum_check *mediaCheckStartFD(int isofd, checkCallback cb, void *cbdata) {
+    (void) isofd;
+    (void) cb;
+    (void) cbdata;
+    return NULL;
+}
+
+int mediaCheckProgress(struct isomd5sum_check *check, long long *offset, long long *total) {
+    (void) check;
+    (void) offset;
+    (void) total;
+    return 0;
+}
+
+int mediaCheckWait(struct isomd5sum_check *check, int timeout) {
+    (void) check;
+    (void) timeout;
+    return ISOMD5SUM_CHECK_NOT_FOUND;
+}
+
+void mediaCheckCancel(struct isomd5sum_check *check) {
+    (void) check;
+}
+
+int mediaCheckEventFD(struct isomd5sum_check *check) {
+    (void) check;
+    return -1;
+}
+
+int mediaCheckRelease(struct isomd5sum_check *check) {
+    (void) check;
+    return ISOMD5SUM_CHECK_NOT_FOUND;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "utilities.h"
+
+struct isomd5sum_check {
+    pthread_t thread;
+    int isofd;
+    bool owns_fd;
+    checkCallback cb;
+    void *cbdata;
+    /* Signalled once the check is done: an eventfd, or the read end of a pipe. */
+    int eventfd;
+    int notifyfd;
+    atomic_int cancelled;
+    atomic_int done;
+    atomic_int result;
+    atomic_llong offset;
+    atomic_llong total;
+};
+
+static int asyncCB(void *const co, const long long offset, const long long total) {
+    struct isomd5sum_check *const check = co;
+    atomic_store_explicit(&check->offset, offset, memory_order_relaxed);
+    atomic_store_explicit(&check->total, total, memory_order_relaxed);
+    if (check->cb && check->cb(check->cbdata, offset, total))
+        return 1;
+    return atomic_load_explicit(&check->cancelled, memory_order_relaxed);
+}
+
+static void *runCheck(void *const co) {
+    struct isomd5sum_check *const check = co;
+    const int rc = mediaCheckFD(check->isofd, asyncCB, check);
+    atomic_store(&check->result, rc);
+    atomic_store(&check->done, 1);
+
+    const uint64_t one = 1;
+    while (write(check->notifyfd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+    return NULL;
+}
+
+static bool open_event(struct isomd5sum_check *const check) {
+#ifdef __linux__
+    check->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (check->eventfd >= 0) {
+        check->notifyfd = check->eventfd;
+        return true;
+    }
+#endif
+    int fds[2];
+    if (pipe(fds))
+        return false;
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+    check->eventfd = fds[0];
+    check->notifyfd = fds[1];
+    return true;
+}
+
+static void close_event(struct isomd5sum_check *const check) {
+    if (check->notifyfd != check->eventfd)
+        close(check->notifyfd);
+    close(check->eventfd);
+}
+
+static struct isomd5sum_check *start(const int isofd, const bool owns_fd, checkCallback cb, void *cbdata) {
+    struct isomd5sum_check *const check = calloc(1, sizeof(*check));
+    if (check == NULL)
+        return NULL;
+    check->isofd = isofd;
+    check->owns_fd = owns_fd;
+    check->cb = cb;
+    check->cbdata = cbdata;
+    atomic_init(&check->cancelled, 0);
+    atomic_init(&check->done, 0);
+    atomic_init(&check->result, ISOMD5SUM_CHECK_RUNNING);
+    atomic_init(&check->offset, 0LL);
+    atomic_init(&check->total, 0LL);
+
+    if (!open_event(check)) {
+        free(check);
+        return NULL;
+    }
+    if (pthread_create(&check->thread, NULL, runCheck, check)) {
+        close_event(check);
+        free(check);
+        return NULL;
+    }
+    return check;
+}
+
+/**
+ * Start checking file on a background thread. The optional cb is called from
+ * that thread. Return NULL if the file can't be opened or no thread started.
+ */
+struct isomd5sum_check *mediaCheckStartFile(const char *file, checkCallback cb, void *cbdata) {
+    int isofd = open(file, O_RDONLY | O_BINARY | O_CLOEXEC);
+    if (isofd < 0)
+        return NULL;
+    struct isomd5sum_check *const check = start(isofd, true, cb, cbdata);
+    if (check == NULL)
+        close(isofd);
+    return check;
+}
+
+/* Like mediaCheckStartFile, isofd must stay open until the check is released. */
+struct isomd5sum_check *mediaCheckStartFD(int isofd, checkCallback cb, void *cbdata) {
+    return start(isofd, false, cb, cbdata);
+}
+
+/**
+ * Store the latest progress in offset and total if given. Return non-zero
+ * while the check is running.
+ */
+int mediaCheckProgress(struct isomd5sum_check *check, long long *offset, long long *total) {
+    if (offset)
+        *offset = atomic_load_explicit(&check->offset, memory_order_relaxed);
+    if (total)
+        *total = atomic_load_explicit(&check->total, memory_order_relaxed);
+    return !atomic_load(&check->done);
+}
+
+/**
+ * Wait up to timeout milliseconds, or forever for a negative timeout, for the
+ * check to finish. Return its result, ISOMD5SUM_CHECK_RUNNING if it is still
+ * running or ISOMD5SUM_CHECK_WAIT_ERROR if polling failed.
+ */
+int mediaCheckWait(struct isomd5sum_check *check, int timeout) {
+    struct pollfd event = { .fd = check->eventfd, .events = POLLIN };
+    while (!atomic_load(&check->done)) {
+        const int rc = poll(&event, 1, timeout);
+        if (rc == 0)
+            return ISOMD5SUM_CHECK_RUNNING;
+        if (rc < 0 && errno != EINTR)
+            return ISOMD5SUM_CHECK_WAIT_ERROR;
+    }
+    return atomic_load(&check->result);
+}
+
+/* Ask the check to stop, safe to call from any thread. */
+void mediaCheckCancel(struct isomd5sum_check *check) {
+    atomic_store_explicit(&check->cancelled, 1, memory_order_relaxed);
+}
+
+/* Return a descriptor that becomes readable once the check is done. */
+int mediaCheckEventFD(struct isomd5sum_check *check) {
+    return check->eventfd;
+}
+
+/**
+ * Cancel the check if it is still running, wait for it and free it. Return
+ * its result.
+ */
+int mediaCheckRelease(struct isomd5sum_check *check) {
+    if (check == NULL)
+        return ISOMD5SUM_CHECK_ABORTED;
+    mediaCheckCancel(check);
+    pthread_join(check->thread, NULL);
+    const int rc = atomic_load(&check->result);
+    close_event(check);
+    if (check->owns_fd)
+        close(check->isofd);
+    free(check);
+    return rc;
+}
+
+#endif /* _WIN32 */
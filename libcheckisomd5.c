@@ -21,9 +21,11 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #ifdef _WIN32
 #include "win32_compat.h"
@@ -36,27 +38,26 @@
 
 #include "md5.h"
 #include "libcheckisomd5.h"
+#include "probes.h"
+#include "protocol.h"
 #include "utilities.h"
+#include "verity.h"
 
-static void clear_appdata(unsigned char *const buffer, const size_t size, const int64_t appdata_offset, const int64_t offset) {
-    static const int64_t buffer_start = 0;
-    const int64_t difference = appdata_offset - offset;
-    if (-APPDATA_SIZE <= difference && difference <= (int64_t) size) {
-        const size_t clear_start = (size_t) MAX(buffer_start, difference);
-        const size_t clear_len = MIN(size, (size_t)(difference + APPDATA_SIZE)) - clear_start;
-        memset(buffer + clear_start, ' ', clear_len);
-    }
-}
-
-static enum isomd5sum_status checkmd5sum(int isofd, checkCallback cb, void *cbdata) {
-    struct volume_info *const info = parsepvd(isofd);
-    if (info == NULL)
+static enum isomd5sum_status checkmd5sum(struct isomd5sum_context *const ctx, int isofd,
+                                         checkCallback cb, void *cbdata) {
+    if (!load_volume_info(ctx, isofd))
         return ISOMD5SUM_CHECK_NOT_FOUND;
+    /* The next check on this context is for another image. */
+    ctx->loaded = false;
+    const struct volume_info *const info = &ctx->info;
 
     const int64_t total_size = info->isosize - info->skipsectors * SECTOR_SIZE;
     const int64_t fragment_size = total_size / (info->fragmentcount + 1);
+    ctx->profile.fragment_size = fragment_size;
+    PROBE1(check__start, total_size);
     if (cb)
         cb(cbdata, 0LL, (long long) total_size);
+    ctx->progress_due = monotonic_ns() + ctx->progress_interval;
 
     /* Rewind, compute md5sum. */
     lseek(isofd, 0LL, SEEK_SET);
@@ -64,17 +65,17 @@ static enum isomd5sum_status checkmd5sum(int isofd, checkCallback cb, void *cbda
     MD5_CTX hashctx;
     MD5_Init(&hashctx);
 
-    const size_t buffer_size = NUM_SYSTEM_SECTORS * SECTOR_SIZE;
+    const size_t buffer_size = READ_BUFFER_SIZE;
     unsigned char *buffer;
-    buffer = aligned_alloc((size_t) getpagesize(), buffer_size * sizeof(*buffer));
 
     size_t previous_fragment = 0UL;
     int64_t offset = 0LL;
-    
+    enum isomd5sum_status rc = ISOMD5SUM_CHECK_RUNNING;
+
     while (offset < total_size) {
         const size_t nbyte = MIN((size_t)(total_size - offset), buffer_size);
 
-        ssize_t nread = read(isofd, buffer, nbyte);
+        ssize_t nread = context_read(ctx, isofd, offset, nbyte, &buffer);
         
         if (nread <= 0L) {
             break;
@@ -89,34 +90,48 @@ static enum isomd5sum_status checkmd5sum(int isofd, checkCallback cb, void *cbda
             nread = nbyte;
             lseek(isofd, offset + nread, SEEK_SET);
         }
-        /* Make sure appdata which contains the md5sum is cleared. */
-        clear_appdata(buffer, nread, info->offset + APPDATA_OFFSET, offset);
+        /* Make sure appdata which contains the md5sum is cleared, once the
+         * digest of the raw bytes is done with them. */
+        const int64_t appdata_offset = info->offset + APPDATA_OFFSET;
+        if (appdata_offset < offset + nread && appdata_offset + APPDATA_SIZE > offset)
+            digest_wait(ctx->digest);
+        clear_appdata(buffer, nread, appdata_offset, offset);
 
+        int64_t start = stats_start(ctx);
         MD5_Update(&hashctx, buffer, (size_t) nread);
+        stats_stop(ctx, &ctx->stats.hash_ns, start);
         if (info->fragmentcount) {
             const size_t current_fragment = offset / fragment_size;
             const size_t fragmentsize = FRAGMENT_SUM_SIZE / info->fragmentcount;
             /* If we're onto the next fragment, calculate the previous sum and check. */
             if (current_fragment != previous_fragment) {
-                if (!validate_fragment(&hashctx, current_fragment, fragmentsize,
-                                       info->fragmentsums, NULL)) {
+                start = stats_start(ctx);
+                const bool valid = validate_fragment(&hashctx, current_fragment, fragmentsize,
+                                                     info->fragmentsums, NULL);
+                stats_stop(ctx, &ctx->stats.validate_ns, start);
+                PROBE2(fragment__done, current_fragment, valid);
+                if (!valid) {
                     /* Exit immediately if current fragment sum is incorrect */
-                    free(info);
-                    aligned_free(buffer);
-                    return ISOMD5SUM_CHECK_FAILED;
+                    rc = ISOMD5SUM_CHECK_FAILED;
+                    break;
                 }
                 previous_fragment = current_fragment;
             }
         }
         offset += nread;
-        if (cb)
-            if (cb(cbdata, (long long) offset, (long long) total_size)) {
-                free(info);
-                aligned_free(buffer);
-                return ISOMD5SUM_CHECK_ABORTED;
+        if (cb && progress_due(ctx)) {
+            start = stats_start(ctx);
+            const int abort = cb(cbdata, (long long) offset, (long long) total_size);
+            stats_stop(ctx, &ctx->stats.callback_ns, start);
+            if (abort) {
+                PROBE1(check__abort, offset);
+                rc = ISOMD5SUM_CHECK_ABORTED;
+                break;
             }
+        }
     }
-    aligned_free(buffer);
+    if (rc != ISOMD5SUM_CHECK_RUNNING)
+        return rc;
 
     if (cb)
         cb(cbdata, (long long) info->isosize, (long long) total_size);
@@ -125,42 +140,580 @@ static enum isomd5sum_status checkmd5sum(int isofd, checkCallback cb, void *cbda
     md5sum(hashsum, &hashctx);
 
     int failed = strcmp(info->hashsum, hashsum);
-    free(info);
     return failed ? ISOMD5SUM_CHECK_FAILED : ISOMD5SUM_CHECK_PASSED;
 }
 
+/**
+ * Check an image read from a pipe or another descriptor that can't seek. The
+ * hasher keeps the start of the image until it found the primary volume
+ * descriptor, so the image is read once from start to end. The rest of the
+ * stream is read too, so a writer also copying it elsewhere isn't cut off.
+ */
+static enum isomd5sum_status checkstream(struct isomd5sum_context *const ctx, const int isofd,
+                                         checkCallback cb, void *cbdata) {
+    struct isomd5sum_hasher *const hasher = isomd5sumHasherNew(ISOMD5SUM_HASHER_CHECK);
+    if (hasher == NULL)
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+
+    bool started = false;
+    bool hashing = true;
+    int64_t offset = 0LL;
+    enum isomd5sum_status rc = ISOMD5SUM_CHECK_RUNNING;
+    for (;;) {
+        unsigned char *data;
+        const ssize_t nread = context_read(ctx, isofd, offset, READ_BUFFER_SIZE, &data);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            break;
+        offset += nread;
+        if (!hashing)
+            continue;
+
+        int64_t start = stats_start(ctx);
+        isomd5sumHasherUpdate(hasher, data, (size_t) nread);
+        stats_stop(ctx, &ctx->stats.hash_ns, start);
+        long long hashed, total;
+        hashing = isomd5sumHasherProgress(hasher, &hashed, &total);
+        /* The total is known once the primary volume descriptor is in. */
+        if (total > 0)
+            ctx->profile.fragment_size = hasher->fragment_size;
+        if (cb == NULL || total == 0)
+            continue;
+        if (!started) {
+            PROBE1(check__start, total);
+            cb(cbdata, 0LL, total);
+            started = true;
+            ctx->progress_due = monotonic_ns() + ctx->progress_interval;
+        } else if (progress_due(ctx)) {
+            start = stats_start(ctx);
+            const int abort = cb(cbdata, hashed, total);
+            stats_stop(ctx, &ctx->stats.callback_ns, start);
+            if (abort) {
+                PROBE1(check__abort, hashed);
+                rc = ISOMD5SUM_CHECK_ABORTED;
+                break;
+            }
+        }
+    }
+    if (rc == ISOMD5SUM_CHECK_RUNNING) {
+        rc = mediaCheckHasher(hasher);
+        if (cb && started)
+            cb(cbdata, (long long) hasher->info.isosize, (long long) hasher->total_size);
+    }
+    isomd5sumHasherFree(hasher);
+    return rc;
+}
+
 int mediaCheckFile(const char *file, checkCallback cb, void *cbdata) {
     int isofd = open(file, O_RDONLY | O_BINARY);
     if (isofd < 0) {
         return ISOMD5SUM_FILE_NOT_FOUND;
     }
-    int rc = checkmd5sum(isofd, cb, cbdata);
+    int rc = mediaCheckFD(isofd, cb, cbdata);
     close(isofd);
     return rc;
 }
 
 int mediaCheckFD(int isofd, checkCallback cb, void *cbdata) {
-    return checkmd5sum(isofd, cb, cbdata);
+    struct isomd5sum_context *const ctx = isomd5sumContextNew();
+    if (ctx == NULL)
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    int rc = mediaCheckContext(ctx, isofd, cb, cbdata);
+    isomd5sumContextFree(ctx);
+    return rc;
 }
 
-int printMD5SUM(const char *file) {
+/**
+ * Like mediaCheckFile, but hand the check to isomd5d if it is running, so
+ * concurrent checks of the same image share one pass over it.
+ */
+int mediaCheckFileDaemon(const char *file, checkCallback cb, void *cbdata) {
+#ifndef _WIN32
+    const int sock = daemon_connect();
+    if (sock >= 0) {
+        const int isofd = open(file, O_RDONLY | O_BINARY | O_CLOEXEC);
+        if (isofd < 0) {
+            close(sock);
+            return ISOMD5SUM_FILE_NOT_FOUND;
+        }
+        const bool sent = send_request(sock, "CHECK", isofd);
+        close(isofd);
+        if (sent) {
+            int rc;
+            if (!read_result(sock, cb, cbdata, &rc, NULL, 0))
+                rc = ISOMD5SUM_CHECK_ABORTED;
+            close(sock);
+            return rc;
+        }
+        close(sock);
+    }
+#endif
+    return mediaCheckFile(file, cb, cbdata);
+}
+
+/**
+ * Check isofd using the buffers of ctx. Volume info loaded for isofd with
+ * mediaLoadContext is used instead of parsing it again.
+ */
+int mediaCheckContext(struct isomd5sum_context *ctx, int isofd, checkCallback cb, void *cbdata) {
+    throttle_begin(&ctx->throttle);
+    stats_begin(ctx);
+    metrics_begin(ctx);
+    digest_begin(ctx);
+    /* Pipes can't seek back to the start after the volume descriptors. */
+    const bool stream = lseek(isofd, 0LL, SEEK_CUR) < 0 && errno == ESPIPE;
+    int rc = stream ? checkstream(ctx, isofd, cb, cbdata) : checkmd5sum(ctx, isofd, cb, cbdata);
+    PROBE1(check__done, rc);
+    digest_end(ctx, isofd, rc);
+    stats_end(ctx);
+    metrics_run(ctx, isofd, metrics_status(rc));
+    throttle_end(&ctx->throttle);
+    return rc;
+}
+
+/* Parse the volume info of isofd into ctx for the next check or print. */
+int mediaLoadContext(struct isomd5sum_context *ctx, int isofd) {
+    ctx->loaded = false;
+    return load_volume_info(ctx, isofd) ? 0 : ISOMD5SUM_CHECK_NOT_FOUND;
+}
+
+/**
+ * Return the result of checking the image passed to hasher, which has to be
+ * in ISOMD5SUM_HASHER_CHECK mode. An image that ended early fails.
+ */
+int mediaCheckHasher(struct isomd5sum_hasher *hasher) {
+    if (hasher->status != ISOMD5SUM_CHECK_RUNNING)
+        return hasher->status;
+    if (!hasher->loaded)
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    char hashsum[HASH_SIZE + 1];
+    if (!hasher_md5sum(hasher, hashsum))
+        return ISOMD5SUM_CHECK_FAILED;
+    return strcmp(hasher->info.hashsum, hashsum) ? ISOMD5SUM_CHECK_FAILED : ISOMD5SUM_CHECK_PASSED;
+}
+
+/**
+ * Check an image of size bytes held in memory, calling cb like mediaCheckFD.
+ */
+int mediaCheckBuffer(const void *buffer, size_t size, checkCallback cb, void *cbdata) {
+    const struct iovec iov = { (void *) buffer, size };
+    return mediaCheckIOV(&iov, 1, cb, cbdata);
+}
+
+/**
+ * Check an image held in memory as the iovcnt segments in iov, in order from
+ * its start, calling cb like mediaCheckFD. The segments are hashed where they
+ * are, the image is never assembled.
+ */
+int mediaCheckIOV(const struct iovec *iov, int iovcnt, checkCallback cb, void *cbdata) {
+    struct isomd5sum_hasher *const hasher = isomd5sumHasherNew(ISOMD5SUM_HASHER_CHECK);
+    if (hasher == NULL)
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+
+    bool started = false;
+    int64_t due = 0;
+    int rc = ISOMD5SUM_CHECK_RUNNING;
+    for (int i = 0; i < iovcnt && rc == ISOMD5SUM_CHECK_RUNNING; i++) {
+        const unsigned char *const bytes = iov[i].iov_base;
+        const size_t size = iov[i].iov_len;
+        for (size_t offset = 0; offset < size && rc == ISOMD5SUM_CHECK_RUNNING;) {
+            const size_t len = MIN(size - offset, READ_BUFFER_SIZE);
+            rc = isomd5sumHasherUpdate(hasher, bytes + offset, len);
+            offset += len;
+            /* The total is known once the primary volume descriptor is in. */
+            if (cb == NULL || !hasher->loaded)
+                continue;
+            if (!started) {
+                cb(cbdata, 0LL, (long long) hasher->total_size);
+                started = true;
+                due = monotonic_ns() + PROGRESS_INTERVAL_NS;
+            } else if (monotonic_ns() >= due) {
+                due = monotonic_ns() + PROGRESS_INTERVAL_NS;
+                if (cb(cbdata, (long long) hasher->offset, (long long) hasher->total_size))
+                    rc = ISOMD5SUM_CHECK_ABORTED;
+            }
+        }
+    }
+    if (rc == ISOMD5SUM_CHECK_RUNNING) {
+        if (cb && hasher->loaded)
+            cb(cbdata, (long long) hasher->info.isosize, (long long) hasher->total_size);
+        rc = mediaCheckHasher(hasher);
+    }
+    isomd5sumHasherFree(hasher);
+    return rc;
+}
+
+/* Report a finished fragment region and start the next one. */
+static int report_fragment(struct isomd5sum_region *const region, const int64_t end,
+                           bool *const chain_valid, const bool valid, regionCallback cb, void *cbdata) {
+    region->length = end - region->offset;
+    if (region->status != ISOMD5SUM_REGION_READ_ERROR) {
+        if (!*chain_valid)
+            region->status = ISOMD5SUM_REGION_UNVERIFIED;
+        else if (!valid)
+            region->status = ISOMD5SUM_REGION_BAD_SUM;
+    }
+    *chain_valid = *chain_valid && valid && region->status == ISOMD5SUM_REGION_OK;
+    int rc = cb ? cb(cbdata, region) : 0;
+    region->fragment++;
+    region->status = ISOMD5SUM_REGION_OK;
+    region->offset = end;
+    region->seconds = 0.0;
+    return rc;
+}
+
+static int report_read_error(struct isomd5sum_region *const error, regionCallback cb, void *cbdata) {
+    int rc = 0;
+    if (error->length > 0 && cb)
+        rc = cb(cbdata, error);
+    error->length = 0;
+    return rc;
+}
+
+static enum isomd5sum_status diagnosemd5sum(struct isomd5sum_context *const ctx, int isofd,
+                                            regionCallback cb, void *cbdata) {
+    if (!load_volume_info(ctx, isofd))
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    ctx->loaded = false;
+    const struct volume_info *const info = &ctx->info;
+
+    const int64_t total_size = info->isosize - info->skipsectors * SECTOR_SIZE;
+    const int64_t fragment_size = total_size / (info->fragmentcount + 1);
+
+    PROBE1(diagnose__start, total_size);
+#ifdef POSIX_FADV_RANDOM
+    /* Keep readahead from running into damaged sectors beyond each request. */
+    posix_fadvise(isofd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+    lseek(isofd, 0LL, SEEK_SET);
+
+    MD5_CTX hashctx;
+    MD5_Init(&hashctx);
+
+    const size_t buffer_size = READ_BUFFER_SIZE;
+    unsigned char *const buffer = ctx->buffer;
+
+    struct isomd5sum_region fragment = { .fragment = 1, .status = ISOMD5SUM_REGION_OK };
+    struct isomd5sum_region error = { .fragment = 0, .status = ISOMD5SUM_REGION_READ_ERROR };
+    bool chain_valid = true;
+    bool aborted = false;
+    size_t previous_fragment = 0UL;
+    int64_t offset = 0LL;
+
+    while (offset < total_size && !aborted) {
+        const size_t nbyte = MIN((size_t)(total_size - offset), buffer_size);
+
+        /* Waiting for the rate limit doesn't count as reading time. */
+        throttle_wait(&ctx->throttle, nbyte);
+        const int64_t start = monotonic_ns();
+        PROBE2(read__start, offset, nbyte);
+        ssize_t nread = read(isofd, buffer, nbyte);
+        PROBE2(read__done, offset, nread);
+        throttle_account(&ctx->throttle, monotonic_ns() - start);
+        const double seconds = (double) (monotonic_ns() - start) / 1e9;
+        fragment.seconds += seconds;
+
+        if (nread < 0L) {
+            /**
+             * Skip the whole request instead of narrowing it down sector by
+             * sector, which would make the kernel retry every bad sector.
+             * The unread bytes are hashed as zeroes.
+             */
+            if (error.length == 0)
+                error.offset = offset;
+            error.length += (long long) nbyte;
+            error.seconds += seconds;
+            fragment.status = ISOMD5SUM_REGION_READ_ERROR;
+            memset(buffer, 0, nbyte);
+            nread = (ssize_t) nbyte;
+            if (lseek(isofd, offset + nread, SEEK_SET) == -1)
+                break;
+        } else if (nread == 0L) {
+            /* Truncated image, the rest is missing. */
+            error.offset = error.length ? error.offset : offset;
+            error.length += total_size - offset;
+            fragment.status = ISOMD5SUM_REGION_READ_ERROR;
+            break;
+        } else {
+            if (nread > nbyte) {
+                nread = nbyte;
+                lseek(isofd, offset + nread, SEEK_SET);
+            }
+            aborted = report_read_error(&error, cb, cbdata);
+        }
+        clear_appdata(buffer, nread, info->offset + APPDATA_OFFSET, offset);
+
+        MD5_Update(&hashctx, buffer, (size_t) nread);
+        if (info->fragmentcount) {
+            const size_t current_fragment = offset / fragment_size;
+            const size_t fragmentsize = FRAGMENT_SUM_SIZE / info->fragmentcount;
+            if (current_fragment != previous_fragment) {
+                const bool valid = validate_fragment(&hashctx, current_fragment, fragmentsize,
+                                                     info->fragmentsums, NULL);
+                PROBE2(fragment__done, current_fragment, valid);
+                if (report_fragment(&fragment, offset + nread, &chain_valid, valid, cb, cbdata))
+                    aborted = true;
+                previous_fragment = current_fragment;
+            }
+        }
+        offset += nread;
+    }
+    if (report_read_error(&error, cb, cbdata))
+        aborted = true;
+
+    char hashsum[HASH_SIZE + 1];
+    md5sum(hashsum, &hashctx);
+    const bool valid = offset == total_size && strcmp(info->hashsum, hashsum) == 0;
+    if (aborted)
+        return ISOMD5SUM_CHECK_ABORTED;
+
+    /* The last region is only covered by the md5sum of the whole image. */
+    if (report_fragment(&fragment, total_size, &chain_valid, valid, cb, cbdata))
+        return ISOMD5SUM_CHECK_ABORTED;
+    return chain_valid ? ISOMD5SUM_CHECK_PASSED : ISOMD5SUM_CHECK_FAILED;
+}
+
+int mediaDiagnoseFile(const char *file, regionCallback cb, void *cbdata) {
     int isofd = open(file, O_RDONLY | O_BINARY);
     if (isofd < 0) {
         return ISOMD5SUM_FILE_NOT_FOUND;
     }
-    struct volume_info *const info = parsepvd(isofd);
+    int rc = mediaDiagnoseFD(isofd, cb, cbdata);
     close(isofd);
-    if (info == NULL) {
+    return rc;
+}
+
+int mediaDiagnoseFD(int isofd, regionCallback cb, void *cbdata) {
+    struct isomd5sum_context *const ctx = isomd5sumContextNew();
+    if (ctx == NULL)
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    int rc = mediaDiagnoseContext(ctx, isofd, cb, cbdata);
+    isomd5sumContextFree(ctx);
+    return rc;
+}
+
+int mediaDiagnoseContext(struct isomd5sum_context *ctx, int isofd, regionCallback cb, void *cbdata) {
+    throttle_begin(&ctx->throttle);
+    int rc = diagnosemd5sum(ctx, isofd, cb, cbdata);
+    PROBE1(diagnose__done, rc);
+    throttle_end(&ctx->throttle);
+    return rc;
+}
+
+struct manifestCheck {
+    const char *patterns;
+    struct iso_file *files;
+    size_t count;
+    size_t capacity;
+};
+
+/* Match path against a comma separated list of patterns. */
+static bool matches_any(const char *patterns, const char *const path) {
+    while (*patterns) {
+        const size_t len = strcspn(patterns, ",");
+        char pattern[ISO_PATH_SIZE];
+        snprintf(pattern, sizeof(pattern), "%.*s", (int) len, patterns);
+        if (len > 0 && match_pattern(pattern, path))
+            return true;
+        patterns += len;
+        if (*patterns == ',')
+            patterns++;
+    }
+    return false;
+}
+
+static int collectFile(void *const co, const struct iso_file *const file) {
+    struct manifestCheck *const data = co;
+    if (!matches_any(data->patterns, file->path))
+        return 0;
+    if (data->count == data->capacity) {
+        const size_t capacity = data->capacity ? 2 * data->capacity : 16;
+        struct iso_file *const files = realloc(data->files, capacity * sizeof(*files));
+        if (files == NULL)
+            return -1;
+        data->files = files;
+        data->capacity = capacity;
+    }
+    data->files[data->count++] = *file;
+    return 0;
+}
+
+/**
+ * Read the whole manifest and check it against the md5sum implanted in the
+ * application data. Return the null terminated contents or NULL, setting
+ * mismatch if the manifest was read but its md5sum differs.
+ */
+static char *read_manifest(const char *const manifest, const char *const manifestsum, bool *const mismatch) {
+    *mismatch = false;
+    FILE *const input = fopen(manifest, "rb");
+    if (input == NULL)
+        return NULL;
+    char *contents = NULL;
+    long size;
+    if (fseek(input, 0L, SEEK_END) == 0 && (size = ftell(input)) >= 0 &&
+        fseek(input, 0L, SEEK_SET) == 0 && (contents = malloc((size_t) size + 1)) != NULL &&
+        fread(contents, 1, (size_t) size, input) == (size_t) size) {
+        contents[size] = '\0';
+        MD5_CTX hashctx;
+        MD5_Init(&hashctx);
+        MD5_Update(&hashctx, (const unsigned char *) contents, (unsigned) size);
+        char hashsum[HASH_SIZE + 1];
+        md5sum(hashsum, &hashctx);
+        if (strcmp(hashsum, manifestsum)) {
+            *mismatch = true;
+            free(contents);
+            contents = NULL;
+        }
+    } else {
+        free(contents);
+        contents = NULL;
+    }
+    fclose(input);
+    return contents;
+}
+
+/* Return the manifest line listing the md5sum of path or NULL. */
+static const char *manifest_sum(const char *line, const char *const path) {
+    const size_t pathlen = strlen(path);
+    for (const char *end; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+        if ((size_t)(end - line) == HASH_SIZE + 2 + pathlen &&
+            strncmp(line + HASH_SIZE + 2, path, pathlen) == 0)
+            return line;
+    }
+    return NULL;
+}
+
+static enum isomd5sum_status checkmanifest(struct isomd5sum_context *const ctx, int isofd, const char *manifest,
+                                           const char *patterns, checkCallback cb, void *cbdata) {
+    struct volume_info *const info = parsepvd(isofd);
+    if (info == NULL)
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    if (info->manifestsum[0] == '\0') {
+        free(info);
         return ISOMD5SUM_CHECK_NOT_FOUND;
     }
+    bool mismatch;
+    char *const contents = read_manifest(manifest, info->manifestsum, &mismatch);
+    free(info);
+    /* Only a manifest that is not the implanted one fails the image. */
+    if (contents == NULL)
+        return mismatch ? ISOMD5SUM_CHECK_FAILED : ISOMD5SUM_CHECK_NOT_FOUND;
+
+    struct manifestCheck data = { .patterns = patterns };
+    enum isomd5sum_status rc = ISOMD5SUM_CHECK_PASSED;
+    if (walk_iso_tree(isofd, collectFile, &data)) {
+        rc = ISOMD5SUM_CHECK_FAILED;
+    } else if (data.count == 0) {
+        rc = ISOMD5SUM_CHECK_NOT_FOUND;
+    }
+
+    long long total = 0LL;
+    for (size_t i = 0; i < data.count; i++)
+        total += data.files[i].size;
+    long long offset = 0LL;
+    if (rc == ISOMD5SUM_CHECK_PASSED && cb)
+        cb(cbdata, offset, total);
+
+    for (size_t i = 0; rc == ISOMD5SUM_CHECK_PASSED && i < data.count; i++) {
+        const struct iso_file *const file = data.files + i;
+        const char *const expected = manifest_sum(contents, file->path);
+        char hashsum[HASH_SIZE + 1];
+        if (expected == NULL || !md5sum_extent(ctx, isofd, file->offset, file->size, hashsum) ||
+            strncmp(expected, hashsum, HASH_SIZE)) {
+            rc = ISOMD5SUM_CHECK_FAILED;
+            break;
+        }
+        offset += file->size;
+        if (cb && cb(cbdata, offset, total))
+            rc = ISOMD5SUM_CHECK_ABORTED;
+    }
+    free(data.files);
+    free(contents);
+    return rc;
+}
 
+int mediaCheckManifestFile(const char *file, const char *manifest, const char *patterns,
+                           checkCallback cb, void *cbdata) {
+    int isofd = open(file, O_RDONLY | O_BINARY);
+    if (isofd < 0) {
+        return ISOMD5SUM_FILE_NOT_FOUND;
+    }
+    int rc = checkmanifest(NULL, isofd, manifest, patterns, cb, cbdata);
+    close(isofd);
+    return rc;
+}
+
+int mediaCheckManifestFD(int isofd, const char *manifest, const char *patterns,
+                         checkCallback cb, void *cbdata) {
+    return checkmanifest(NULL, isofd, manifest, patterns, cb, cbdata);
+}
+
+/* Check the files reading them with the buffer and rate limit of ctx. */
+int mediaCheckManifestContext(struct isomd5sum_context *ctx, int isofd, const char *manifest, const char *patterns,
+                              checkCallback cb, void *cbdata) {
+    throttle_begin(&ctx->throttle);
+    int rc = checkmanifest(ctx, isofd, manifest, patterns, cb, cbdata);
+    throttle_end(&ctx->throttle);
+    return rc;
+}
+
+static void print_volume_info(const char *const file, const struct volume_info *const info) {
     printf("%s:   %s\n", file, info->hashsum);
     if (strlen(info->fragmentsums) > 0 && info->fragmentcount > 0) {
         printf("Fragment sums: %s\n", info->fragmentsums);
         printf("Fragment count: %zu\n", info->fragmentcount);
         printf("Supported ISO: %s\n", info->supported ? "yes" : "no");
     }
+    if (strlen(info->manifestsum) > 0)
+        printf("File manifest: %s\n", info->manifestsum);
+    if (strlen(info->verityroot) > 0)
+        printf("Verity root: %s\n", info->verityroot);
     fflush(stdout);
+}
+
+int printMD5SUM(const char *file) {
+    int isofd = open(file, O_RDONLY | O_BINARY);
+    if (isofd < 0) {
+        return ISOMD5SUM_FILE_NOT_FOUND;
+    }
+    struct volume_info *const info = parsepvd(isofd);
+    close(isofd);
+    if (info == NULL) {
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    }
+    print_volume_info(file, info);
+    free(info);
+    return 0;
+}
+
+/* Print the volume info loaded into ctx under the name file. */
+int printMD5SUMContext(struct isomd5sum_context *ctx, const char *file) {
+    if (!ctx->loaded) {
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    }
+    print_volume_info(file, &ctx->info);
+    return 0;
+}
+
+/**
+ * Store the parameters of the dm-verity hash tree implanted with
+ * implantISOVerity in verity. Return ISOMD5SUM_CHECK_NOT_FOUND if the image
+ * has none.
+ */
+int mediaVerityInfo(int isofd, struct isomd5sum_verity *verity) {
+    struct volume_info *const info = parsepvd(isofd);
+    if (info == NULL || info->verityroot[0] == '\0') {
+        free(info);
+        return ISOMD5SUM_CHECK_NOT_FOUND;
+    }
+    memcpy(verity->root, info->verityroot, sizeof(verity->root));
+    memcpy(verity->salt, info->veritysalt, sizeof(verity->salt));
+    verity->data_offset = info->veritydata;
+    verity->data_blocks = info->verityblocks;
+    verity->hash_offset = info->verityhash;
+    verity->data_block_size = VERITY_DATA_BLOCK_SIZE;
+    verity->hash_block_size = VERITY_HASH_BLOCK_SIZE;
     free(info);
     return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef __LIBCHECKISOMD5_H__
 #define __LIBCHECKISOMD5_H__
 
+#include "libisomd5sum.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -10,16 +12,113 @@ enum isomd5sum_status {
     ISOMD5SUM_CHECK_NOT_FOUND = -1,
     ISOMD5SUM_CHECK_FAILED = 0,
     ISOMD5SUM_CHECK_PASSED = 1,
-    ISOMD5SUM_CHECK_ABORTED = 2
+    ISOMD5SUM_CHECK_ABORTED = 2,
+    ISOMD5SUM_CHECK_RUNNING = 3,
+    /* mediaCheckWait could not wait for the check, errno tells why. */
+    ISOMD5SUM_CHECK_WAIT_ERROR = 4
+};
+
+enum isomd5sum_region_status {
+    ISOMD5SUM_REGION_OK = 0,
+    ISOMD5SUM_REGION_BAD_SUM = 1,
+    ISOMD5SUM_REGION_READ_ERROR = 2,
+    /* Fragment sums chain from the start, so after a bad region the
+     * following fragments can't be verified on their own. */
+    ISOMD5SUM_REGION_UNVERIFIED = 3
+};
+
+struct isomd5sum_region {
+    int fragment;           /* Fragment number, 0 for an unreadable range */
+    enum isomd5sum_region_status status;
+    long long offset;
+    long long length;
+    double seconds;         /* Time spent reading the region */
+};
+
+struct isomd5sum_scan_result {
+    const char *path;
+    int error;              /* errno if the file could not be opened */
+    int implanted;          /* Non-zero if an implanted md5sum was found */
+    char hashsum[33];
+    char fragmentsums[61];
+    long long fragmentcount;
+    long long size;         /* Volume space size in bytes */
+    int supported;
+};
+
+/* dm-verity hash tree of the image, in the format version 1 with sha256. */
+struct isomd5sum_verity {
+    char root[65];
+    char salt[33];
+    long long data_offset;  /* Image offset of the first block under the tree */
+    long long data_blocks;
+    long long hash_offset;  /* Offset of the tree in the image, 0 if kept apart */
+    int data_block_size;
+    int hash_block_size;
 };
 
+struct isomd5sum_scan;
+struct isomd5sum_check;
+
 /* For non-zero return value, check is aborted. */
 typedef int (*checkCallback)(void *, long long offset, long long total);
+/* For non-zero return value, diagnosis is aborted. */
+typedef int (*regionCallback)(void *, const struct isomd5sum_region *region);
 
 int mediaCheckFile(const char *file, checkCallback cb, void *cbdata);
 int mediaCheckFD(int isofd, checkCallback cb, void *cbdata);
+/* Like mediaCheckFile, but run by isomd5d when it is listening. */
+int mediaCheckFileDaemon(const char *file, checkCallback cb, void *cbdata);
+/* Check using the buffers of ctx. Info loaded with mediaLoadContext for the
+ * same descriptor is used instead of parsing it again. */
+int mediaCheckContext(struct isomd5sum_context *ctx, int isofd, checkCallback cb, void *cbdata);
+int mediaLoadContext(struct isomd5sum_context *ctx, int isofd);
+/* Check the image at an http:// or https:// URL without storing it, fetching
+ * it with up to connections concurrent range requests. Without libcurl
+ * support every URL is reported as not found. */
+int mediaCheckURL(const char *url, int connections, checkCallback cb, void *cbdata);
+int mediaCheckBuffer(const void *buffer, size_t size, checkCallback cb, void *cbdata);
+/* Check an image passed as segments in order from its start, without
+ * assembling it. */
+int mediaCheckIOV(const struct iovec *iov, int iovcnt, checkCallback cb, void *cbdata);
+int mediaCheckHasher(struct isomd5sum_hasher *hasher);
+int printMD5SUMContext(struct isomd5sum_context *ctx, const char *file);
+/* Read the parameters of the hash tree implanted by implantISOVerity. */
+int mediaVerityInfo(int isofd, struct isomd5sum_verity *verity);
+/* Check only the files matching the comma separated shell patterns against
+ * the file manifest written by implantManifestFile. */
+int mediaCheckManifestFile(const char *file, const char *manifest, const char *patterns,
+                           checkCallback cb, void *cbdata);
+int mediaCheckManifestFD(int isofd, const char *manifest, const char *patterns,
+                         checkCallback cb, void *cbdata);
+int mediaCheckManifestContext(struct isomd5sum_context *ctx, int isofd, const char *manifest, const char *patterns,
+                              checkCallback cb, void *cbdata);
+/* Read the whole medium even after failures and report every fragment and
+ * every unreadable range through cb. */
+int mediaDiagnoseFile(const char *file, regionCallback cb, void *cbdata);
+int mediaDiagnoseFD(int isofd, regionCallback cb, void *cbdata);
+int mediaDiagnoseContext(struct isomd5sum_context *ctx, int isofd, regionCallback cb, void *cbdata);
 int printMD5SUM(const char *file);
 
+/* Run a check on a background thread. Progress can be polled, the check can
+ * be cancelled from any thread, and the event descriptor becomes readable
+ * once it is done so it can be added to a poll or epoll loop. Release waits
+ * for the check, cancelling it first if still running, and frees it. */
+struct isomd5sum_check *mediaCheckStartFile(const char *file, checkCallback cb, void *cbdata);
+struct isomd5sum_check *mediaCheckStartFD(int isofd, checkCallback cb, void *cbdata);
+int mediaCheckProgress(struct isomd5sum_check *check, long long *offset, long long *total);
+int mediaCheckWait(struct isomd5sum_check *check, int timeout);
+void mediaCheckCancel(struct isomd5sum_check *check);
+int mediaCheckEventFD(struct isomd5sum_check *check);
+int mediaCheckRelease(struct isomd5sum_check *check);
+
+/* Read the implanted md5sum information of every *.iso file below dir using
+ * the given number of threads. Results come in completion order and stay
+ * valid until the next call; NULL marks the end. */
+struct isomd5sum_scan *mediaScanOpen(const char *dir, int threads);
+const struct isomd5sum_scan_result *mediaScanNext(struct isomd5sum_scan *scan);
+void mediaScanClose(struct isomd5sum_scan *scan);
+
 #ifdef __cplusplus
 }
 #endif
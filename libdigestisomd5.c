@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * SHA-256 of the raw image bytes, as sha256sum computes it for published
+ * CHECKSUM files, taken from the buffers a check reads anyway. Every slice
+ * returned by context_read is handed to a second thread, which hashes it
+ * while the check computes the md5sum of the same slice. The buffer is only
+ * reused once the thread is done with it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "win32_compat.h"
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "libcheckisomd5.h"
+#include "sha256.h"
+#include "utilities.h"
+
+struct image_digest {
+    SHA256_CTX hashctx;
+    int64_t offset;         /* Bytes of the image hashed or being hashed */
+    bool running;           /* Set during a check */
+    bool broken;            /* Reads were not contiguous from the start */
+    bool complete;          /* Set once the whole image of the last check is in */
+    char hashsum[2 * SHA256_DIGEST_SIZE + 1];
+#ifndef _WIN32
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    const unsigned char *data;  /* Slice being hashed, NULL while idle */
+    size_t size;
+    bool quit;
+#endif
+};
+
+struct isomd5sum_sha256 {
+    SHA256_CTX hashctx;
+};
+
+/* Finalize hashctx into base 16 in hashsum. */
+static void sha256sum(char *const hashsum, SHA256_CTX *const hashctx) {
+    unsigned char sum[SHA256_DIGEST_SIZE];
+    SHA256_Final(sum, hashctx);
+    for (size_t i = 0; i < SHA256_DIGEST_SIZE; i++)
+        snprintf(hashsum + 2 * i, 3, "%02x", sum[i]);
+}
+
+#ifndef _WIN32
+static void *digest_thread(void *const arg) {
+    struct image_digest *const digest = arg;
+    pthread_mutex_lock(&digest->lock);
+    while (!digest->quit) {
+        if (digest->data == NULL) {
+            pthread_cond_wait(&digest->changed, &digest->lock);
+            continue;
+        }
+        const unsigned char *const data = digest->data;
+        const size_t size = digest->size;
+        pthread_mutex_unlock(&digest->lock);
+        SHA256_Update(&digest->hashctx, data, size);
+        pthread_mutex_lock(&digest->lock);
+        digest->data = NULL;
+        pthread_cond_broadcast(&digest->changed);
+    }
+    pthread_mutex_unlock(&digest->lock);
+    return NULL;
+}
+#endif
+
+static struct image_digest *digest_new(void) {
+    struct image_digest *const digest = calloc(1, sizeof(*digest));
+    if (digest == NULL)
+        return NULL;
+#ifndef _WIN32
+    pthread_mutex_init(&digest->lock, NULL);
+    pthread_cond_init(&digest->changed, NULL);
+    if (pthread_create(&digest->thread, NULL, digest_thread, digest)) {
+        pthread_cond_destroy(&digest->changed);
+        pthread_mutex_destroy(&digest->lock);
+        free(digest);
+        return NULL;
+    }
+#endif
+    return digest;
+}
+
+void digest_free(struct image_digest *const digest) {
+    if (digest == NULL)
+        return;
+#ifndef _WIN32
+    pthread_mutex_lock(&digest->lock);
+    digest->quit = true;
+    pthread_cond_broadcast(&digest->changed);
+    pthread_mutex_unlock(&digest->lock);
+    pthread_join(digest->thread, NULL);
+    pthread_cond_destroy(&digest->changed);
+    pthread_mutex_destroy(&digest->lock);
+#endif
+    free(digest);
+}
+
+/* Wait until the slice handed over last is hashed and its buffer free. */
+void digest_wait(struct image_digest *const digest) {
+#ifndef _WIN32
+    if (digest == NULL)
+        return;
+    pthread_mutex_lock(&digest->lock);
+    while (digest->data != NULL)
+        pthread_cond_wait(&digest->changed, &digest->lock);
+    pthread_mutex_unlock(&digest->lock);
+#else
+    (void) digest;
+#endif
+}
+
+/**
+ * Hash the size bytes of the image at offset in data, which have to stay
+ * unchanged until digest_wait returns. Bytes not following the ones before
+ * leave the digest incomplete.
+ */
+void digest_update(struct image_digest *const digest, const int64_t offset,
+                   const unsigned char *const data, const size_t size) {
+    if (digest == NULL || !digest->running || digest->broken || size == 0)
+        return;
+    if (offset != digest->offset) {
+        digest->broken = true;
+        return;
+    }
+    digest->offset += (int64_t) size;
+#ifndef _WIN32
+    pthread_mutex_lock(&digest->lock);
+    while (digest->data != NULL)
+        pthread_cond_wait(&digest->changed, &digest->lock);
+    digest->data = data;
+    digest->size = size;
+    pthread_cond_broadcast(&digest->changed);
+    pthread_mutex_unlock(&digest->lock);
+#else
+    /* Without threads the digest is computed in line. */
+    SHA256_Update(&digest->hashctx, data, size);
+#endif
+}
+
+void digest_begin(struct isomd5sum_context *const ctx) {
+    struct image_digest *const digest = ctx->digest;
+    if (digest == NULL)
+        return;
+    digest_wait(digest);
+    SHA256_Init(&digest->hashctx);
+    digest->offset = 0;
+    digest->running = true;
+    digest->broken = false;
+    digest->complete = false;
+    digest->hashsum[0] = '\0';
+}
+
+/*
+ * Size of the image as sha256sum sees it: the file size, or the volume size
+ * for block devices, which are larger than the image written to them.
+ */
+static int64_t digest_size(struct isomd5sum_context *const ctx, const int isofd) {
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(isofd, &st) == 0 && S_ISREG(st.st_mode))
+        return st.st_size;
+#endif
+    int64_t pvd_offset;
+    const int64_t isosize = primary_volume_size(isofd, ctx->descriptors, &pvd_offset);
+    return isosize > 0 ? isosize : INT64_MAX;
+}
+
+/*
+ * Whether the check that returned status read all the sectors it sums. A
+ * wrong md5sum is only known once they are, a wrong fragment sum before.
+ */
+static bool digest_summed(const struct isomd5sum_context *const ctx, const int status) {
+    if (status == ISOMD5SUM_CHECK_PASSED || status == ISOMD5SUM_CHECK_NOT_FOUND)
+        return true;
+    if (status != ISOMD5SUM_CHECK_FAILED)
+        return false;
+    const struct volume_info *const info = &ctx->info;
+    return ctx->digest->offset >= info->isosize - info->skipsectors * SECTOR_SIZE;
+}
+
+/**
+ * Finish the digest of the check that returned status. The part of the image
+ * the check did not need, past the summed sectors, is read here, whatever the
+ * md5sum said. Checks that failed early or were aborted leave the digest
+ * incomplete.
+ */
+void digest_end(struct isomd5sum_context *const ctx, const int isofd, const int status) {
+    struct image_digest *const digest = ctx->digest;
+    if (digest == NULL || !digest->running)
+        return;
+    /* Checks of streams read them to their end anyway. */
+    const bool stream = lseek(isofd, 0LL, SEEK_CUR) < 0 && errno == ESPIPE;
+    if (stream) {
+        digest->complete = !digest->broken && status != ISOMD5SUM_CHECK_ABORTED;
+    } else if (!digest->broken && digest_summed(ctx, status)) {
+        const int64_t end = digest_size(ctx, isofd);
+        const struct read_ahead *const ahead = &ctx->ahead;
+        /* Reads go on from the current position unless the read-ahead holds them. */
+        if (digest->offset < ahead->offset || digest->offset >= ahead->offset + (int64_t) ahead->size)
+            lseek(isofd, digest->offset, SEEK_SET);
+        while (digest->offset < end && !digest->broken) {
+            unsigned char *data;
+            const size_t nbyte = (size_t) MIN(end - digest->offset, READ_BUFFER_SIZE);
+            const ssize_t nread = context_read(ctx, isofd, digest->offset, nbyte, &data);
+            if (nread < 0 && errno == EINTR)
+                continue;
+            if (nread <= 0)
+                break;
+        }
+        digest_wait(digest);
+        /* Past the end of a block device, only the volume size counts. */
+        digest->complete = !digest->broken && (digest->offset == end || end == INT64_MAX);
+    }
+    digest_wait(digest);
+    digest->running = false;
+    if (digest->complete)
+        sha256sum(digest->hashsum, &digest->hashctx);
+}
+
+int isomd5sumContextEnableSha256(struct isomd5sum_context *ctx, int enable) {
+    if (!enable) {
+        digest_free(ctx->digest);
+        ctx->digest = NULL;
+    } else if (ctx->digest == NULL && (ctx->digest = digest_new()) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+int isomd5sumContextSha256(struct isomd5sum_context *ctx, char *hashsum) {
+    if (ctx->digest == NULL || !ctx->digest->complete)
+        return 0;
+    memcpy(hashsum, ctx->digest->hashsum, sizeof(ctx->digest->hashsum));
+    return 1;
+}
+
+struct isomd5sum_sha256 *isomd5sumSha256New(void) {
+    struct isomd5sum_sha256 *const sha256 = malloc(sizeof(*sha256));
+    if (sha256 != NULL)
+        SHA256_Init(&sha256->hashctx);
+    return sha256;
+}
+
+void isomd5sumSha256Free(struct isomd5sum_sha256 *sha256) {
+    free(sha256);
+}
+
+void isomd5sumSha256Update(struct isomd5sum_sha256 *sha256, const void *data, size_t size) {
+    SHA256_Update(&sha256->hashctx, data, size);
+}
+
+void isomd5sumSha256Hashsum(struct isomd5sum_sha256 *sha256, char *hashsum) {
+    /* Finalize a copy, so more data can follow. */
+    SHA256_CTX hashctx;
+    memcpy(&hashctx, &sha256->hashctx, sizeof(hashctx));
+    sha256sum(hashsum, &hashctx);
+}
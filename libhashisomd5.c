@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "md5.h"
+#include "libcheckisomd5.h"
+#include "utilities.h"
+
+/* Images have a handful of volume descriptors, give up on finding the
+ * primary one after this many bytes. */
+#define MAX_HEAD_SIZE (SYSTEM_AREA_SIZE + 256 * SECTOR_SIZE)
+
+struct isomd5sum_hasher *isomd5sumHasherNew(int mode) {
+    struct isomd5sum_hasher *const hasher = calloc(1, sizeof(*hasher));
+    if (hasher == NULL)
+        return NULL;
+    hasher->mode = mode;
+    hasher->status = ISOMD5SUM_CHECK_RUNNING;
+    MD5_Init(&hasher->hashctx);
+    return hasher;
+}
+
+void isomd5sumHasherFree(struct isomd5sum_hasher *hasher) {
+    if (hasher == NULL)
+        return;
+    free(hasher->head);
+    free(hasher);
+}
+
+/*
+ * Hash len bytes at the current offset where they are, with the part of the
+ * appdata among them hashed as spaces as it was when the md5sum was computed.
+ */
+static void hash_piece(struct isomd5sum_hasher *const hasher, const unsigned char *data, size_t len) {
+    const int64_t appdata_offset = hasher->info.offset + APPDATA_OFFSET;
+    const int64_t offset = hasher->offset;
+    hasher->offset += (int64_t) len;
+    if (appdata_offset >= offset + (int64_t) len || appdata_offset + APPDATA_SIZE <= offset) {
+        MD5_Update(&hasher->hashctx, data, (unsigned) len);
+        return;
+    }
+
+    const size_t before = (size_t) MAX(appdata_offset - offset, 0);
+    const size_t blanks = (size_t) (MIN(appdata_offset + APPDATA_SIZE, offset + (int64_t) len) - offset) - before;
+    unsigned char spaces[APPDATA_SIZE];
+    memset(spaces, ' ', blanks);
+    MD5_Update(&hasher->hashctx, data, (unsigned) before);
+    MD5_Update(&hasher->hashctx, spaces, (unsigned) blanks);
+    MD5_Update(&hasher->hashctx, data + before + blanks, (unsigned) (len - before - blanks));
+}
+
+/**
+ * Compute or verify the fragment sum due after the block starting at start,
+ * the same way the check and implant loops do after a read.
+ */
+static void finish_block(struct isomd5sum_hasher *const hasher, const int64_t start) {
+    const struct volume_info *const info = &hasher->info;
+    if (!info->fragmentcount || hasher->fragment_size <= 0 || (hasher->mode & ISOMD5SUM_HASHER_NO_FRAGMENTS))
+        return;
+    const size_t current_fragment = start / hasher->fragment_size;
+    const size_t fragmentsize = FRAGMENT_SUM_SIZE / info->fragmentcount;
+    if (current_fragment != hasher->previous_fragment) {
+        if (hasher->mode & ISOMD5SUM_HASHER_IMPLANT)
+            validate_fragment(&hasher->hashctx, current_fragment, fragmentsize, NULL, hasher->fragmentsums);
+        else if (!validate_fragment(&hasher->hashctx, current_fragment, fragmentsize, info->fragmentsums, NULL))
+            hasher->status = ISOMD5SUM_CHECK_FAILED;
+        hasher->previous_fragment = current_fragment;
+    }
+}
+
+/*
+ * Hash size bytes following the primary volume descriptor. They are hashed
+ * where they are, however the image is split, only the fragment sums follow
+ * the blocks of the read loops.
+ */
+static void hash_data(struct isomd5sum_hasher *const hasher, const unsigned char *data, size_t size) {
+    while (size > 0 && hasher->status == ISOMD5SUM_CHECK_RUNNING && hasher->offset < hasher->total_size) {
+        const int64_t start = hasher->offset - (int64_t) hasher->pending;
+        const size_t block = (size_t) MIN(hasher->total_size - start, READ_BUFFER_SIZE);
+        const size_t len = MIN(size, block - hasher->pending);
+        hash_piece(hasher, data, len);
+        hasher->pending += len;
+        data += len;
+        size -= len;
+        if (hasher->pending == block) {
+            hasher->pending = 0;
+            finish_block(hasher, start);
+        }
+    }
+}
+
+/* Parse the primary volume descriptor at offset in the head of the image. */
+static void load_head(struct isomd5sum_hasher *const hasher, const int64_t offset) {
+    struct volume_info *const info = &hasher->info;
+    const unsigned char *const pvd = hasher->head + offset;
+    if (hasher->mode & ISOMD5SUM_HASHER_IMPLANT) {
+        info->offset = offset;
+        info->isosize = isosize(pvd);
+        info->skipsectors = SKIPSECTORS;
+        info->fragmentcount = FRAGMENT_COUNT;
+        for (size_t i = 0; i < APPDATA_SIZE; i++)
+            hasher->appdata_used |= pvd[APPDATA_OFFSET + i] != ' ';
+    } else if (!parse_volume_info(pvd, offset, info)) {
+        hasher->status = ISOMD5SUM_CHECK_NOT_FOUND;
+        return;
+    }
+    hasher->total_size = info->isosize - info->skipsectors * SECTOR_SIZE;
+    hasher->fragment_size = hasher->total_size / (int64_t) (info->fragmentcount + 1);
+    hasher->loaded = true;
+
+    unsigned char *const head = hasher->head;
+    hasher->head = NULL;
+    hash_data(hasher, head, hasher->head_size);
+    free(head);
+}
+
+/**
+ * Keep the start of the image up to the next sector boundary. Once the primary
+ * volume descriptor is complete the kept bytes are hashed. Return the number
+ * of bytes used.
+ */
+static size_t collect_head(struct isomd5sum_hasher *const hasher, const unsigned char *const data, const size_t size) {
+    const size_t wanted = MAX(SYSTEM_AREA_SIZE + SECTOR_SIZE, (hasher->head_size / SECTOR_SIZE + 1) * SECTOR_SIZE);
+    if (wanted > MAX_HEAD_SIZE) {
+        hasher->status = ISOMD5SUM_CHECK_NOT_FOUND;
+        return size;
+    }
+    unsigned char *const head = realloc(hasher->head, wanted);
+    if (head == NULL) {
+        hasher->status = ISOMD5SUM_CHECK_NOT_FOUND;
+        return size;
+    }
+    hasher->head = head;
+    const size_t len = MIN(size, wanted - hasher->head_size);
+    memcpy(head + hasher->head_size, data, len);
+    hasher->head_size += len;
+    if (hasher->head_size < wanted)
+        return len;
+
+    const int64_t offset = find_primary_volume_descriptor(head, hasher->head_size);
+    if (offset < 0)
+        hasher->status = ISOMD5SUM_CHECK_NOT_FOUND;
+    else if (offset > 0)
+        load_head(hasher, offset);
+    return len;
+}
+
+int isomd5sumHasherUpdate(struct isomd5sum_hasher *hasher, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    while (size > 0 && hasher->status == ISOMD5SUM_CHECK_RUNNING && !hasher->loaded) {
+        const size_t len = collect_head(hasher, bytes, size);
+        bytes += len;
+        size -= len;
+    }
+    if (hasher->loaded)
+        hash_data(hasher, bytes, size);
+    return hasher->status;
+}
+
+int isomd5sumHasherUpdateIOV(struct isomd5sum_hasher *hasher, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt && hasher->status == ISOMD5SUM_CHECK_RUNNING; i++)
+        isomd5sumHasherUpdate(hasher, iov[i].iov_base, iov[i].iov_len);
+    return hasher->status;
+}
+
+/**
+ * Finalize a copy of the md5sum of hasher into hashsum. Return false unless
+ * the whole image has been hashed.
+ */
+bool hasher_md5sum(const struct isomd5sum_hasher *const hasher, char *const hashsum) {
+    MD5_CTX hashctx;
+    memcpy(&hashctx, &hasher->hashctx, sizeof(hashctx));
+    md5sum(hashsum, &hashctx);
+    return hasher->loaded && hasher->offset == hasher->total_size;
+}
+
+int isomd5sumHasherProgress(struct isomd5sum_hasher *hasher, long long *offset, long long *total) {
+    if (offset)
+        *offset = (long long) (hasher->loaded ? hasher->offset : (int64_t) hasher->head_size);
+    if (total)
+        *total = (long long) (hasher->loaded ? hasher->total_size : 0);
+    return hasher->status == ISOMD5SUM_CHECK_RUNNING && !(hasher->loaded && hasher->offset == hasher->total_size);
+}
+
+int isomd5sumHasherMd5sum(struct isomd5sum_hasher *hasher, char *hashsum) {
+    return hasher_md5sum(hasher, hashsum);
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Check images served over HTTP or HTTPS without storing them. The start of
+ * the image is fetched with one range request to find the size of the
+ * summed part, the rest with several concurrent range requests. Ranges are
+ * hashed in order as they arrive: the oldest one goes straight into the
+ * hasher, later ones are held in a window of a few buffers until it is done.
+ * A server ignoring the Range header sends the whole image in the first
+ * response, which is then hashed as it streams in.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcheckisomd5.h"
+#include "utilities.h"
+
+#ifdef ISOMD5SUM_HAVE_HTTP
+
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+/* The first request covers the system area and the first descriptors. */
+#define PROBE_SIZE (SYSTEM_AREA_SIZE + 16 * SECTOR_SIZE)
+#define RANGE_SIZE (2 * 1024 * 1024)
+#define MAX_CONNECTIONS 16
+
+struct http_range {
+    struct http_check *check;
+    CURL *easy;
+    int64_t start;
+    size_t length;
+    size_t received;
+    size_t hashed;
+    unsigned char *buffer;
+    bool probe;         /* First request, which may be answered with the whole image */
+    bool running;
+    bool done;
+    bool failed;
+};
+
+struct http_check {
+    CURLM *multi;
+    struct isomd5sum_hasher *hasher;
+    struct http_range *ranges;  /* Ring of requested ranges, the oldest at head */
+    int window;
+    int connections;
+    int head;
+    int count;
+    int running;
+    int64_t next_offset;
+    bool ended;         /* No more ranges are requested, the image ended or failed */
+    bool unreachable;   /* The first request failed */
+};
+
+/* Return true while the hasher wants more of the image. */
+static bool wants_more(struct http_check *const check) {
+    return isomd5sumHasherProgress(check->hasher, NULL, NULL) != 0;
+}
+
+static bool is_head(const struct http_range *const range) {
+    return range == &range->check->ranges[range->check->head];
+}
+
+static size_t receive(char *const data, const size_t size, const size_t nmemb, void *const userdata) {
+    struct http_range *const range = userdata;
+    const size_t len = size * nmemb;
+
+    if (range->received == 0) {
+        long code = 0;
+        curl_easy_getinfo(range->easy, CURLINFO_RESPONSE_CODE, &code);
+        /* Only the first request may get the whole image. */
+        if (code != 206 && !(range->probe && code == 200))
+            return 0;
+        if (code == 200)
+            range->length = SIZE_MAX;
+    }
+    if (len > range->length - range->received)
+        return 0;
+
+    if (is_head(range) && range->hashed == range->received) {
+        /* Everything before this range is hashed, no need to keep it. */
+        isomd5sumHasherUpdate(range->check->hasher, data, len);
+        range->received += len;
+        range->hashed += len;
+        /* Stop a whole image response once the summed part is in. */
+        return wants_more(range->check) ? len : 0;
+    }
+    if (range->buffer == NULL && (range->buffer = malloc(RANGE_SIZE)) == NULL)
+        return 0;
+    memcpy(range->buffer + range->received, data, len);
+    range->received += len;
+    return len;
+}
+
+static bool request_range(struct http_check *const check, const char *const url, const int64_t start,
+                          const size_t length) {
+    struct http_range *const range = &check->ranges[(check->head + check->count) % check->window];
+    if (range->easy == NULL && (range->easy = curl_easy_init()) == NULL)
+        return false;
+
+    char bytes[64];
+    snprintf(bytes, sizeof(bytes), "%lld-%lld", (long long) start, (long long) start + (long long) length - 1);
+    curl_easy_reset(range->easy);
+    curl_easy_setopt(range->easy, CURLOPT_URL, url);
+    curl_easy_setopt(range->easy, CURLOPT_RANGE, bytes);
+    curl_easy_setopt(range->easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(range->easy, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(range->easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(range->easy, CURLOPT_WRITEFUNCTION, receive);
+    curl_easy_setopt(range->easy, CURLOPT_WRITEDATA, range);
+    curl_easy_setopt(range->easy, CURLOPT_PRIVATE, range);
+    if (curl_multi_add_handle(check->multi, range->easy) != CURLM_OK)
+        return false;
+
+    range->check = check;
+    range->start = start;
+    range->length = length;
+    range->received = 0;
+    range->hashed = 0;
+    range->probe = start == 0;
+    range->running = true;
+    range->done = false;
+    range->failed = false;
+    check->count++;
+    check->running++;
+    check->next_offset = start + (int64_t) length;
+    return true;
+}
+
+/* Request the next ranges while there are free connections and buffers. */
+static bool request_ranges(struct http_check *const check, const char *const url) {
+    long long total;
+    isomd5sumHasherProgress(check->hasher, NULL, &total);
+    while (!check->ended && check->count < check->window && check->running < check->connections) {
+        if (total == 0) {
+            /* Until the primary volume descriptor is in the size is unknown,
+             * fetch the start of the image one piece after another. */
+            if (check->count > 0)
+                break;
+            if (!request_range(check, url, check->next_offset, PROBE_SIZE))
+                return false;
+            continue;
+        }
+        if (check->next_offset >= total)
+            break;
+        if (!request_range(check, url, check->next_offset,
+                           (size_t) MIN(total - check->next_offset, RANGE_SIZE)))
+            return false;
+    }
+    return true;
+}
+
+static void finish_range(struct http_check *const check, CURL *const easy, const CURLcode result) {
+    struct http_range *range;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **) &range);
+    curl_multi_remove_handle(check->multi, easy);
+    range->running = false;
+    range->done = true;
+    check->running--;
+
+    /* A whole image response ends the image, and so does a short range. */
+    const bool whole = range->length == SIZE_MAX;
+    if (result != CURLE_OK && !(result == CURLE_WRITE_ERROR && whole && !wants_more(check))) {
+        range->failed = true;
+        if (range->probe && range->received == 0)
+            check->unreachable = true;
+    }
+    if (whole || range->failed || range->received < range->length)
+        check->ended = true;
+}
+
+/* Hash the buffered ranges which are next in order and free their slots. */
+static void hash_ranges(struct http_check *const check) {
+    while (check->count > 0) {
+        struct http_range *const range = &check->ranges[check->head];
+        if (range->hashed < range->received) {
+            isomd5sumHasherUpdate(check->hasher, range->buffer + range->hashed, range->received - range->hashed);
+            range->hashed = range->received;
+        }
+        if (!range->done)
+            return;
+        if (range->failed || range->received < range->length) {
+            /* Later ranges can't be hashed after a gap. */
+            check->ended = true;
+            return;
+        }
+        check->head = (check->head + 1) % check->window;
+        check->count--;
+    }
+}
+
+static void free_check(struct http_check *const check) {
+    for (int i = 0; check->ranges && i < check->window; i++) {
+        struct http_range *const range = &check->ranges[i];
+        if (range->running)
+            curl_multi_remove_handle(check->multi, range->easy);
+        if (range->easy)
+            curl_easy_cleanup(range->easy);
+        free(range->buffer);
+    }
+    free(check->ranges);
+    if (check->multi)
+        curl_multi_cleanup(check->multi);
+    isomd5sumHasherFree(check->hasher);
+}
+
+static int check_url(struct http_check *const check, const char *const url, checkCallback cb, void *cbdata) {
+    bool started = false;
+    int64_t due = 0;
+    while (wants_more(check)) {
+        if (!request_ranges(check, url))
+            return ISOMD5SUM_FILE_NOT_FOUND;
+        if (check->count == 0)
+            break;
+
+        int still_running;
+        if (curl_multi_perform(check->multi, &still_running) != CURLM_OK)
+            return ISOMD5SUM_FILE_NOT_FOUND;
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(check->multi, &left)) != NULL) {
+            if (msg->msg == CURLMSG_DONE)
+                finish_range(check, msg->easy_handle, msg->data.result);
+        }
+        hash_ranges(check);
+        if (check->unreachable)
+            return ISOMD5SUM_FILE_NOT_FOUND;
+        if (check->ended && (check->count == 0 || check->ranges[check->head].done))
+            break;
+
+        long long offset, total;
+        isomd5sumHasherProgress(check->hasher, &offset, &total);
+        if (cb && total > 0) {
+            if (!started) {
+                cb(cbdata, 0LL, total);
+                started = true;
+                due = monotonic_ns() + PROGRESS_INTERVAL_NS;
+            } else if (monotonic_ns() >= due) {
+                due = monotonic_ns() + PROGRESS_INTERVAL_NS;
+                if (cb(cbdata, offset, total))
+                    return ISOMD5SUM_CHECK_ABORTED;
+            }
+        }
+        if (wants_more(check) && still_running)
+            curl_multi_poll(check->multi, NULL, 0, 100, NULL);
+    }
+
+    const int rc = mediaCheckHasher(check->hasher);
+    if (cb && started)
+        cb(cbdata, (long long) check->hasher->info.isosize, (long long) check->hasher->total_size);
+    return rc;
+}
+
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+static CURLcode curl_init_result = CURLE_FAILED_INIT;
+
+static void init_curl(void) {
+    curl_init_result = curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+int mediaCheckURL(const char *url, int connections, checkCallback cb, void *cbdata) {
+    /* curl_global_init and curl_global_cleanup aren't thread safe, and other
+     * checks or the application may be using curl meanwhile. The global
+     * state is set up once and left for the process exit to clean up. */
+    pthread_once(&curl_once, init_curl);
+    if (curl_init_result != CURLE_OK)
+        return ISOMD5SUM_FILE_NOT_FOUND;
+
+    struct http_check check;
+    memset(&check, 0, sizeof(check));
+    check.connections = connections < 1 ? 1 : MIN(connections, MAX_CONNECTIONS);
+    /* Twice as many buffers as connections keep every connection busy while
+     * the oldest range is still arriving. */
+    check.window = 2 * check.connections;
+    check.multi = curl_multi_init();
+    check.hasher = isomd5sumHasherNew(ISOMD5SUM_HASHER_CHECK);
+    check.ranges = calloc((size_t) check.window, sizeof(*check.ranges));
+
+    int rc = ISOMD5SUM_CHECK_NOT_FOUND;
+    if (check.multi && check.hasher && check.ranges) {
+        curl_multi_setopt(check.multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) check.connections);
+        rc = check_url(&check, url, cb, cbdata);
+    }
+    free_check(&check);
+    return rc;
+}
+
+#else
+
+int mediaCheckURL(const char *url, int connections, checkCallback cb, void *cbdata) {
+    (void) url;
+    (void) connections;
+    (void) cb;
+    (void) cbdata;
+    return ISOMD5SUM_FILE_NOT_FOUND;
+}
+
+#endif
@@ -37,7 +37,21 @@
 
 #include "md5.h"
 #include "libimplantisomd5.h"
+#include "midstate.h"
+#include "probes.h"
+#include "protocol.h"
 #include "utilities.h"
+#include "verity.h"
+
+static const char appdata_trailer[] = "THIS IS NOT THE SAME AS RUNNING MD5SUM ON THIS ISO!!";
+static const char manifest_key[] = "FILE MANIFEST MD5SUM = ";
+
+struct manifestData {
+    int isofd;
+    FILE *output;
+    MD5_CTX hashctx;
+    int quiet;
+};
 
 static int writeAppData(unsigned char *const appdata, const char *const valstr, size_t *loc, char **errstr) {
     size_t vallen = strlen(valstr);
@@ -52,6 +66,96 @@ static int writeAppData(unsigned char *const appdata, const char *const valstr,
     return 0;
 }
 
+static void hex_string(char *const string, const unsigned char *const data, const size_t size) {
+    for (size_t i = 0; i < size; i++)
+        snprintf(string + 2 * i, 3, "%02x", data[i]);
+}
+
+/* Record the root and parameters of the dm-verity hash tree. */
+static int fill_verity(unsigned char *const appdata, const struct verity_tree *const verity,
+                       size_t *loc, const int quiet, char **errstr) {
+    char root[VERITY_ROOT_HEX_SIZE + 1];
+    char salt[VERITY_SALT_HEX_SIZE + 1];
+    hex_string(root, verity->root, SHA256_DIGEST_SIZE);
+    hex_string(salt, verity->salt, VERITY_SALT_SIZE);
+    if (!quiet) {
+        printf("Inserting dm-verity root hash into iso image...\n");
+        printf("verity root = %s\n", root);
+        printf("verity salt = %s\n", salt);
+        printf("verity tree = %lld bytes at %lld\n", (long long) verity_hash_size(verity),
+               (long long) verity->hash_offset);
+    }
+
+    char appdata_buffer[APPDATA_SIZE];
+    snprintf(appdata_buffer, APPDATA_SIZE, "VERITY ROOT = %s;VERITY SALT = %s;", root, salt);
+    if (writeAppData(appdata, appdata_buffer, loc, errstr))
+        return -1;
+    snprintf(appdata_buffer, APPDATA_SIZE, "VERITY DATA = %lld;VERITY BLOCKS = %lld;VERITY HASH = %lld;",
+             (long long) verity->data_offset, (long long) verity->data_blocks, (long long) verity->hash_offset);
+    return writeAppData(appdata, appdata_buffer, loc, errstr);
+}
+
+/* Lay out the application data holding the md5sums to implant. */
+static int fill_appdata(unsigned char *const appdata, const char *const hashsum, const char *const fragmentsums,
+                        const struct verity_tree *const verity, const int supported, const int quiet,
+                        char **errstr) {
+    if (!quiet) {
+        printf("Inserting md5sum into iso image...\n");
+        printf("md5 = %s\n", hashsum);
+        printf("Inserting fragment md5sums into iso image...\n");
+        printf("fragmd5 = %s\n", fragmentsums);
+        printf("frags = %lu\n", FRAGMENT_COUNT);
+    }
+    memset(appdata, ' ', APPDATA_SIZE);
+
+    size_t loc = 0;
+    if (writeAppData(appdata, "ISO MD5SUM = ", &loc, errstr))
+        return -1;
+    if (writeAppData(appdata, hashsum, &loc, errstr))
+        return -1;
+    if (writeAppData(appdata, ";", &loc, errstr))
+        return -1;
+
+    char appdata_buffer[APPDATA_SIZE];
+    snprintf(appdata_buffer, APPDATA_SIZE, "SKIPSECTORS = %lld", SKIPSECTORS);
+
+    if (writeAppData(appdata, appdata_buffer, &loc, errstr))
+        return -1;
+    if (writeAppData(appdata, ";", &loc, errstr))
+        return -1;
+
+    if (!quiet)
+        printf("Setting supported flag to %d\n", supported);
+    static const char status[] = "RHLISOSTATUS=%d";
+    char tmp[sizeof(status) / sizeof(*status)];
+    snprintf(tmp, sizeof(status) / sizeof(*status), status, supported);
+    if (writeAppData(appdata, tmp, &loc, errstr))
+        return -1;
+
+    if (writeAppData(appdata, ";", &loc, errstr))
+        return -1;
+
+    if (writeAppData(appdata, "FRAGMENT SUMS = ", &loc, errstr))
+        return -1;
+    if (writeAppData(appdata, fragmentsums, &loc, errstr))
+        return -1;
+    if (writeAppData(appdata, ";", &loc, errstr))
+        return -1;
+
+    snprintf(appdata_buffer, APPDATA_SIZE, "FRAGMENT COUNT = %lu", FRAGMENT_COUNT);
+    if (writeAppData(appdata, appdata_buffer, &loc, errstr))
+        return -1;
+    if (writeAppData(appdata, ";", &loc, errstr))
+        return -1;
+
+    if (verity && fill_verity(appdata, verity, &loc, quiet, errstr))
+        return -1;
+
+    if (writeAppData(appdata, appdata_trailer, &loc, errstr))
+        return -1;
+    return 0;
+}
+
 int implantISOFile(const char *iso, int supported, int forceit, int quiet, char **errstr) {
     int isofd = open(iso, O_RDWR | O_BINARY);
     if (isofd < 0) {
@@ -63,10 +167,81 @@ int implantISOFile(const char *iso, int supported, int forceit, int quiet, char
     return rc;
 }
 
+/**
+ * Like implantISOFile, but hand the implant to isomd5d if it is running.
+ */
+int implantISOFileDaemon(const char *iso, int supported, int forceit, int quiet, char **errstr) {
+#ifndef _WIN32
+    static _Thread_local char message[PROTOCOL_LINE_SIZE];
+    const int sock = daemon_connect();
+    if (sock >= 0) {
+        const int isofd = open(iso, O_RDWR | O_BINARY | O_CLOEXEC);
+        if (isofd < 0) {
+            close(sock);
+            *errstr = "Error - Unable to open file %s";
+            return -1;
+        }
+        char request[PROTOCOL_LINE_SIZE];
+        snprintf(request, sizeof(request), "IMPLANT %d %d", supported, forceit);
+        const bool sent = send_request(sock, request, isofd);
+        close(isofd);
+        if (sent) {
+            int rc;
+            if (!read_result(sock, NULL, NULL, &rc, message, sizeof(message))) {
+                snprintf(message, sizeof(message), "Lost connection to isomd5d.");
+                rc = -1;
+            }
+            close(sock);
+            if (rc)
+                *errstr = message;
+            return rc;
+        }
+        close(sock);
+    }
+#endif
+    return implantISOFile(iso, supported, forceit, quiet, errstr);
+}
+
 int implantISOFD(int isofd, int supported, int forceit, int quiet, char **errstr) {
+    struct isomd5sum_context *const ctx = isomd5sumContextNew();
+    if (ctx == NULL) {
+        *errstr = "Out of memory.";
+        return -1;
+    }
+    int rc = implantISOContext(ctx, isofd, supported, forceit, quiet, errstr);
+    isomd5sumContextFree(ctx);
+    return rc;
+}
+
+/*
+ * Find where to append the hash tree to the image: where the tree implanted
+ * before starts when it is replaced, else past the end of the file.
+ */
+static int64_t verity_hash_offset(struct isomd5sum_context *const ctx, const int isofd, const int64_t isosize) {
+    struct volume_info old;
+    if (read_volume_info(isofd, ctx->descriptors, &old) && old.verityroot[0] != '\0' &&
+        old.verityhash >= isosize)
+        return old.verityhash;
+    const int64_t end = lseek(isofd, 0LL, SEEK_END);
+    if (end < 0)
+        return -1;
+    const int64_t start = MAX(end, isosize);
+    return (start + VERITY_HASH_BLOCK_SIZE - 1) / VERITY_HASH_BLOCK_SIZE * VERITY_HASH_BLOCK_SIZE;
+}
+
+/*
+ * Implant the md5sums. With verity set, build a dm-verity hash tree over the
+ * image in the same pass, written to hashfd or appended to the image if it
+ * is negative. A non-zero return of cb aborts and puts the old appdata back.
+ */
+static int implantmd5sum(struct isomd5sum_context *const ctx, const int isofd, const int supported,
+                         const int forceit, const int quiet, const bool verity, const int hashfd,
+                         implantCallback cb, void *cbdata, char **errstr) {
+    /* The appdata is about to change, parsed info is stale. */
+    ctx->loaded = false;
 
     int64_t pvd_offset;
-    const int64_t isosize = primary_volume_size(isofd, &pvd_offset);
+    const int64_t isosize = primary_volume_size(isofd, ctx->descriptors, &pvd_offset);
     if (isosize == 0) {
         *errstr = "Could not find primary volume!";
         return -1;
@@ -78,6 +253,15 @@ int implantISOFD(int isofd, int supported, int forceit, int quiet, char **errstr
         *errstr = "Failed to read application data from file.";
         return -errno;
     }
+    unsigned char old_appdata[APPDATA_SIZE];
+    memcpy(old_appdata, appdata, APPDATA_SIZE);
+
+    /* Looked up before the old appdata is blanked out. */
+    const int64_t hash_offset = !verity || hashfd >= 0 ? 0 : verity_hash_offset(ctx, isofd, isosize);
+    if (hash_offset < 0) {
+        *errstr = "Could not find the end of the image for the hash tree.";
+        return -1;
+    }
 
     if (!forceit) {
         for (size_t i = 0; i < APPDATA_SIZE; i++) {
@@ -102,103 +286,333 @@ int implantISOFD(int isofd, int supported, int forceit, int quiet, char **errstr
 
     MD5_CTX hashctx;
     MD5_Init(&hashctx);
+    struct midstate_run prefix;
+    midstate_begin(&prefix, ctx->cache);
     char fragmentsums[FRAGMENT_SUM_SIZE + 1];
     *fragmentsums = '\0';
 
-    const size_t pagesize = (size_t) getpagesize();
-    const size_t buffer_size = NUM_SYSTEM_SECTORS * SECTOR_SIZE;
+    const size_t buffer_size = READ_BUFFER_SIZE;
     unsigned char *buffer;
-    buffer = aligned_alloc(pagesize, buffer_size * sizeof(*buffer));
 
     const int64_t total_size = isosize - SKIPSECTORS * SECTOR_SIZE;
     const int64_t fragment_size = total_size / (FRAGMENT_COUNT + 1);
     size_t previous_fragment = 0UL;
     int64_t offset = 0LL;
-    while (offset < total_size) {
-        const size_t nbyte = MIN((size_t)(total_size - offset), buffer_size);
-        ssize_t nread = read(isofd, buffer, nbyte);
+
+    /* The tree covers the sectors skipped by the md5sum as well. The system
+     * area and the primary volume descriptor holding the root are left out. */
+    struct verity_tree tree;
+    if (verity && !verity_begin(&tree, hashfd >= 0 ? hashfd : isofd, hash_offset,
+                                pvd_offset + SECTOR_SIZE, isosize)) {
+        *errstr = "Unable to set up the hash tree.";
+        return -1;
+    }
+    const int64_t read_size = verity ? isosize : total_size;
+
+    PROBE1(implant__start, total_size);
+    throttle_begin(&ctx->throttle);
+    stats_begin(ctx);
+    ctx->profile.fragment_size = fragment_size;
+    if (cb)
+        cb(cbdata, 0LL, (long long) read_size);
+    ctx->progress_due = monotonic_ns() + ctx->progress_interval;
+    bool aborted = false;
+    while (offset < read_size) {
+        const size_t nbyte = MIN((size_t)(read_size - offset), buffer_size);
+        ssize_t nread = context_read(ctx, isofd, offset, nbyte, &buffer);
         if (nread <= 0L)
             break;
 
-        MD5_Update(&hashctx, buffer, (size_t) nread);
+        int64_t start = stats_start(ctx);
+        if (verity)
+            verity_update(&tree, offset, buffer, (size_t) nread);
+        if (offset >= total_size) {
+            stats_stop(ctx, &ctx->stats.hash_ns, start);
+            offset += nread;
+            continue;
+        }
+        midstate_update(&prefix, &hashctx, buffer, (size_t) MIN(nread, total_size - offset));
+        stats_stop(ctx, &ctx->stats.hash_ns, start);
         const size_t current_fragment = offset / fragment_size;
         const size_t fragmentsize = FRAGMENT_SUM_SIZE / FRAGMENT_COUNT;
         /* If we're onto the next fragment, calculate the previous sum and check. */
         if (current_fragment != previous_fragment) {
+            start = stats_start(ctx);
+            midstate_sync(&prefix, &hashctx);
             validate_fragment(&hashctx, current_fragment, fragmentsize, NULL, fragmentsums);
+            stats_stop(ctx, &ctx->stats.validate_ns, start);
+            PROBE2(fragment__done, current_fragment, 1);
             previous_fragment = current_fragment;
         }
 
         offset += nread;
+        if (cb && progress_due(ctx)) {
+            start = stats_start(ctx);
+            aborted = cb(cbdata, (long long) offset, (long long) read_size) != 0;
+            stats_stop(ctx, &ctx->stats.callback_ns, start);
+            if (aborted)
+                break;
+        }
+    }
+    midstate_sync(&prefix, &hashctx);
+    ctx->stats.cached_bytes = prefix.skipped;
+    midstate_end(&prefix);
+    stats_end(ctx);
+    throttle_end(&ctx->throttle);
+
+    if (aborted) {
+        if (verity)
+            verity_end(&tree);
+        if (forceit && (lseek(isofd, pvd_offset + APPDATA_OFFSET, SEEK_SET) < 0 ||
+                        write(isofd, old_appdata, APPDATA_SIZE) != APPDATA_SIZE)) {
+            *errstr = "Aborted, failed to restore the application data.";
+            return -1;
+        }
+        *errstr = "Aborted.";
+        return -1;
+    }
+
+    if (verity) {
+        if (!verity_end(&tree)) {
+            *errstr = "Failed to write the hash tree.";
+            return -1;
+        }
+#ifndef _WIN32
+        /* Drop what is left of a larger tree implanted before. */
+        struct stat st;
+        if (hashfd < 0 && fstat(isofd, &st) == 0 && S_ISREG(st.st_mode) &&
+            ftruncate(isofd, hash_offset + verity_hash_size(&tree))) {
+            *errstr = "Failed to write the hash tree.";
+            return -1;
+        }
+#endif
     }
-    aligned_free(buffer);
 
     char hashsum[HASH_SIZE + 1];
     md5sum(hashsum, &hashctx);
-    if (!quiet) {
-        printf("Inserting md5sum into iso image...\n");
-        printf("md5 = %s\n", hashsum);
-        printf("Inserting fragment md5sums into iso image...\n");
-        printf("fragmd5 = %s\n", fragmentsums);
-        printf("frags = %lu\n", FRAGMENT_COUNT);
+    if (fill_appdata(appdata, hashsum, fragmentsums, verity ? &tree : NULL, supported, quiet, errstr))
+        return -1;
+
+    if (lseek(isofd, pvd_offset + APPDATA_OFFSET, SEEK_SET) < 0) {
+        *errstr = "Seek failed.";
+        return -1;
     }
-    memset(appdata, ' ', APPDATA_SIZE);
 
-    size_t loc = 0;
-    if (writeAppData(appdata, "ISO MD5SUM = ", &loc, errstr))
+    ssize_t error = write(isofd, appdata, APPDATA_SIZE);
+    if (error < 0) {
+        *errstr = "Write failed.";
         return -1;
-    if (writeAppData(appdata, hashsum, &loc, errstr))
+    }
+
+    errstr = NULL;
+    return 0;
+}
+
+static int implant_context(struct isomd5sum_context *const ctx, const int isofd, const int supported,
+                           const int forceit, const int quiet, const bool verity, const int hashfd,
+                           implantCallback cb, void *cbdata, char **errstr) {
+    metrics_begin(ctx);
+    const int rc = implantmd5sum(ctx, isofd, supported, forceit, quiet, verity, hashfd, cb, cbdata, errstr);
+    PROBE1(implant__done, rc);
+    metrics_run(ctx, isofd, rc == 0 ? "implanted" : "failed");
+    return rc;
+}
+
+/* Implant using the buffers of ctx. */
+int implantISOContext(struct isomd5sum_context *ctx, int isofd, int supported, int forceit, int quiet, char **errstr) {
+    return implant_context(ctx, isofd, supported, forceit, quiet, false, -1, NULL, NULL, errstr);
+}
+
+/**
+ * Like implantISOContext, but call cb with the progress of hashing the image,
+ * as often as the progress interval of ctx allows. If cb returns non-zero the
+ * implant is aborted, the application data found in the image is written
+ * back and -1 is returned.
+ */
+int implantISOContextCallback(struct isomd5sum_context *ctx, int isofd, int supported, int forceit, int quiet,
+                              implantCallback cb, void *cbdata, char **errstr) {
+    return implant_context(ctx, isofd, supported, forceit, quiet, false, -1, cb, cbdata, errstr);
+}
+
+/**
+ * Like implantISOContext, but also build a dm-verity hash tree over the image
+ * in the same pass and record its root hash and parameters in the application
+ * data. The tree is written to hashfd from its start, or appended to the image
+ * if hashfd is negative, so the kernel can verify blocks as they are read.
+ */
+int implantISOVerity(struct isomd5sum_context *ctx, int isofd, int hashfd, int supported, int forceit,
+                     int quiet, char **errstr) {
+    return implant_context(ctx, isofd, supported, forceit, quiet, true, hashfd, NULL, NULL, errstr);
+}
+
+/**
+ * Compute the application data to implant into the image passed to hasher,
+ * which has to be in ISOMD5SUM_HASHER_IMPLANT mode. Store it in appdata, which
+ * holds ISOMD5SUM_APPDATA_SIZE bytes, and its offset in the image in offset.
+ * Writing it there is up to the caller.
+ */
+int implantISOHasher(struct isomd5sum_hasher *hasher, int supported, int forceit, int quiet,
+                     unsigned char *appdata, long long *offset, char **errstr) {
+    if (!hasher->loaded) {
+        *errstr = "Could not find primary volume!";
         return -1;
-    if (writeAppData(appdata, ";", &loc, errstr))
+    }
+    if (hasher->appdata_used && !forceit) {
+        *errstr = "Application data has been used - not implanting md5sum!";
+        return -1;
+    }
+    char hashsum[HASH_SIZE + 1];
+    if (!hasher_md5sum(hasher, hashsum)) {
+        *errstr = "Image is shorter than its volume size.";
+        return -1;
+    }
+    if (fill_appdata(appdata, hashsum, hasher->fragmentsums, NULL, supported, quiet, errstr))
         return -1;
+    *offset = hasher->info.offset + APPDATA_OFFSET;
+    return 0;
+}
 
-    char appdata_buffer[APPDATA_SIZE];
-    snprintf(appdata_buffer, APPDATA_SIZE, "SKIPSECTORS = %lld", SKIPSECTORS);
+/**
+ * Implant into an image of size bytes held in memory.
+ */
+int implantISOBuffer(void *buffer, size_t size, int supported, int forceit, int quiet, char **errstr) {
+    const struct iovec iov = { buffer, size };
+    unsigned char appdata[APPDATA_SIZE];
+    long long offset;
+    const int rc = implantISOIOV(&iov, 1, supported, forceit, quiet, appdata, &offset, errstr);
+    if (rc == 0)
+        memcpy((unsigned char *) buffer + offset, appdata, APPDATA_SIZE);
+    return rc;
+}
 
-    if (writeAppData(appdata, appdata_buffer, &loc, errstr))
+/**
+ * Compute the application data to implant into an image held in memory as
+ * the iovcnt segments in iov, in order from its start, without assembling
+ * it. Store it in appdata, which holds ISOMD5SUM_APPDATA_SIZE bytes, and its
+ * offset in the image in offset, like implantISOHasher.
+ */
+int implantISOIOV(const struct iovec *iov, int iovcnt, int supported, int forceit, int quiet,
+                  unsigned char *appdata, long long *offset, char **errstr) {
+    struct isomd5sum_hasher *const hasher = isomd5sumHasherNew(ISOMD5SUM_HASHER_IMPLANT);
+    if (hasher == NULL) {
+        *errstr = "Out of memory.";
         return -1;
-    if (writeAppData(appdata, ";", &loc, errstr))
+    }
+    isomd5sumHasherUpdateIOV(hasher, iov, iovcnt);
+    const int rc = implantISOHasher(hasher, supported, forceit, quiet, appdata, offset, errstr);
+    isomd5sumHasherFree(hasher);
+    return rc;
+}
+
+static unsigned char *findAppData(unsigned char *const appdata, const char *const string) {
+    const size_t len = strlen(string);
+    for (size_t i = 0; i + len <= APPDATA_SIZE; i++) {
+        if (memcmp(appdata + i, string, len) == 0)
+            return appdata + i;
+    }
+    return NULL;
+}
+
+static int writeManifestLine(void *const co, const struct iso_file *const file) {
+    struct manifestData *const data = co;
+    char hashsum[HASH_SIZE + 1];
+    if (!md5sum_extent(NULL, data->isofd, file->offset, file->size, hashsum))
         return -1;
 
-    if (!quiet)
-        printf("Setting supported flag to %d\n", supported);
-    static const char status[] = "RHLISOSTATUS=%d";
-    char tmp[sizeof(status) / sizeof(*status)];
-    snprintf(tmp, sizeof(status) / sizeof(*status), status, supported);
-    if (writeAppData(appdata, tmp, &loc, errstr))
+    char line[HASH_SIZE + ISO_PATH_SIZE + 4];
+    const int len = snprintf(line, sizeof(line), "%s  %s\n", hashsum, file->path);
+    MD5_Update(&data->hashctx, (const unsigned char *) line, (unsigned) len);
+    if (fputs(line, data->output) == EOF)
         return -1;
+    if (!data->quiet)
+        printf("%s", line);
+    return 0;
+}
 
-    if (writeAppData(appdata, ";", &loc, errstr))
+int implantManifestFile(const char *iso, const char *manifest, int quiet, char **errstr) {
+    int isofd = open(iso, O_RDWR | O_BINARY);
+    if (isofd < 0) {
+        *errstr = "Error - Unable to open file %s";
         return -1;
+    }
+    int rc = implantManifestFD(isofd, manifest, quiet, errstr);
+    close(isofd);
+    return rc;
+}
 
-    if (writeAppData(appdata, "FRAGMENT SUMS = ", &loc, errstr))
+/**
+ * Write the md5sum of every file in the image to manifest and record the
+ * md5sum of the manifest itself in the application data, next to the md5sum
+ * implanted by implantISOFD. This lets checkers verify single files without
+ * reading the whole image.
+ */
+int implantManifestFD(int isofd, const char *manifest, int quiet, char **errstr) {
+    struct volume_info *const info = parsepvd(isofd);
+    if (info == NULL) {
+        *errstr = "No md5sum implanted - implant it before the file manifest!";
         return -1;
-    if (writeAppData(appdata, fragmentsums, &loc, errstr))
+    }
+    const int64_t appdata_offset = info->offset + APPDATA_OFFSET;
+    free(info);
+
+    struct manifestData data;
+    data.isofd = isofd;
+    data.quiet = quiet;
+    MD5_Init(&data.hashctx);
+    data.output = fopen(manifest, "w");
+    if (data.output == NULL) {
+        *errstr = "Unable to create file manifest.";
         return -1;
-    if (writeAppData(appdata, ";", &loc, errstr))
+    }
+    int rc = walk_iso_tree(isofd, writeManifestLine, &data);
+    if (fclose(data.output) == EOF || rc) {
+        *errstr = "Failed to write file manifest.";
         return -1;
+    }
+    char hashsum[HASH_SIZE + 1];
+    md5sum(hashsum, &data.hashctx);
 
-    snprintf(appdata_buffer, APPDATA_SIZE, "FRAGMENT COUNT = %lu", FRAGMENT_COUNT);
-    if (writeAppData(appdata, appdata_buffer, &loc, errstr))
-        return -1;
-    if (writeAppData(appdata, ";", &loc, errstr))
+    unsigned char appdata[APPDATA_SIZE];
+    if (lseek(isofd, appdata_offset, SEEK_SET) < 0 ||
+        read(isofd, appdata, APPDATA_SIZE) != APPDATA_SIZE) {
+        *errstr = "Failed to read application data from file.";
         return -1;
+    }
 
-    if (writeAppData(
-            appdata, "THIS IS NOT THE SAME AS RUNNING MD5SUM ON THIS ISO!!", &loc, errstr))
+    /* Replace an existing manifest sum or insert one before the trailer. */
+    const size_t keylen = strlen(manifest_key);
+    unsigned char *key = findAppData(appdata, manifest_key);
+    if (key == NULL) {
+        unsigned char *const trailer = findAppData(appdata, appdata_trailer);
+        if (trailer == NULL) {
+            *errstr = "Application data has an unknown layout - not implanting file manifest!";
+            return -1;
+        }
+        const size_t entrylen = keylen + HASH_SIZE + 1;
+        const size_t trailerlen = strlen(appdata_trailer);
+        if ((size_t)(trailer - appdata) + entrylen + trailerlen >= APPDATA_SIZE) {
+            *errstr = "Attempted to write too much appdata.";
+            return -1;
+        }
+        memmove(trailer + entrylen, trailer, trailerlen);
+        key = trailer;
+        memcpy(key, manifest_key, keylen);
+        key[keylen + HASH_SIZE] = ';';
+    } else if ((size_t)(key - appdata) + keylen + HASH_SIZE >= APPDATA_SIZE) {
+        *errstr = "Attempted to write too much appdata.";
         return -1;
+    }
+    memcpy(key + keylen, hashsum, HASH_SIZE);
+    if (!quiet)
+        printf("manifest md5 = %s\n", hashsum);
 
-    if (lseek(isofd, pvd_offset + APPDATA_OFFSET, SEEK_SET) < 0) {
+    if (lseek(isofd, appdata_offset, SEEK_SET) < 0) {
         *errstr = "Seek failed.";
         return -1;
     }
-
-    ssize_t error = write(isofd, appdata, APPDATA_SIZE);
-    if (error < 0) {
+    if (write(isofd, appdata, APPDATA_SIZE) < 0) {
         *errstr = "Write failed.";
         return -1;
     }
-
-    errstr = NULL;
     return 0;
 }
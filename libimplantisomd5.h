@@ -1,12 +1,36 @@
 #ifndef __LIBIMPLANTISOMD5_H__
 #define __LIBIMPLANTISOMD5_H__
 
+#include "libisomd5sum.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* For non-zero return value, implant is aborted. */
+typedef int (*implantCallback)(void *, long long offset, long long total);
+
 int implantISOFile(const char *iso, int supported, int forceit, int quiet, char **errstr);
 int implantISOFD(int isofd, int supported, int forceit, int quiet, char **errstr);
+/* Like implantISOFile, but run by isomd5d when it is listening. */
+int implantISOFileDaemon(const char *iso, int supported, int forceit, int quiet, char **errstr);
+int implantISOContext(struct isomd5sum_context *ctx, int isofd, int supported, int forceit, int quiet, char **errstr);
+/* Call cb with the progress, restoring the old appdata when it aborts. */
+int implantISOContextCallback(struct isomd5sum_context *ctx, int isofd, int supported, int forceit, int quiet,
+                              implantCallback cb, void *cbdata, char **errstr);
+/* Also build a dm-verity hash tree, written to hashfd or appended to the
+ * image if it is negative. */
+int implantISOVerity(struct isomd5sum_context *ctx, int isofd, int hashfd, int supported, int forceit,
+                     int quiet, char **errstr);
+int implantISOBuffer(void *buffer, size_t size, int supported, int forceit, int quiet, char **errstr);
+/* Compute the appdata for an image passed as segments, for the caller to
+ * write at offset. */
+int implantISOIOV(const struct iovec *iov, int iovcnt, int supported, int forceit, int quiet,
+                  unsigned char *appdata, long long *offset, char **errstr);
+int implantISOHasher(struct isomd5sum_hasher *hasher, int supported, int forceit, int quiet,
+                     unsigned char *appdata, long long *offset, char **errstr);
+int implantManifestFile(const char *iso, const char *manifest, int quiet, char **errstr);
+int implantManifestFD(int isofd, const char *manifest, int quiet, char **errstr);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,216 @@
+#ifndef __LIBISOMD5SUM_H__
+#define __LIBISOMD5SUM_H__
+
+#include <stddef.h>
+
+#ifdef _WIN32
+/* Segments of an image for the *IOV functions, as in POSIX. */
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Read buffers and parsed volume information that can be reused for any
+ * number of checks and implants, so they don't allocate memory per image.
+ * A context must not be used by two threads at the same time. */
+struct isomd5sum_context;
+
+/* Statistics of the last check or implant run through a context. */
+struct isomd5sum_stats {
+    long long bytes_read;
+    long long read_calls;
+    long long short_reads;      /* Reads returning less than requested */
+    long long peak_buffer;      /* Most bytes of the read buffer in use at once */
+    double read_seconds;        /* Time spent in read, without rate limit waits */
+    double throttle_seconds;    /* Time spent waiting for the rate limit */
+    double hash_seconds;        /* Time spent in MD5_Update */
+    double validate_seconds;    /* Time spent computing fragment sums */
+    double callback_seconds;    /* Time spent in progress callbacks */
+    double total_seconds;
+    long long cached_bytes;     /* Bytes not hashed thanks to the midstate cache */
+    const char *engine;         /* MD5 implementation used */
+};
+
+/* Buckets of the read latency histogram. Bucket 0 counts reads taking less
+ * than a microsecond, bucket i those taking 2^(i-1) to 2^i microseconds and
+ * the last one all slower reads. */
+#define ISOMD5SUM_LATENCY_BUCKETS 28
+
+/* Reads of one region of the image in the last run through a context. */
+struct isomd5sum_read_profile {
+    long long offset;
+    long long bytes;
+    long long read_calls;
+    double read_seconds;
+    double max_latency_seconds; /* Slowest single read */
+};
+
+enum isomd5sum_profile_format {
+    ISOMD5SUM_PROFILE_JSON = 0,
+    ISOMD5SUM_PROFILE_CSV = 1
+};
+
+/* Where the read size picked by isomd5sumContextAutoTune comes from. */
+enum isomd5sum_io_source {
+    ISOMD5SUM_IO_DEFAULT = 0,   /* Nothing learned, the default read size */
+    ISOMD5SUM_IO_CACHED = 1,    /* The image is in the page cache */
+    ISOMD5SUM_IO_STORED = 2,    /* Stored for the device by an earlier run */
+    ISOMD5SUM_IO_SAMPLED = 3    /* Measured on the image just now */
+};
+
+/* How an image is read, see isomd5sumContextAutoTune. */
+struct isomd5sum_io_profile {
+    char device[128];           /* Model or number of the device holding the image */
+    long long read_size;
+    long long sector_size;      /* Logical sector size of the device, 0 if unknown */
+    long long readahead;        /* Readahead window of the device in bytes, 0 if unknown */
+    double resident;            /* Share of the image in the page cache */
+    double mb_per_s;            /* Throughput with read_size, 0 unless measured */
+    int source;                 /* enum isomd5sum_io_source */
+};
+
+enum isomd5sum_throttle_flags {
+    /* Read with the idle I/O priority class, only supported on Linux. */
+    ISOMD5SUM_THROTTLE_IDLE = 1,
+    /* Pause between reads while they take longer than usual, which means
+     * other users keep the device busy. */
+    ISOMD5SUM_THROTTLE_ADAPTIVE = 2
+};
+
+/* Hash state of an image passed in pieces, in order from its start, for
+ * images held in memory or streamed without a file. */
+struct isomd5sum_hasher;
+struct isomd5sum_metrics;
+struct isomd5sum_sha256;
+
+/* Size of the application data of the primary volume descriptor holding
+ * the implanted md5sums. */
+#define ISOMD5SUM_APPDATA_SIZE 512
+
+enum isomd5sum_hasher_mode {
+    /* Verify the implanted md5sums, see mediaCheckHasher. */
+    ISOMD5SUM_HASHER_CHECK = 0,
+    /* Compute the md5sums to implant, see implantISOHasher. */
+    ISOMD5SUM_HASHER_IMPLANT = 1,
+    /* Added to ISOMD5SUM_HASHER_CHECK, only compare the md5sum at the end
+     * instead of failing at the first bad fragment. */
+    ISOMD5SUM_HASHER_NO_FRAGMENTS = 2
+};
+
+struct isomd5sum_context *isomd5sumContextNew(void);
+void isomd5sumContextFree(struct isomd5sum_context *ctx);
+/* Limit reading the image through ctx to max_rate bytes per second, or
+ * leave it unlimited for 0. flags is a mask of isomd5sum_throttle_flags. */
+void isomd5sumContextSetThrottle(struct isomd5sum_context *ctx, long long max_rate, int flags);
+/* Call progress callbacks at most every interval milliseconds, 100 unless
+ * set. 0 calls them after every read like older releases did. */
+void isomd5sumContextSetProgressInterval(struct isomd5sum_context *ctx, int interval);
+/* Collect statistics for the runs through ctx. They are off by default,
+ * which saves reading the clock around every step. */
+void isomd5sumContextEnableStats(struct isomd5sum_context *ctx, int enable);
+/* Copy the statistics of the last run through ctx into stats. */
+void isomd5sumContextStats(struct isomd5sum_context *ctx, struct isomd5sum_stats *stats);
+/* Print the statistics of the last run as one line of JSON. */
+void isomd5sumContextPrintStats(struct isomd5sum_context *ctx);
+/* Record how fast the image is read through ctx per region of region_size
+ * bytes, per fragment and in a latency histogram, to find media that slow
+ * down before they fail. 0 turns it off, which it is by default. */
+void isomd5sumContextEnableProfile(struct isomd5sum_context *ctx, long long region_size);
+/* Copy the profile of up to count regions or fragments of the last run into
+ * profile and return how many there are. Reads before the size of the image
+ * was known are missing from the fragments. */
+size_t isomd5sumContextRegionProfile(struct isomd5sum_context *ctx, struct isomd5sum_read_profile *profile,
+                                     size_t count);
+size_t isomd5sumContextFragmentProfile(struct isomd5sum_context *ctx, struct isomd5sum_read_profile *profile,
+                                       size_t count);
+/* Copy the ISOMD5SUM_LATENCY_BUCKETS read counts of the last run. */
+void isomd5sumContextLatencyHistogram(struct isomd5sum_context *ctx, long long *histogram);
+/* Print the profile of the last run as one line of JSON or as CSV. */
+void isomd5sumContextPrintProfile(struct isomd5sum_context *ctx, int format);
+/* Read images through ctx read_size bytes at a time, rounded down to a
+ * multiple of 32 KiB and at most 16 MiB. Hashing and fragment sums don't
+ * depend on the read size. Return -1 if the buffer can't be allocated. */
+int isomd5sumContextSetReadSize(struct isomd5sum_context *ctx, long long read_size);
+long long isomd5sumContextReadSize(struct isomd5sum_context *ctx);
+/* Set the read size of ctx for the file or block device isofd. An image
+ * mostly in the page cache gets large reads. Otherwise the size stored in
+ * the profiles file for the device is used, or the throughput of a few read
+ * sizes is sampled on the image, reading a few MiB with each, and the result
+ * is stored in profiles, which may be NULL. The choice is described in
+ * profile, which may be NULL too. Only the read size is tuned, reads stay
+ * buffered and one at a time. Return -1 if isofd is neither a file nor a
+ * block device, or on Windows. */
+int isomd5sumContextAutoTune(struct isomd5sum_context *ctx, int isofd, const char *profiles,
+                             struct isomd5sum_io_profile *profile);
+/* Export metrics of the checks and implants through contexts set up with
+ * isomd5sumContextSetMetrics to the file at path, in the OpenMetrics text
+ * format read by the textfile collector of the Prometheus node exporter.
+ * Counters already in the file are continued, so it can be shared by runs
+ * and processes. The file is rewritten in the background every interval
+ * seconds, or only on close if interval is 0. tool becomes the tool label of
+ * the metrics. Return NULL with errno set on failure, always on Windows. */
+struct isomd5sum_metrics *isomd5sumMetricsOpen(const char *path, const char *tool, int interval);
+/* Write the metrics one last time and free them. */
+void isomd5sumMetricsClose(struct isomd5sum_metrics *metrics);
+/* Count an image found by a scan, by result such as "implanted". */
+void isomd5sumMetricsRecordScan(struct isomd5sum_metrics *metrics, const char *result);
+/* Record the runs through ctx in metrics, which have to outlive its use by
+ * ctx. NULL stops recording. */
+void isomd5sumContextSetMetrics(struct isomd5sum_context *ctx, struct isomd5sum_metrics *metrics);
+/* Keep the md5 states of the images implanted through ctx in the cache file
+ * at path, and skip hashing the parts of later images which start the same
+ * way. The images are still read. Checks never use the cache, its keys are
+ * no cryptographic hashes. NULL stops using a cache. Return 0, or -1 with
+ * errno set if path can't be used. */
+int isomd5sumContextSetCache(struct isomd5sum_context *ctx, const char *path);
+
+/* Also compute the SHA-256 of the raw image bytes, as sha256sum does, in
+ * checks through ctx. It is hashed from the buffers read for the md5sum, on
+ * a second thread. The end of the image the md5sum skips is read after the
+ * check; for block devices the image ends at its volume size. Return 0, or
+ * -1 if the thread can't be started. */
+int isomd5sumContextEnableSha256(struct isomd5sum_context *ctx, int enable);
+/* Store the SHA-256 of the image of the last check in base 16 in hashsum,
+ * which holds 65 bytes. Return 0 if it was not computed to the end, which
+ * checks that were aborted or failed before the end are not. */
+int isomd5sumContextSha256(struct isomd5sum_context *ctx, char *hashsum);
+
+/* SHA-256 of data passed in pieces, as sha256sum computes it. */
+struct isomd5sum_sha256 *isomd5sumSha256New(void);
+void isomd5sumSha256Free(struct isomd5sum_sha256 *sha256);
+void isomd5sumSha256Update(struct isomd5sum_sha256 *sha256, const void *data, size_t size);
+/* Store the SHA-256 of the bytes passed so far in base 16 in hashsum, which
+ * holds 65 bytes. */
+void isomd5sumSha256Hashsum(struct isomd5sum_sha256 *sha256, char *hashsum);
+
+/* mode is a mask of isomd5sum_hasher_mode. */
+struct isomd5sum_hasher *isomd5sumHasherNew(int mode);
+void isomd5sumHasherFree(struct isomd5sum_hasher *hasher);
+/* Hash the next size bytes of the image. Return ISOMD5SUM_CHECK_RUNNING
+ * while they may still pass, ISOMD5SUM_CHECK_FAILED once a fragment sum
+ * mismatches and ISOMD5SUM_CHECK_NOT_FOUND if the image has no primary
+ * volume descriptor or, for checks, no implanted md5sum. Data past the
+ * summed part of the image is ignored. */
+int isomd5sumHasherUpdate(struct isomd5sum_hasher *hasher, const void *data, size_t size);
+/* Hash the iovcnt segments in iov, which follow each other in the image,
+ * like isomd5sumHasherUpdate without copying them. */
+int isomd5sumHasherUpdateIOV(struct isomd5sum_hasher *hasher, const struct iovec *iov, int iovcnt);
+/* Store the number of bytes hashed so far in offset and the number summed
+ * in total, 0 until it is known. Return non-zero while more are needed. */
+int isomd5sumHasherProgress(struct isomd5sum_hasher *hasher, long long *offset, long long *total);
+/* Store the md5sum of the bytes hashed so far in base 16 in hashsum, which
+ * holds 33 bytes. Return non-zero once all summed bytes are hashed. */
+int isomd5sumHasherMd5sum(struct isomd5sum_hasher *hasher, char *hashsum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Metrics of checks and implants in the OpenMetrics text format, for the
+ * textfile collector of the Prometheus node exporter. Reads only add to two
+ * atomic counters. Everything else is recorded once per run into a table of
+ * changes, which a writer thread merges into the file every few seconds and
+ * on close. The file is rewritten under a lock, adding to the counters found
+ * in it, so several runs may share one file.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcheckisomd5.h"
+#include "utilities.h"
+
+#ifdef _WIN32
+
+/* Writing metrics in the background needs POSIX threads. */
+struct isomd5sum_metrics *isomd5sumMetricsOpen(const char *path, const char *tool, int interval) {
+    (void) path;
+    (void) tool;
+    (void) interval;
+    return NULL;
+}
+
+void isomd5sumMetricsClose(struct isomd5sum_metrics *metrics) {
+    (void) metrics;
+}
+
+void isomd5sumMetricsRecordScan(struct isomd5sum_metrics *metrics, const char *result) {
+    (void) metrics;
+    (void) result;
+}
+
+void metrics_read(struct isomd5sum_metrics *const metrics, const size_t nbyte, const int64_t latency) {
+    (void) metrics;
+    (void) nbyte;
+    (void) latency;
+}
+
+void metrics_run(struct isomd5sum_context *const ctx, const int isofd, const char *const status) {
+    (void) ctx;
+    (void) isofd;
+    (void) status;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define MAX_KEY_SIZE 512
+
+struct sample {
+    char *key;              /* Metric name and labels */
+    double value;
+    bool set;               /* Replaces the value in the file instead of adding to it */
+};
+
+struct sample_table {
+    struct sample *items;
+    size_t count;
+    size_t capacity;
+};
+
+struct isomd5sum_metrics {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t writer;
+    bool writing;           /* The writer thread runs */
+    bool closing;
+    int interval;
+    atomic_int_least64_t bytes;
+    atomic_int_least64_t read_ns;
+    struct sample_table pending;
+    char tool[64];
+    char path[];
+};
+
+static const struct family {
+    const char *name;
+    const char *type;
+    const char *help;
+} families[] = {
+    { "isomd5sum_bytes_hashed_total", "counter", "Bytes of images read and hashed." },
+    { "isomd5sum_read_seconds_total", "counter", "Time spent reading images." },
+    { "isomd5sum_runs_total", "counter", "Finished checks and implants by result." },
+    { "isomd5sum_run_duration_seconds", "histogram", "Duration of checks and implants." },
+    { "isomd5sum_device_bytes_total", "counter", "Bytes of images read per device." },
+    { "isomd5sum_device_seconds_total", "counter", "Duration of the runs per device." },
+    { "isomd5sum_device_throughput_mb_per_second", "gauge", "Throughput of the last run per device." },
+    { "isomd5sum_scanned_images_total", "counter", "Images found by scans by result." },
+    { "isomd5sum_last_run_timestamp_seconds", "gauge", "Time the last run finished." },
+};
+
+/* Upper bounds of the duration histogram in seconds. */
+static const double duration_buckets[] = { 1, 5, 15, 60, 300, 900, 3600 };
+
+/* Return the family a sample name belongs to, or NULL. */
+static const struct family *find_family(const char *const key) {
+    const size_t len = strcspn(key, "{ ");
+    for (size_t i = 0; i < sizeof(families) / sizeof(*families); i++) {
+        const size_t name_len = strlen(families[i].name);
+        if (len < name_len || strncmp(key, families[i].name, name_len))
+            continue;
+        const char *const suffix = key + name_len;
+        const size_t suffix_len = len - name_len;
+        if (suffix_len == 0)
+            return &families[i];
+        if (strcmp(families[i].type, "histogram") == 0 &&
+            ((suffix_len == 7 && !strncmp(suffix, "_bucket", 7)) || (suffix_len == 4 && !strncmp(suffix, "_sum", 4)) ||
+             (suffix_len == 6 && !strncmp(suffix, "_count", 6))))
+            return &families[i];
+    }
+    return NULL;
+}
+
+/* Add value to the sample key, or replace it if set. */
+static bool update_sample(struct sample_table *const table, const char *const key, const double value,
+                          const bool set) {
+    for (size_t i = 0; i < table->count; i++) {
+        if (strcmp(table->items[i].key, key) == 0) {
+            table->items[i].value = set ? value : table->items[i].value + value;
+            table->items[i].set |= set;
+            return true;
+        }
+    }
+    if (table->count == table->capacity) {
+        const size_t capacity = table->capacity ? 2 * table->capacity : 32;
+        struct sample *const items = realloc(table->items, capacity * sizeof(*items));
+        if (items == NULL)
+            return false;
+        table->items = items;
+        table->capacity = capacity;
+    }
+    char *const copy = strdup(key);
+    if (copy == NULL)
+        return false;
+    table->items[table->count++] = (struct sample) { .key = copy, .value = value, .set = set };
+    return true;
+}
+
+static void clear_samples(struct sample_table *const table) {
+    for (size_t i = 0; i < table->count; i++)
+        free(table->items[i].key);
+    free(table->items);
+    memset(table, 0, sizeof(*table));
+}
+
+/* Copy value into label as an escaped label value. */
+static void escape_label(char *const label, const size_t size, const char *value) {
+    size_t len = 0;
+    for (; *value && len + 3 < size; value++) {
+        if (*value == '\\' || *value == '"') {
+            label[len++] = '\\';
+            label[len++] = *value;
+        } else if (*value == '\n') {
+            label[len++] = '\\';
+            label[len++] = 'n';
+        } else {
+            label[len++] = *value;
+        }
+    }
+    label[len] = '\0';
+}
+
+/* Update the sample name{tool="...",labels} of the pending changes. */
+static void record(struct isomd5sum_metrics *const metrics, const char *const name, const char *const labels,
+                   const double value, const bool set) {
+    char key[MAX_KEY_SIZE];
+    snprintf(key, sizeof(key), "%s{tool=\"%s\"%s}", name, metrics->tool, labels);
+    update_sample(&metrics->pending, key, value, set);
+}
+
+/* Read the samples of the known families from the metrics file. */
+static void load_samples(const char *const path, struct sample_table *const table) {
+    FILE *const file = fopen(path, "r");
+    if (file == NULL)
+        return;
+    char line[MAX_KEY_SIZE + 64];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *const space = strrchr(line, ' ');
+        if (*line == '#' || space == NULL)
+            continue;
+        *space = '\0';
+        char *end;
+        const double value = strtod(space + 1, &end);
+        if (end != space + 1 && find_family(line))
+            update_sample(table, line, value, false);
+    }
+    fclose(file);
+}
+
+static bool write_samples(const char *const path, const struct sample_table *const table) {
+    FILE *const file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    for (size_t i = 0; i < sizeof(families) / sizeof(*families); i++) {
+        bool header = false;
+        for (size_t j = 0; j < table->count; j++) {
+            const struct sample *const sample = &table->items[j];
+            if (find_family(sample->key) != &families[i])
+                continue;
+            if (!header) {
+                fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", families[i].name, families[i].help,
+                        families[i].name, families[i].type);
+                header = true;
+            }
+            fprintf(file, "%s %.15g\n", sample->key, sample->value);
+        }
+    }
+    fprintf(file, "# EOF\n");
+    return fclose(file) == 0;
+}
+
+/* Merge the pending changes into the file. Called with the lock held. */
+static void flush(struct isomd5sum_metrics *const metrics) {
+    const int64_t bytes = atomic_exchange(&metrics->bytes, 0);
+    const int64_t read_ns = atomic_exchange(&metrics->read_ns, 0);
+    if (bytes || read_ns) {
+        record(metrics, "isomd5sum_bytes_hashed_total", "", (double) bytes, false);
+        record(metrics, "isomd5sum_read_seconds_total", "", (double) read_ns / 1e9, false);
+    }
+    if (metrics->pending.count == 0)
+        return;
+
+    char lock_path[PATH_MAX], temp_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", metrics->path);
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld", metrics->path, (long) getpid());
+    const int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0)
+        return;
+    while (flock(lock, LOCK_EX) && errno == EINTR) {
+    }
+
+    struct sample_table samples = { 0 };
+    load_samples(metrics->path, &samples);
+    bool merged = true;
+    for (size_t i = 0; i < metrics->pending.count; i++) {
+        const struct sample *const sample = &metrics->pending.items[i];
+        merged &= update_sample(&samples, sample->key, sample->value, sample->set);
+    }
+    /* Keep the changes for the next attempt if the file can't be written. */
+    if (merged && write_samples(temp_path, &samples) && rename(temp_path, metrics->path) == 0)
+        clear_samples(&metrics->pending);
+    else
+        unlink(temp_path);
+    clear_samples(&samples);
+    close(lock);
+}
+
+static void *writer(void *const co) {
+    struct isomd5sum_metrics *const metrics = co;
+    pthread_mutex_lock(&metrics->lock);
+    while (!metrics->closing) {
+        struct timespec due;
+        clock_gettime(CLOCK_REALTIME, &due);
+        due.tv_sec += metrics->interval;
+        while (!metrics->closing && pthread_cond_timedwait(&metrics->changed, &metrics->lock, &due) != ETIMEDOUT) {
+        }
+        flush(metrics);
+    }
+    pthread_mutex_unlock(&metrics->lock);
+    return NULL;
+}
+
+struct isomd5sum_metrics *isomd5sumMetricsOpen(const char *path, const char *tool, int interval) {
+    const size_t len = strlen(path);
+    if (len + 32 >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    struct isomd5sum_metrics *const metrics = calloc(1, sizeof(*metrics) + len + 1);
+    if (metrics == NULL)
+        return NULL;
+    memcpy(metrics->path, path, len + 1);
+    escape_label(metrics->tool, sizeof(metrics->tool), tool);
+    metrics->interval = interval;
+    atomic_init(&metrics->bytes, 0);
+    atomic_init(&metrics->read_ns, 0);
+    pthread_mutex_init(&metrics->lock, NULL);
+    pthread_cond_init(&metrics->changed, NULL);
+    if (interval > 0)
+        metrics->writing = pthread_create(&metrics->writer, NULL, writer, metrics) == 0;
+    return metrics;
+}
+
+void isomd5sumMetricsClose(struct isomd5sum_metrics *metrics) {
+    if (metrics == NULL)
+        return;
+    pthread_mutex_lock(&metrics->lock);
+    metrics->closing = true;
+    pthread_cond_broadcast(&metrics->changed);
+    pthread_mutex_unlock(&metrics->lock);
+    if (metrics->writing)
+        pthread_join(metrics->writer, NULL);
+
+    flush(metrics);
+    clear_samples(&metrics->pending);
+    pthread_cond_destroy(&metrics->changed);
+    pthread_mutex_destroy(&metrics->lock);
+    free(metrics);
+}
+
+void isomd5sumMetricsRecordScan(struct isomd5sum_metrics *metrics, const char *result) {
+    char labels[128], value[64];
+    escape_label(value, sizeof(value), result);
+    snprintf(labels, sizeof(labels), ",result=\"%s\"", value);
+    pthread_mutex_lock(&metrics->lock);
+    record(metrics, "isomd5sum_scanned_images_total", labels, 1, false);
+    pthread_mutex_unlock(&metrics->lock);
+}
+
+/* Count a read, which is all the read loops do. */
+void metrics_read(struct isomd5sum_metrics *const metrics, const size_t nbyte, const int64_t latency) {
+    atomic_fetch_add_explicit(&metrics->bytes, (int_least64_t) nbyte, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics->read_ns, latency, memory_order_relaxed);
+}
+
+/* Record the run through ctx started by metrics_begin, which read isofd. */
+void metrics_run(struct isomd5sum_context *const ctx, const int isofd, const char *const status) {
+    struct isomd5sum_metrics *const metrics = ctx->metrics;
+    if (metrics == NULL)
+        return;
+    const double seconds = (double) (monotonic_ns() - ctx->metrics_started) / 1e9;
+    const double bytes = (double) ctx->metrics_bytes;
+    char device[128], label[160], labels[MAX_KEY_SIZE / 2];
+    device_name(isofd, device, sizeof(device));
+    escape_label(label, sizeof(label), device);
+
+    pthread_mutex_lock(&metrics->lock);
+    snprintf(labels, sizeof(labels), ",status=\"%s\"", status);
+    record(metrics, "isomd5sum_runs_total", labels, 1, false);
+    for (size_t i = 0; i < sizeof(duration_buckets) / sizeof(*duration_buckets); i++) {
+        snprintf(labels, sizeof(labels), ",le=\"%g\"", duration_buckets[i]);
+        record(metrics, "isomd5sum_run_duration_seconds_bucket", labels, seconds <= duration_buckets[i], false);
+    }
+    record(metrics, "isomd5sum_run_duration_seconds_bucket", ",le=\"+Inf\"", 1, false);
+    record(metrics, "isomd5sum_run_duration_seconds_sum", "", seconds, false);
+    record(metrics, "isomd5sum_run_duration_seconds_count", "", 1, false);
+    snprintf(labels, sizeof(labels), ",device=\"%s\"", label);
+    record(metrics, "isomd5sum_device_bytes_total", labels, bytes, false);
+    record(metrics, "isomd5sum_device_seconds_total", labels, seconds, false);
+    if (seconds > 0)
+        record(metrics, "isomd5sum_device_throughput_mb_per_second", labels, bytes / seconds / 1e6, true);
+    record(metrics, "isomd5sum_last_run_timestamp_seconds", "", (double) time(NULL), true);
+    pthread_mutex_unlock(&metrics->lock);
+}
+
+#endif
+
+void isomd5sumContextSetMetrics(struct isomd5sum_context *ctx, struct isomd5sum_metrics *metrics) {
+    ctx->metrics = metrics;
+}
+
+void metrics_begin(struct isomd5sum_context *const ctx) {
+    ctx->metrics_bytes = 0;
+    ctx->metrics_started = ctx->metrics ? monotonic_ns() : 0;
+}
+
+/* Name the result of a check in the metrics. */
+const char *metrics_status(const int status) {
+    switch (status) {
+    case ISOMD5SUM_FILE_NOT_FOUND:
+        return "file_not_found";
+    case ISOMD5SUM_CHECK_NOT_FOUND:
+        return "not_found";
+    case ISOMD5SUM_CHECK_FAILED:
+        return "failed";
+    case ISOMD5SUM_CHECK_PASSED:
+        return "passed";
+    case ISOMD5SUM_CHECK_ABORTED:
+        return "aborted";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2001-2013 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "libcheckisomd5.h"
+
+#ifdef _WIN32
+
+/* Bulk scans need POSIX threads and directory streams. */
+struct isomd5sum_scan *mediaScanOpen(const char *dir, int threads) {
+    (void) dir;
+    (void) threads;
+    return NULL;
+}
+
+const struct isomd5sum_scan_result *mediaScanNext(struct isomd5sum_scan *scan) {
+    (void) scan;
+    return NULL;
+}
+
+void mediaScanClose(struct isomd5sum_scan *scan) {
+    (void) scan;
+}
+
+#else
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "utilities.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Files queued per worker before the directory walk waits. */
+#define SCAN_QUEUE_DEPTH 4
+
+struct scanJob {
+    struct scanJob *next;
+    struct isomd5sum_scan_result result;
+    char path[];
+};
+
+struct isomd5sum_scan {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t walker;
+    pthread_t *workers;
+    int nworkers;
+    size_t queue_limit;     /* Pending files the walk waits at */
+    struct scanJob *pending;
+    struct scanJob **pending_tail;
+    size_t npending;
+    struct scanJob *done;
+    struct scanJob **done_tail;
+    size_t active;
+    bool walking;
+    bool closing;
+    struct scanJob *current;
+    char dir[];
+};
+
+static void push(struct scanJob ***const tail, struct scanJob *const job) {
+    job->next = NULL;
+    **tail = job;
+    *tail = &job->next;
+}
+
+static struct scanJob *pop(struct scanJob **const head, struct scanJob ***const tail) {
+    struct scanJob *const job = *head;
+    *head = job->next;
+    if (*head == NULL)
+        *tail = head;
+    return job;
+}
+
+static bool is_iso(const char *const name) {
+    const size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".iso") == 0;
+}
+
+/* Queue a file, waiting while the workers are behind. Return false to stop. */
+static bool queue_file(struct isomd5sum_scan *const scan, const char *const path) {
+    const size_t len = strlen(path);
+    struct scanJob *const job = calloc(1, sizeof(*job) + len + 1);
+    if (job == NULL)
+        return false;
+    memcpy(job->path, path, len + 1);
+    job->result.path = job->path;
+
+    pthread_mutex_lock(&scan->lock);
+    while (scan->npending >= scan->queue_limit && !scan->closing)
+        pthread_cond_wait(&scan->changed, &scan->lock);
+    const bool closing = scan->closing;
+    if (closing) {
+        free(job);
+    } else {
+        push(&scan->pending_tail, job);
+        scan->npending++;
+        pthread_cond_broadcast(&scan->changed);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return !closing;
+}
+
+static bool walk(struct isomd5sum_scan *const scan, char *const path) {
+    DIR *const dir = opendir(path);
+    if (dir == NULL)
+        return true;
+
+    const size_t pathlen = strlen(path);
+    bool keep_going = true;
+    struct dirent *entry;
+    while (keep_going && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (pathlen + 1 + strlen(entry->d_name) >= PATH_MAX)
+            continue;
+        snprintf(path + pathlen, PATH_MAX - pathlen, "/%s", entry->d_name);
+
+        /* Directory symlinks are not followed to stay clear of loops. */
+        unsigned char type = entry->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        if (type == DT_DIR) {
+            keep_going = walk(scan, path);
+        } else if (is_iso(entry->d_name) &&
+                   (type == DT_REG || (type == DT_LNK && stat(path, &st) == 0 && S_ISREG(st.st_mode)))) {
+            keep_going = queue_file(scan, path);
+        }
+        path[pathlen] = '\0';
+    }
+    closedir(dir);
+    return keep_going;
+}
+
+static void *walker(void *const co) {
+    struct isomd5sum_scan *const scan = co;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", scan->dir);
+    walk(scan, path);
+
+    pthread_mutex_lock(&scan->lock);
+    scan->walking = false;
+    pthread_cond_broadcast(&scan->changed);
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+static void scan_file(struct isomd5sum_scan_result *const result) {
+    const int isofd = open(result->path, O_RDONLY | O_BINARY | O_CLOEXEC);
+    if (isofd < 0) {
+        result->error = errno;
+        return;
+    }
+    struct volume_info *const info = parsepvd(isofd);
+    close(isofd);
+    if (info == NULL)
+        return;
+
+    result->implanted = 1;
+    snprintf(result->hashsum, sizeof(result->hashsum), "%s", info->hashsum);
+    snprintf(result->fragmentsums, sizeof(result->fragmentsums), "%s", info->fragmentsums);
+    result->fragmentcount = (long long) info->fragmentcount;
+    result->size = info->isosize;
+    result->supported = info->supported != 0;
+    free(info);
+}
+
+static void *worker(void *const co) {
+    struct isomd5sum_scan *const scan = co;
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        while (scan->pending == NULL && scan->walking && !scan->closing)
+            pthread_cond_wait(&scan->changed, &scan->lock);
+        if (scan->closing || scan->pending == NULL)
+            break;
+        struct scanJob *const job = pop(&scan->pending, &scan->pending_tail);
+        scan->npending--;
+        scan->active++;
+        pthread_cond_broadcast(&scan->changed);
+        pthread_mutex_unlock(&scan->lock);
+
+        scan_file(&job->result);
+
+        pthread_mutex_lock(&scan->lock);
+        push(&scan->done_tail, job);
+        scan->active--;
+        pthread_cond_broadcast(&scan->changed);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+/**
+ * Start scanning all *.iso files below dir. Many files are in flight at once,
+ * which hides the latency of network storage; each file costs one read for
+ * its volume descriptors.
+ */
+struct isomd5sum_scan *mediaScanOpen(const char *dir, int threads) {
+    if (threads < 1)
+        threads = 1;
+    const size_t dirlen = strlen(dir);
+    if (dirlen >= PATH_MAX)
+        return NULL;
+    /* Only directories below the top one are skipped when unreadable. */
+    struct stat st;
+    if (stat(dir, &st) || !S_ISDIR(st.st_mode) || access(dir, R_OK | X_OK))
+        return NULL;
+
+    struct isomd5sum_scan *const scan = calloc(1, sizeof(*scan) + dirlen + 1);
+    if (scan == NULL)
+        return NULL;
+    memcpy(scan->dir, dir, dirlen + 1);
+    scan->workers = calloc((size_t) threads, sizeof(*scan->workers));
+    if (scan->workers == NULL) {
+        free(scan);
+        return NULL;
+    }
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->changed, NULL);
+    scan->pending_tail = &scan->pending;
+    scan->done_tail = &scan->done;
+    scan->walking = true;
+    /* Set before the walk starts, which must not wait for the workers. */
+    scan->queue_limit = (size_t) threads * SCAN_QUEUE_DEPTH;
+
+    if (pthread_create(&scan->walker, NULL, walker, scan)) {
+        pthread_cond_destroy(&scan->changed);
+        pthread_mutex_destroy(&scan->lock);
+        free(scan->workers);
+        free(scan);
+        return NULL;
+    }
+    for (; scan->nworkers < threads; scan->nworkers++) {
+        if (pthread_create(scan->workers + scan->nworkers, NULL, worker, scan))
+            break;
+    }
+    if (scan->nworkers == 0) {
+        mediaScanClose(scan);
+        return NULL;
+    }
+    return scan;
+}
+
+/**
+ * Return the next scanned file in completion order, or NULL once all files
+ * are done. The result stays valid until the next call.
+ */
+const struct isomd5sum_scan_result *mediaScanNext(struct isomd5sum_scan *scan) {
+    free(scan->current);
+    scan->current = NULL;
+
+    pthread_mutex_lock(&scan->lock);
+    while (scan->done == NULL && (scan->walking || scan->pending != NULL || scan->active > 0))
+        pthread_cond_wait(&scan->changed, &scan->lock);
+    if (scan->done != NULL)
+        scan->current = pop(&scan->done, &scan->done_tail);
+    pthread_mutex_unlock(&scan->lock);
+    return scan->current ? &scan->current->result : NULL;
+}
+
+void mediaScanClose(struct isomd5sum_scan *scan) {
+    if (scan == NULL)
+        return;
+    pthread_mutex_lock(&scan->lock);
+    scan->closing = true;
+    pthread_cond_broadcast(&scan->changed);
+    pthread_mutex_unlock(&scan->lock);
+
+    pthread_join(scan->walker, NULL);
+    for (int i = 0; i < scan->nworkers; i++)
+        pthread_join(scan->workers[i], NULL);
+
+    while (scan->pending != NULL)
+        free(pop(&scan->pending, &scan->pending_tail));
+    while (scan->done != NULL)
+        free(pop(&scan->done, &scan->done_tail));
+    free(scan->current);
+    pthread_cond_destroy(&scan->changed);
+    pthread_mutex_destroy(&scan->lock);
+    free(scan->workers);
+    free(scan);
+}
+
+#endif /* _WIN32 */
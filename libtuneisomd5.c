@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Pick the read size for an image from the device holding it. An image which
+ * is mostly in the page cache is read in large pieces right away. Otherwise a
+ * size stored for the device before is used, or a few sizes are sampled on
+ * separate areas of the image and the smallest one reaching close to the best
+ * throughput wins. Profiles are stored as lines of read size, throughput and
+ * device name, the name taking the rest of the line. Reads always go through
+ * the page cache one at a time, so there is no engine or queue depth to pick.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libcheckisomd5.h"
+#include "utilities.h"
+
+#ifndef _WIN32
+
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#endif
+
+/* Read size for images in the page cache, where reads only copy memory. */
+#define CACHED_READ_SIZE (1024 * 1024)
+/* Share of the image in the page cache above which the device doesn't matter. */
+#define RESIDENT_SHARE 0.9
+/* Bytes read with each candidate read size. */
+#define SAMPLE_SIZE (4 * 1024 * 1024)
+/* Smaller read sizes win unless slower than this share of the best one. */
+#define SAMPLE_TOLERANCE 0.9
+#define MAX_CANDIDATES 5
+
+/* Read the line of the sysfs attribute of the block device dev, trying the
+ * whole disk if dev is a partition. */
+static bool read_sysfs(const dev_t dev, const char *const name, char *const value, const size_t size) {
+#ifdef __linux__
+    static const char *const formats[] = { "/sys/dev/block/%u:%u/%s", "/sys/dev/block/%u:%u/../%s" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+        char path[128];
+        snprintf(path, sizeof(path), formats[i], major(dev), minor(dev), name);
+        FILE *const file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        const bool found = fgets(value, (int) size, file) != NULL;
+        fclose(file);
+        if (found) {
+            size_t len = strlen(value);
+            while (len > 0 && (value[len - 1] == '\n' || value[len - 1] == ' '))
+                value[--len] = '\0';
+            if (len > 0)
+                return true;
+        }
+    }
+#else
+    (void) dev;
+    (void) name;
+    (void) value;
+    (void) size;
+#endif
+    return false;
+}
+
+/* Name the device holding the file or block device st by its model, or its
+ * number if the model is unknown. */
+static void name_device(const struct stat *const st, char *const name, const size_t size) {
+    const bool block = S_ISBLK(st->st_mode);
+    const dev_t dev = block ? st->st_rdev : st->st_dev;
+    char model[64];
+    if (read_sysfs(dev, "device/model", model, sizeof(model)))
+        snprintf(name, size, "%s %s", block ? "disk" : "file on", model);
+    else
+        snprintf(name, size, "%s %u:%u", block ? "disk" : "file on", (unsigned) major(dev), (unsigned) minor(dev));
+}
+
+void device_name(const int isofd, char *const name, const size_t size) {
+    struct stat st;
+    if (fstat(isofd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+        name_device(&st, name, size);
+    else
+        snprintf(name, size, "stream");
+}
+
+/* Fill in the name, sector size and readahead window of the device. */
+static void probe_device(const int isofd, const struct stat *const st, struct isomd5sum_io_profile *const profile) {
+    const bool block = S_ISBLK(st->st_mode);
+    const dev_t dev = block ? st->st_rdev : st->st_dev;
+    name_device(st, profile->device, sizeof(profile->device));
+
+#ifdef __linux__
+    if (block) {
+        int sector_size = 0;
+        long readahead = 0;
+        if (ioctl(isofd, BLKSSZGET, &sector_size) == 0)
+            profile->sector_size = sector_size;
+        /* The readahead window is counted in 512 byte sectors. */
+        if (ioctl(isofd, BLKRAGET, &readahead) == 0)
+            profile->readahead = (long long) readahead * 512LL;
+        return;
+    }
+    char value[32];
+    if (read_sysfs(dev, "queue/logical_block_size", value, sizeof(value)))
+        profile->sector_size = atoll(value);
+    if (read_sysfs(dev, "queue/read_ahead_kb", value, sizeof(value)))
+        profile->readahead = atoll(value) * 1024LL;
+#else
+    (void) isofd;
+#endif
+}
+
+/* Return the share of the first size bytes of isofd in the page cache. */
+static double resident_share(const int isofd, const int64_t size) {
+#ifdef __linux__
+    const size_t pagesize = (size_t) getpagesize();
+    const size_t pages = (size_t) ((size + (int64_t) pagesize - 1) / (int64_t) pagesize);
+    void *const map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, isofd, 0);
+    if (map == MAP_FAILED)
+        return 0.0;
+    unsigned char *const vec = malloc(pages);
+    size_t resident = 0;
+    if (vec != NULL && mincore(map, (size_t) size, vec) == 0) {
+        for (size_t i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+    }
+    free(vec);
+    munmap(map, (size_t) size);
+    return (double) resident / (double) pages;
+#else
+    (void) isofd;
+    (void) size;
+    return 0.0;
+#endif
+}
+
+/* Take the read size stored for the device of profile, if any. */
+static bool load_profile(const char *const path, struct isomd5sum_io_profile *const profile) {
+    FILE *const file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+    char line[512];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file)) {
+        long long read_size;
+        double mb_per_s;
+        int name;
+        if (sscanf(line, "%lld %lf %n", &read_size, &mb_per_s, &name) < 2)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line + name, profile->device) || read_size < READ_BUFFER_SIZE || read_size > MAX_READ_SIZE)
+            continue;
+        profile->read_size = read_size;
+        profile->mb_per_s = mb_per_s;
+        found = true;
+    }
+    fclose(file);
+    return found;
+}
+
+/* Replace the line of the device in the profiles file, or add one. */
+static void store_profile(const char *const path, const struct isomd5sum_io_profile *const profile) {
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.%ld", path, (long) getpid()) >= (int) sizeof(temp))
+        return;
+    FILE *const out = fopen(temp, "w");
+    if (out == NULL)
+        return;
+    char device[sizeof(profile->device) + 1];
+    snprintf(device, sizeof(device), "%s\n", profile->device);
+    FILE *const in = fopen(path, "r");
+    if (in != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), in)) {
+            long long read_size;
+            double mb_per_s;
+            int name = 0;
+            if (sscanf(line, "%lld %lf %n", &read_size, &mb_per_s, &name) >= 2 && !strcmp(line + name, device))
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%lld %.1f %s\n", profile->read_size, profile->mb_per_s, profile->device);
+    if (fclose(out) || rename(temp, path))
+        unlink(temp);
+}
+
+/* Return the throughput in MB/s of reading SAMPLE_SIZE at offset in pieces of read_size. */
+static double sample_rate(const int isofd, unsigned char *const buffer, const int64_t offset, const size_t read_size) {
+    const int64_t start = monotonic_ns();
+    int64_t done = 0;
+    while (done < SAMPLE_SIZE) {
+        const ssize_t nread = pread(isofd, buffer, read_size, offset + done);
+        if (nread <= 0)
+            return 0.0;
+        done += nread;
+    }
+    const int64_t elapsed = MAX(monotonic_ns() - start, 1LL);
+    return (double) done * 1e3 / (double) elapsed;
+}
+
+/* Sample the candidate read sizes on separate areas of the image. */
+static void sample_profile(const int isofd, const int64_t size, struct isomd5sum_io_profile *const profile) {
+    long long candidates[MAX_CANDIDATES] = { 32 * 1024, 128 * 1024, 512 * 1024, 2 * 1024 * 1024 };
+    size_t count = 4;
+    /* Reads matching the readahead window of the device may suit it best. */
+    const long long window = profile->readahead / READ_BUFFER_SIZE * READ_BUFFER_SIZE;
+    if (window > READ_BUFFER_SIZE && window <= MAX_READ_SIZE) {
+        bool known = false;
+        for (size_t i = 0; i < count; i++)
+            known |= candidates[i] == window;
+        if (!known)
+            candidates[count++] = window;
+    }
+    /* Leave small images to the default, sampling would read most of them. */
+    if (size < (int64_t) (4 * count) * SAMPLE_SIZE)
+        return;
+
+    long long largest = 0;
+    for (size_t i = 0; i < count; i++)
+        largest = MAX(largest, candidates[i]);
+    unsigned char *const buffer = aligned_alloc((size_t) getpagesize(), (size_t) largest);
+    if (buffer == NULL)
+        return;
+    double rates[MAX_CANDIDATES];
+    double best = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        const int64_t offset = size / (int64_t) (count + 1) * (int64_t) (i + 1) / MAX_READ_SIZE * MAX_READ_SIZE;
+        rates[i] = sample_rate(isofd, buffer, offset, (size_t) candidates[i]);
+        best = MAX(best, rates[i]);
+    }
+    aligned_free(buffer);
+    if (best == 0.0)
+        return;
+    for (size_t i = 0; i < count; i++) {
+        if (rates[i] >= SAMPLE_TOLERANCE * best &&
+            (profile->source != ISOMD5SUM_IO_SAMPLED || candidates[i] < profile->read_size)) {
+            profile->read_size = candidates[i];
+            profile->mb_per_s = rates[i];
+            profile->source = ISOMD5SUM_IO_SAMPLED;
+        }
+    }
+}
+
+int isomd5sumContextAutoTune(struct isomd5sum_context *ctx, int isofd, const char *profiles,
+                             struct isomd5sum_io_profile *result) {
+    struct stat st;
+    if (fstat(isofd, &st) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+        return -1;
+    const int64_t size = lseek(isofd, 0LL, SEEK_END);
+    if (size <= 0 || lseek(isofd, 0LL, SEEK_SET) < 0)
+        return -1;
+
+    struct isomd5sum_io_profile profile;
+    memset(&profile, 0, sizeof(profile));
+    profile.read_size = READ_BUFFER_SIZE;
+    profile.source = ISOMD5SUM_IO_DEFAULT;
+    probe_device(isofd, &st, &profile);
+    profile.resident = resident_share(isofd, size);
+
+    if (profile.resident >= RESIDENT_SHARE) {
+        /* Says nothing about the device, so it isn't stored. */
+        profile.read_size = CACHED_READ_SIZE;
+        profile.source = ISOMD5SUM_IO_CACHED;
+    } else if (profiles && load_profile(profiles, &profile)) {
+        profile.source = ISOMD5SUM_IO_STORED;
+    } else {
+        sample_profile(isofd, size, &profile);
+        if (profiles && profile.source == ISOMD5SUM_IO_SAMPLED)
+            store_profile(profiles, &profile);
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* Let the kernel read further ahead of a device it has to go to. */
+    if (profile.source != ISOMD5SUM_IO_CACHED)
+        posix_fadvise(isofd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (result)
+        *result = profile;
+    return isomd5sumContextSetReadSize(ctx, profile.read_size);
+}
+
+#else
+
+void device_name(const int isofd, char *const name, const size_t size) {
+    (void) isofd;
+    snprintf(name, size, "unknown");
+}
+
+int isomd5sumContextAutoTune(struct isomd5sum_context *ctx, int isofd, const char *profiles,
+                             struct isomd5sum_io_profile *result) {
+    (void) ctx;
+    (void) isofd;
+    (void) profiles;
+    (void) result;
+    return -1;
+}
+
+#endif
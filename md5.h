@@ -27,4 +27,7 @@ void MD5_Final(unsigned char digest[16], struct MD5Context *);
 
 typedef struct MD5Context MD5_CTX;
 
+/* Name of this MD5 implementation, reported in the statistics. */
+#define MD5_ENGINE "generic"
+
 #endif				/* MD5_H */
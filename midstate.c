@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "midstate.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* The cache file is a header followed by records, appended by every run. */
+static const char cache_magic[8] = "ISOMD5MS";
+#define CACHE_VERSION 1
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t interval;
+};
+
+struct midstate_record {
+    uint64_t key[2];
+    int64_t offset;         /* 0 marks an empty slot of the table */
+    uint32_t buf[4];
+    uint32_t bits[2];
+};
+
+struct midstate_cache {
+    char *path;
+    /* Open addressing table of the records read from the file and added. */
+    struct midstate_record *table;
+    size_t capacity;
+    size_t count;
+    /* Records added since the last write. */
+    struct midstate_record *added;
+    size_t added_count;
+    size_t added_capacity;
+    int64_t loaded_size;    /* Bytes of the file read into the table */
+    bool readonly;          /* The file is no cache of this version */
+    unsigned char pending[MIDSTATE_INTERVAL];
+};
+
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+
+static inline uint64_t rotl64(const uint64_t x, const int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Mix a stripe of MIDSTATE_STRIPE bytes into the four lanes. */
+static inline void digest_stripe(uint64_t *const lanes, const unsigned char *const stripe) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t word;
+        memcpy(&word, stripe + 8 * i, sizeof(word));
+        lanes[i] = rotl64(lanes[i] + word * PRIME2, 31) * PRIME1;
+    }
+}
+
+static void digest_update(struct midstate_run *const run, const unsigned char *data, size_t len) {
+    if (run->tail_size > 0) {
+        const size_t fill = MIN(len, MIDSTATE_STRIPE - run->tail_size);
+        memcpy(run->tail + run->tail_size, data, fill);
+        run->tail_size += fill;
+        data += fill;
+        len -= fill;
+        if (run->tail_size < MIDSTATE_STRIPE)
+            return;
+        digest_stripe(run->lanes, run->tail);
+        run->tail_size = 0;
+    }
+    for (; len >= MIDSTATE_STRIPE; data += MIDSTATE_STRIPE, len -= MIDSTATE_STRIPE)
+        digest_stripe(run->lanes, data);
+    memcpy(run->tail, data, len);
+    run->tail_size = len;
+}
+
+/* Key of the prefix ending at a checkpoint, which is a multiple of the stripe. */
+static void digest_key(const struct midstate_run *const run, uint64_t *const key) {
+    const uint64_t *const l = run->lanes;
+    key[0] = avalanche(rotl64(l[0], 1) + rotl64(l[1], 7) + rotl64(l[2], 12) + rotl64(l[3], 18) +
+                       (uint64_t) run->offset * PRIME1);
+    key[1] = avalanche((l[0] ^ rotl64(l[1], 23)) * PRIME3 + (l[2] ^ rotl64(l[3], 41)) * PRIME2 +
+                       (uint64_t) run->offset);
+}
+
+static struct midstate_record *find_slot(struct midstate_cache *const cache, const uint64_t *const key,
+                                         const int64_t offset) {
+    size_t i = (size_t) key[0] & (cache->capacity - 1);
+    for (;; i = (i + 1) & (cache->capacity - 1)) {
+        struct midstate_record *const slot = &cache->table[i];
+        if (slot->offset == 0 ||
+            (slot->offset == offset && slot->key[0] == key[0] && slot->key[1] == key[1]))
+            return slot;
+    }
+}
+
+static bool insert_record(struct midstate_cache *const cache, const struct midstate_record *const record) {
+    if (2 * (cache->count + 1) > cache->capacity) {
+        const size_t capacity = cache->capacity ? 2 * cache->capacity : 4096;
+        struct midstate_record *const table = calloc(capacity, sizeof(*table));
+        if (table == NULL)
+            return false;
+        struct midstate_record *const old = cache->table;
+        const size_t old_capacity = cache->capacity;
+        cache->table = table;
+        cache->capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].offset != 0)
+                *find_slot(cache, old[i].key, old[i].offset) = old[i];
+        }
+        free(old);
+    }
+    struct midstate_record *const slot = find_slot(cache, record->key, record->offset);
+    if (slot->offset == 0)
+        cache->count++;
+    *slot = *record;
+    return true;
+}
+
+#ifndef _WIN32
+/* Records are trusted to skip hashing, so only a file nobody else could have
+ * written to is used. */
+static bool trusted(const int fd, struct stat *const st) {
+    if (fstat(fd, st))
+        return false;
+    if (!S_ISREG(st->st_mode) || st->st_uid != geteuid() || (st->st_mode & (S_IWGRP | S_IWOTH))) {
+        errno = EPERM;
+        return false;
+    }
+    return true;
+}
+#endif
+
+/* Read the records other runs added to the file since it was last read. */
+static void load_cache(struct midstate_cache *const cache) {
+#ifndef _WIN32
+    const int fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (!trusted(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    if (st.st_size < cache->loaded_size) {
+        /* Replaced by a smaller file, start over. */
+        cache->count = 0;
+        if (cache->table)
+            memset(cache->table, 0, cache->capacity * sizeof(*cache->table));
+        cache->loaded_size = 0;
+    }
+    if (cache->loaded_size == 0) {
+        struct cache_header header;
+        if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+            memcmp(header.magic, cache_magic, sizeof(cache_magic)) || header.version != CACHE_VERSION ||
+            header.interval != MIDSTATE_INTERVAL) {
+            cache->readonly = true;
+            close(fd);
+            return;
+        }
+        cache->loaded_size = sizeof(header);
+    }
+
+    struct midstate_record records[256];
+    for (;;) {
+        const ssize_t nread = pread(fd, records, sizeof(records), cache->loaded_size);
+        if (nread < (ssize_t) sizeof(*records))
+            break;
+        const size_t count = (size_t) nread / sizeof(*records);
+        for (size_t i = 0; i < count; i++) {
+            if (records[i].offset <= 0 || !insert_record(cache, &records[i]))
+                break;
+        }
+        cache->loaded_size += (int64_t) (count * sizeof(*records));
+    }
+    close(fd);
+#else
+    (void) cache;
+#endif
+}
+
+/* Append the records added by the last run to the file. */
+static void store_cache(struct midstate_cache *const cache) {
+#ifndef _WIN32
+    const int fd = cache->added_count == 0 || cache->readonly ? -1 :
+                   open(cache->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        cache->added_count = 0;
+        return;
+    }
+    /* Concurrent runs append whole batches of records. */
+    flock(fd, LOCK_EX);
+    struct stat st;
+    bool ok = trusted(fd, &st);
+    if (ok && st.st_size == 0) {
+        struct cache_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, cache_magic, sizeof(cache_magic));
+        header.version = CACHE_VERSION;
+        header.interval = MIDSTATE_INTERVAL;
+        ok = write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header);
+    }
+    const size_t size = cache->added_count * sizeof(*cache->added);
+    if (ok && write(fd, cache->added, size) != (ssize_t) size) {
+        /* Cut off a partial record, it would misalign the ones after it. */
+        if (ftruncate(fd, st.st_size))
+            cache->readonly = true;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+#endif
+    cache->added_count = 0;
+}
+
+struct midstate_cache *midstate_cache_open(const char *const path) {
+#ifdef _WIN32
+    (void) path;
+    errno = ENOSYS;
+    return NULL;
+#else
+    struct midstate_cache *const cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+    cache->path = strdup(path);
+    if (cache->path == NULL) {
+        free(cache);
+        return NULL;
+    }
+    /* Fail early for a cache that could never be written or be trusted. */
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || !trusted(fd, &st)) {
+        const int error = errno;
+        if (fd >= 0)
+            close(fd);
+        midstate_cache_close(cache);
+        errno = error;
+        return NULL;
+    }
+    close(fd);
+    return cache;
+#endif
+}
+
+void midstate_cache_close(struct midstate_cache *const cache) {
+    if (cache == NULL)
+        return;
+    free(cache->path);
+    free(cache->table);
+    free(cache->added);
+    free(cache);
+}
+
+void midstate_begin(struct midstate_run *const run, struct midstate_cache *const cache) {
+    memset(run, 0, sizeof(*run));
+    run->cache = cache;
+    if (cache == NULL)
+        return;
+    run->lanes[0] = PRIME1 + PRIME2;
+    run->lanes[1] = PRIME2;
+    run->lanes[2] = 0;
+    run->lanes[3] = 0 - PRIME1;
+    load_cache(cache);
+}
+
+void midstate_sync(struct midstate_run *const run, MD5_CTX *const hashctx) {
+    if (!run->skipping)
+        return;
+    MD5_Update(hashctx, run->cache->pending, (unsigned) run->pending_size);
+    run->skipping = false;
+    run->pending_size = 0;
+}
+
+static void add_record(struct midstate_cache *const cache, const struct midstate_record *const record) {
+    if (cache->added_count == cache->added_capacity) {
+        const size_t capacity = cache->added_capacity ? 2 * cache->added_capacity : 256;
+        struct midstate_record *const added = realloc(cache->added, capacity * sizeof(*added));
+        if (added == NULL)
+            return;
+        cache->added = added;
+        cache->added_capacity = capacity;
+    }
+    if (insert_record(cache, record))
+        cache->added[cache->added_count++] = *record;
+}
+
+/* Continue from the cached state of this prefix, or cache the state. */
+static void checkpoint(struct midstate_run *const run, MD5_CTX *const hashctx) {
+    struct midstate_cache *const cache = run->cache;
+    struct midstate_record record;
+    digest_key(run, record.key);
+    record.offset = run->offset;
+
+    const struct midstate_record *const cached =
+        cache->capacity ? find_slot(cache, record.key, record.offset) : NULL;
+    if (cached && cached->offset != 0) {
+        memcpy(hashctx->buf, cached->buf, sizeof(hashctx->buf));
+        memcpy(hashctx->bits, cached->bits, sizeof(hashctx->bits));
+        run->skipped += (int64_t) run->pending_size;
+        run->skipping = true;
+        run->pending_size = 0;
+        return;
+    }
+    midstate_sync(run, hashctx);
+    memcpy(record.buf, hashctx->buf, sizeof(record.buf));
+    memcpy(record.bits, hashctx->bits, sizeof(record.bits));
+    add_record(cache, &record);
+}
+
+void midstate_update(struct midstate_run *const run, MD5_CTX *const hashctx,
+                     const unsigned char *data, size_t len) {
+    if (run->cache == NULL) {
+        MD5_Update(hashctx, data, (unsigned) len);
+        return;
+    }
+    while (len > 0) {
+        /* Split the data at checkpoints, keeping at most an interval. */
+        const size_t piece = MIN(len, (size_t) (MIDSTATE_INTERVAL - run->offset % MIDSTATE_INTERVAL));
+        digest_update(run, data, piece);
+        if (run->skipping) {
+            memcpy(run->cache->pending + run->pending_size, data, piece);
+            run->pending_size += piece;
+        } else {
+            MD5_Update(hashctx, data, (unsigned) piece);
+        }
+        run->offset += (int64_t) piece;
+        data += piece;
+        len -= piece;
+        if (run->offset % MIDSTATE_INTERVAL == 0)
+            checkpoint(run, hashctx);
+    }
+}
+
+void midstate_end(struct midstate_run *const run) {
+    if (run->cache)
+        store_cache(run->cache);
+}
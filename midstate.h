@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef ISOMD5_MIDSTATE_H
+#define ISOMD5_MIDSTATE_H
+
+/*
+ * Cache of md5 states at every MIDSTATE_INTERVAL bytes of the images hashed,
+ * keyed by a cheap digest of all bytes up to there. Images sharing a prefix
+ * with one hashed before, like variants of a build differing only in a late
+ * area, still have to be read, but md5 only runs where the state is needed:
+ * at fragment boundaries, after the images diverge and at the end. The key
+ * is no cryptographic hash, so only implants use the cache: a colliding
+ * prefix there implants a wrong md5sum, which every check then fails, while
+ * in a check it would pass an image that was never hashed.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "md5.h"
+
+#define MIDSTATE_INTERVAL (1024 * 1024)
+#define MIDSTATE_STRIPE 32
+
+struct midstate_cache;
+
+/* Hashing of one image through a cache. */
+struct midstate_run {
+    struct midstate_cache *cache;
+    uint64_t lanes[4];      /* Digest of the bytes so far */
+    unsigned char tail[MIDSTATE_STRIPE];
+    size_t tail_size;
+    int64_t offset;
+    /* Set while the md5 state is the one cached at offset - pending_size,
+     * the bytes from there are only kept. */
+    bool skipping;
+    size_t pending_size;
+    int64_t skipped;        /* Bytes that were never hashed */
+};
+
+/* Return NULL with errno set if path can't be used as a cache, which is also
+ * the case for files of other users or writable by group or others. */
+struct midstate_cache *midstate_cache_open(const char *const path);
+
+void midstate_cache_close(struct midstate_cache *const cache);
+
+/* Start hashing an image through cache, which may be NULL. */
+void midstate_begin(struct midstate_run *const run, struct midstate_cache *const cache);
+
+/* Use instead of MD5_Update for the next len bytes of the image. */
+void midstate_update(struct midstate_run *const run, MD5_CTX *const hashctx,
+                     const unsigned char *data, size_t len);
+
+/* Bring hashctx up to date before it is read. */
+void midstate_sync(struct midstate_run *const run, MD5_CTX *const hashctx);
+
+/* Store the states of the image not cached yet. */
+void midstate_end(struct midstate_run *const run);
+
+#endif
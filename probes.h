@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef ISOMD5_PROBES_H
+#define ISOMD5_PROBES_H
+
+/*
+ * USDT probes of the isomd5sum provider for bpftrace, perf and SystemTap.
+ * Until a tracer attaches, a probe is a single nop. Without sys/sdt.h, or
+ * with ISOMD5SUM_NO_PROBES defined, they are compiled out.
+ *
+ *   check__start(total)            diagnose__start(total)
+ *   check__done(status)            diagnose__done(status)
+ *   check__abort(offset)           implant__start(total)
+ *   read__start(offset, size)      implant__done(result)
+ *   read__done(offset, nread)      appdata__clear(offset, length)
+ *   fragment__done(fragment, valid)
+ */
+
+#if !defined(ISOMD5SUM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ISOMD5SUM_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef ISOMD5SUM_HAVE_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(isomd5sum, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(isomd5sum, name, a, b)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#endif
+
+#endif /* ISOMD5_PROBES_H */
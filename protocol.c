@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* isomd5d needs Unix sockets, Windows clients always check locally. */
+#ifndef _WIN32
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+const char *daemon_socket_path(void) {
+    const char *const path = getenv(ISOMD5D_SOCKET_ENV);
+    return path && *path ? path : ISOMD5D_SOCKET;
+}
+
+/**
+ * Connect to the daemon. Return the socket or -1 if it isn't running.
+ */
+int daemon_connect(void) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    const char *const path = daemon_socket_path();
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *) &address, sizeof(address))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Send the request line together with fd.
+ */
+bool send_request(const int sock, const char *const request, const int fd) {
+    char line[PROTOCOL_LINE_SIZE];
+    const int len = snprintf(line, sizeof(line), "%s\n", request);
+    if (len < 0 || (size_t) len >= sizeof(line))
+        return false;
+
+    struct iovec data = { .iov_base = line, .iov_len = (size_t) len };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {
+        .msg_iov = &data,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+    struct cmsghdr *const header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    ssize_t sent;
+    while ((sent = sendmsg(sock, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    return sent == len;
+}
+
+/**
+ * Receive a request line and the descriptor sent with it, -1 if there is none.
+ */
+bool receive_request(const int sock, char *const request, const size_t size, int *const fd) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec data = { .iov_base = request, .iov_len = size - 1 };
+    struct msghdr message = {
+        .msg_iov = &data,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+
+    *fd = -1;
+    ssize_t received;
+    while ((received = recvmsg(sock, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (received <= 0)
+        return false;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(header), sizeof(int));
+    }
+    request[received] = '\0';
+    /* A request is a single line sent in one message. */
+    char *const end = strchr(request, '\n');
+    if (end == NULL || (message.msg_flags & MSG_CTRUNC))
+        return false;
+    *end = '\0';
+    return true;
+}
+
+/**
+ * Read the next line without its newline. Return false at end of stream.
+ */
+bool read_line(struct line_reader *const reader, char *const line, const size_t size) {
+    for (;;) {
+        char *const end = memchr(reader->buffer, '\n', reader->len);
+        if (end != NULL) {
+            const size_t len = (size_t)(end - reader->buffer);
+            snprintf(line, size, "%.*s", (int) len, reader->buffer);
+            reader->len -= len + 1;
+            memmove(reader->buffer, end + 1, reader->len);
+            return true;
+        }
+        if (reader->len == sizeof(reader->buffer))
+            return false;
+        const ssize_t nread = read(reader->fd, reader->buffer + reader->len, sizeof(reader->buffer) - reader->len);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            return false;
+        reader->len += (size_t) nread;
+    }
+}
+
+bool write_line(const int sock, const char *const format, ...) {
+    char line[PROTOCOL_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    const int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (len < 0 || (size_t) len >= sizeof(line) - 1)
+        return false;
+    line[len] = '\n';
+
+    for (size_t done = 0; done <= (size_t) len;) {
+        const ssize_t sent = send(sock, line + done, (size_t) len + 1 - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        done += (size_t) sent;
+    }
+    return true;
+}
+
+/**
+ * Pass progress lines to cb until the result arrives and store it in result
+ * and message. Return false if the stream ended or cb asked to detach.
+ */
+bool read_result(const int sock, progressCallback cb, void *cbdata, int *const result,
+                 char *const message, const size_t size) {
+    struct line_reader reader = { .fd = sock, .len = 0 };
+    char line[PROTOCOL_LINE_SIZE];
+    while (read_line(&reader, line, sizeof(line))) {
+        long long offset, total;
+        int consumed = 0;
+        if (sscanf(line, "PROGRESS %lld %lld", &offset, &total) == 2) {
+            if (cb && cb(cbdata, offset, total))
+                return false;
+        } else if (sscanf(line, "RESULT %d %n", result, &consumed) == 1) {
+            if (message)
+                snprintf(message, size, "%s", consumed ? line + consumed : "");
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif /* _WIN32 */
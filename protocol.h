@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef ISOMD5_PROTOCOL_H
+#define ISOMD5_PROTOCOL_H
+
+/*
+ * isomd5d talks line based text over a Unix stream socket. A client sends
+ * one request together with the descriptor of the image it opened itself:
+ *
+ *   CHECK
+ *   IMPLANT <supported> <forceit>
+ *
+ * and the daemon answers with any number of progress lines followed by the
+ * result, where <status> is an enum isomd5sum_status for checks and the
+ * implantISOFD return value for implants:
+ *
+ *   PROGRESS <offset> <total>
+ *   RESULT <status> [<error message>]
+ *
+ * Closing the connection detaches the client; a job without clients left is
+ * aborted.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ISOMD5D_SOCKET "/run/isomd5d.sock"
+/* Environment variable overriding the socket path for clients and daemon. */
+#define ISOMD5D_SOCKET_ENV "ISOMD5D_SOCKET"
+#define PROTOCOL_LINE_SIZE 512
+
+/* Same as checkCallback, for non-zero return value the client detaches. */
+typedef int (*progressCallback)(void *, long long offset, long long total);
+
+struct line_reader {
+    int fd;
+    size_t len;
+    char buffer[PROTOCOL_LINE_SIZE];
+};
+
+const char *daemon_socket_path(void);
+
+int daemon_connect(void);
+
+bool send_request(const int sock, const char *const request, const int fd);
+
+bool receive_request(const int sock, char *const request, const size_t size, int *const fd);
+
+bool read_line(struct line_reader *const reader, char *const line, const size_t size);
+
+bool write_line(const int sock, const char *const format, ...);
+
+bool read_result(const int sock, progressCallback cb, void *cbdata, int *const result,
+                 char *const message, const size_t size);
+
+#endif /* ISOMD5_PROTOCOL_H */
@@ -16,77 +16,528 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 #include "libcheckisomd5.h"
 #include "libimplantisomd5.h"
 
-static PyObject *doCheckIsoMD5Sum(PyObject *s, PyObject *args);
-static PyObject *doImplantIsoMD5Sum(PyObject *s, PyObject *args);
+static PyObject *doCheckIsoMD5Sum(PyObject *s, PyObject *args, PyObject *kwargs);
+static PyObject *doImplantIsoMD5Sum(PyObject *s, PyObject *args, PyObject *kwargs);
+static PyObject *doCheckIsoMD5SumStats(PyObject *s, PyObject *args, PyObject *kwargs);
+static PyObject *doImplantIsoMD5SumStats(PyObject *s, PyObject *args, PyObject *kwargs);
+
+static PyObject *doCheckIsoMD5SumBuffer(PyObject *s, PyObject *args, PyObject *kwargs);
+static PyObject *doImplantIsoMD5SumBuffer(PyObject *s, PyObject *args, PyObject *kwargs);
 
 static PyMethodDef isomd5sumMethods[] = {
-    { "checkisomd5sum", (PyCFunction) doCheckIsoMD5Sum, METH_VARARGS, NULL },
-    { "implantisomd5sum", (PyCFunction) doImplantIsoMD5Sum, METH_VARARGS, NULL },
+    { "checkisomd5sum", (PyCFunction) doCheckIsoMD5Sum, METH_VARARGS | METH_KEYWORDS, NULL },
+    { "implantisomd5sum", (PyCFunction) doImplantIsoMD5Sum, METH_VARARGS | METH_KEYWORDS, NULL },
+    { "checkisomd5sum_stats", (PyCFunction) doCheckIsoMD5SumStats, METH_VARARGS | METH_KEYWORDS, NULL },
+    { "implantisomd5sum_stats", (PyCFunction) doImplantIsoMD5SumStats, METH_VARARGS | METH_KEYWORDS, NULL },
+    { "checkisomd5sum_buffer", (PyCFunction) doCheckIsoMD5SumBuffer, METH_VARARGS | METH_KEYWORDS, NULL },
+    { "implantisomd5sum_buffer", (PyCFunction) doImplantIsoMD5SumBuffer, METH_VARARGS | METH_KEYWORDS, NULL },
     { NULL }
 };
 
+static char *checkKeywords[] = { "isofile", "callback", "interval", "fd", NULL };
+static char *implantKeywords[] = { "isofile", "supported", "forceit", "fd", NULL };
+
+/* A callback called while the GIL is released for the check. */
+struct pythonCallback {
+    PyObject *callback;
+    PyThreadState *state;
+};
+
 /* Call python object with offset and total
- * If the object returns true return 1 to abort the check
+ * If the object returns true or raises return 1 to abort the check
  */
 int pythonCB(void *cbdata, long long offset, long long total) {
+    struct pythonCallback *const cb = cbdata;
     PyObject *arglist, *result;
     int rc;
 
+    PyEval_RestoreThread(cb->state);
     arglist = Py_BuildValue("(LL)", offset, total);
-    result = PyObject_CallObject(cbdata, arglist);
+    result = PyObject_CallObject(cb->callback, arglist);
     Py_DECREF(arglist);
 
-    if (result == NULL)
-        return 1;
+    if (result == NULL) {
+        rc = 1;
+    } else {
+        rc = PyObject_IsTrue(result);
+        Py_DECREF(result);
+    }
+    cb->state = PyEval_SaveThread();
+    return (rc != 0);
+}
 
-    rc = PyObject_IsTrue(result);
-    Py_DECREF(result);
-    return (rc > 0);
+/* Exactly one of isofile and fd names the image. */
+static int validArgs(const char *isofile, int fd, PyObject *callback) {
+    if ((isofile == NULL) == (fd < 0)) {
+        PyErr_SetString(PyExc_TypeError, "pass either isofile or fd");
+        return 0;
+    }
+    if (callback && callback != Py_None && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+        return 0;
+    }
+    return 1;
 }
 
-static PyObject *doCheckIsoMD5Sum(PyObject *s, PyObject *args) {
+/* Check isofile or fd through ctx without holding the GIL, which is only
+ * taken back to call callback. */
+static int checkContext(struct isomd5sum_context *ctx, const char *isofile, int fd, PyObject *callback) {
+    struct pythonCallback cb = { callback, NULL };
+    const int hasCallback = callback && callback != Py_None;
+    int rc;
+
+    cb.state = PyEval_SaveThread();
+    int isofd = fd >= 0 ? fd : open(isofile, O_RDONLY | O_BINARY);
+    if (isofd < 0) {
+        rc = ISOMD5SUM_FILE_NOT_FOUND;
+    } else {
+        rc = mediaCheckContext(ctx, isofd, hasCallback ? pythonCB : NULL, &cb);
+        if (fd < 0)
+            close(isofd);
+    }
+    PyEval_RestoreThread(cb.state);
+    return rc;
+}
+
+/* Implant into isofile or fd through ctx without holding the GIL. */
+static int implantContext(struct isomd5sum_context *ctx, const char *isofile, int fd, int supported, int forceit) {
+    char *errstr;
+    int rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    int isofd = fd >= 0 ? fd : open(isofile, O_RDWR | O_BINARY);
+    if (isofd < 0) {
+        rc = -1;
+    } else {
+        rc = implantISOContext(ctx, isofd, supported, forceit, 1, &errstr);
+        if (fd < 0)
+            close(isofd);
+    }
+    Py_END_ALLOW_THREADS
+    return rc;
+}
+
+static PyObject *doCheckIsoMD5Sum(PyObject *s, PyObject *args, PyObject *kwargs) {
     PyObject *callback = NULL;
-    char *isofile;
+    char *isofile = NULL;
+    /* Milliseconds between callbacks, the default of the library. */
+    int interval = 100;
+    int fd = -1;
     int rc;
 
-    if (!PyArg_ParseTuple(args, "s|O", &isofile, &callback))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zOii", checkKeywords, &isofile, &callback, &interval, &fd))
+        return NULL;
+    if (!validArgs(isofile, fd, callback))
         return NULL;
 
-    if (callback) {
-        if (!PyCallable_Check(callback)) {
-            PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-            return NULL;
-        }
+    struct isomd5sum_context *ctx = isomd5sumContextNew();
+    if (ctx == NULL)
+        return PyErr_NoMemory();
+    isomd5sumContextSetProgressInterval(ctx, interval);
+    rc = checkContext(ctx, isofile, fd, callback);
+    isomd5sumContextFree(ctx);
 
-        rc = mediaCheckFile(isofile, pythonCB, callback);
-        Py_DECREF(callback);
-    } else {
-        rc = mediaCheckFile(isofile, NULL, NULL);
+    if (PyErr_Occurred())
+        return NULL;
+    return Py_BuildValue("i", rc);
+}
+
+static PyObject *doImplantIsoMD5Sum(PyObject *s, PyObject *args, PyObject *kwargs) {
+    char *isofile = NULL;
+    int forceit, supported;
+    int fd = -1;
+    int rc;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "zii|i", implantKeywords, &isofile, &supported, &forceit, &fd))
+        return NULL;
+    if (!validArgs(isofile, fd, NULL))
+        return NULL;
+
+    struct isomd5sum_context *ctx = isomd5sumContextNew();
+    if (ctx == NULL)
+        return PyErr_NoMemory();
+    rc = implantContext(ctx, isofile, fd, supported, forceit);
+    isomd5sumContextFree(ctx);
+
+    return Py_BuildValue("i", rc);
+}
+
+/* Return (rc, stats) with the statistics of the last run through ctx as a dict. */
+static PyObject *resultWithStats(int rc, struct isomd5sum_context *ctx) {
+    struct isomd5sum_stats stats;
+    isomd5sumContextStats(ctx, &stats);
+    isomd5sumContextFree(ctx);
+
+    if (PyErr_Occurred())
+        return NULL;
+    return Py_BuildValue("(i{s:s,s:L,s:L,s:L,s:L,s:d,s:d,s:d,s:d,s:d,s:d})", rc,
+                         "engine", stats.engine,
+                         "bytes_read", stats.bytes_read,
+                         "read_calls", stats.read_calls,
+                         "short_reads", stats.short_reads,
+                         "peak_buffer", stats.peak_buffer,
+                         "read_seconds", stats.read_seconds,
+                         "throttle_seconds", stats.throttle_seconds,
+                         "hash_seconds", stats.hash_seconds,
+                         "validate_seconds", stats.validate_seconds,
+                         "callback_seconds", stats.callback_seconds,
+                         "total_seconds", stats.total_seconds);
+}
+
+static PyObject *doCheckIsoMD5SumStats(PyObject *s, PyObject *args, PyObject *kwargs) {
+    PyObject *callback = NULL;
+    char *isofile = NULL;
+    int interval = 100;
+    int fd = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zOii", checkKeywords, &isofile, &callback, &interval, &fd))
+        return NULL;
+    if (!validArgs(isofile, fd, callback))
+        return NULL;
+
+    struct isomd5sum_context *ctx = isomd5sumContextNew();
+    if (ctx == NULL)
+        return PyErr_NoMemory();
+    isomd5sumContextEnableStats(ctx, 1);
+    isomd5sumContextSetProgressInterval(ctx, interval);
+
+    return resultWithStats(checkContext(ctx, isofile, fd, callback), ctx);
+}
+
+static PyObject *doImplantIsoMD5SumStats(PyObject *s, PyObject *args, PyObject *kwargs) {
+    char *isofile = NULL;
+    int forceit, supported;
+    int fd = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "zii|i", implantKeywords, &isofile, &supported, &forceit, &fd))
+        return NULL;
+    if (!validArgs(isofile, fd, NULL))
+        return NULL;
+
+    struct isomd5sum_context *ctx = isomd5sumContextNew();
+    if (ctx == NULL)
+        return PyErr_NoMemory();
+    isomd5sumContextEnableStats(ctx, 1);
+
+    return resultWithStats(implantContext(ctx, isofile, fd, supported, forceit), ctx);
+}
+
+/* Check an image held in any object supporting the buffer protocol, in place. */
+static PyObject *doCheckIsoMD5SumBuffer(PyObject *s, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "buffer", "callback", NULL };
+    PyObject *buffer, *callback = NULL;
+    Py_buffer view;
+    int rc;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", keywords, &buffer, &callback))
+        return NULL;
+    if (callback == Py_None)
+        callback = NULL;
+    if (callback && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+        return NULL;
     }
+    if (PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE))
+        return NULL;
 
+    struct pythonCallback cb = { callback, NULL };
+    cb.state = PyEval_SaveThread();
+    rc = mediaCheckBuffer(view.buf, (size_t) view.len, callback ? pythonCB : NULL, &cb);
+    PyEval_RestoreThread(cb.state);
+    PyBuffer_Release(&view);
+
+    if (PyErr_Occurred())
+        return NULL;
     return Py_BuildValue("i", rc);
 }
 
-static PyObject *doImplantIsoMD5Sum(PyObject *s, PyObject *args) {
-    char *isofile, *errstr;
+/* Implant into an image held in a writable buffer, in place. */
+static PyObject *doImplantIsoMD5SumBuffer(PyObject *s, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "buffer", "supported", "forceit", NULL };
+    PyObject *buffer;
+    char *errstr;
     int forceit, supported;
+    Py_buffer view;
+    int rc;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oii", keywords, &buffer, &supported, &forceit))
+        return NULL;
+    if (PyObject_GetBuffer(buffer, &view, PyBUF_WRITABLE))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = implantISOBuffer(view.buf, (size_t) view.len, supported, forceit, 1, &errstr);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+
+    return Py_BuildValue("i", rc);
+}
+
+/* Incremental hashing of an image passed in pieces. */
+typedef struct {
+    PyObject_HEAD
+    struct isomd5sum_hasher *hasher;
+    int implant;
+    /* Set while update runs without the GIL. */
+    int busy;
+} HasherObject;
+
+static int Hasher_init(HasherObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "implant", NULL };
+    int implant = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", keywords, &implant))
+        return -1;
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "hasher is in use");
+        return -1;
+    }
+    isomd5sumHasherFree(self->hasher);
+    self->implant = implant != 0;
+    self->hasher = isomd5sumHasherNew(self->implant ? ISOMD5SUM_HASHER_IMPLANT : ISOMD5SUM_HASHER_CHECK);
+    if (self->hasher == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static void Hasher_dealloc(HasherObject *self) {
+    isomd5sumHasherFree(self->hasher);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int Hasher_ready(HasherObject *self) {
+    if (self->hasher == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "hasher is not initialized");
+        return 0;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "hasher is in use");
+        return 0;
+    }
+    return 1;
+}
+
+/* Hash the next piece of the image, return the check status so far. */
+static PyObject *Hasher_update(HasherObject *self, PyObject *args) {
+    PyObject *data;
+    Py_buffer view;
     int rc;
 
-    if (!PyArg_ParseTuple(args, "sii", &isofile, &supported, &forceit))
+    if (!PyArg_ParseTuple(args, "O", &data))
+        return NULL;
+    if (!Hasher_ready(self) || PyObject_GetBuffer(data, &view, PyBUF_SIMPLE))
+        return NULL;
+
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    rc = isomd5sumHasherUpdate(self->hasher, view.buf, (size_t) view.len);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+    PyBuffer_Release(&view);
+
+    return Py_BuildValue("i", rc);
+}
+
+/* Return the result of checking the image hashed so far. */
+static PyObject *Hasher_result(HasherObject *self, PyObject *unused) {
+    if (!Hasher_ready(self))
+        return NULL;
+    if (self->implant) {
+        PyErr_SetString(PyExc_ValueError, "hasher was created for implanting");
+        return NULL;
+    }
+    return Py_BuildValue("i", mediaCheckHasher(self->hasher));
+}
+
+/* Return (offset, appdata) to write into the image hashed for implanting. */
+static PyObject *Hasher_implant_data(HasherObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "supported", "forceit", NULL };
+    unsigned char appdata[ISOMD5SUM_APPDATA_SIZE];
+    long long offset;
+    char *errstr;
+    int supported, forceit = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|i", keywords, &supported, &forceit))
+        return NULL;
+    if (!Hasher_ready(self))
+        return NULL;
+    if (!self->implant) {
+        PyErr_SetString(PyExc_ValueError, "hasher was created for checking");
+        return NULL;
+    }
+    if (implantISOHasher(self->hasher, supported, forceit, 1, appdata, &offset, &errstr)) {
+        PyErr_SetString(PyExc_ValueError, errstr);
+        return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    return Py_BuildValue("(Ly#)", offset, appdata, (Py_ssize_t) sizeof(appdata));
+#else
+    return Py_BuildValue("(Ls#)", offset, appdata, (Py_ssize_t) sizeof(appdata));
+#endif
+}
+
+static PyMethodDef HasherMethods[] = {
+    { "update", (PyCFunction) Hasher_update, METH_VARARGS, NULL },
+    { "result", (PyCFunction) Hasher_result, METH_NOARGS, NULL },
+    { "implant_data", (PyCFunction) Hasher_implant_data, METH_VARARGS | METH_KEYWORDS, NULL },
+    { NULL }
+};
+
+static PyTypeObject HasherType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pyisomd5sum.Hasher",
+    .tp_basicsize = sizeof(HasherObject),
+    .tp_dealloc = (destructor) Hasher_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = HasherMethods,
+    .tp_init = (initproc) Hasher_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* A check running on a native background thread. */
+typedef struct {
+    PyObject_HEAD
+    struct isomd5sum_check *check;
+    int result;
+} CheckObject;
+
+static int Check_init(CheckObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = { "isofile", "fd", NULL };
+    char *isofile = NULL;
+    int fd = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zi", keywords, &isofile, &fd))
+        return -1;
+    if (!validArgs(isofile, fd, NULL))
+        return -1;
+    if (self->check) {
+        PyErr_SetString(PyExc_RuntimeError, "check already started");
+        return -1;
+    }
+    /* The descriptor has to stay open until the check is released. */
+    self->check = isofile ? mediaCheckStartFile(isofile, NULL, NULL) : mediaCheckStartFD(fd, NULL, NULL);
+    if (self->check == NULL) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, isofile);
+        return -1;
+    }
+    self->result = ISOMD5SUM_CHECK_RUNNING;
+    return 0;
+}
+
+static void Check_dealloc(CheckObject *self) {
+    if (self->check) {
+        Py_BEGIN_ALLOW_THREADS
+        mediaCheckRelease(self->check);
+        Py_END_ALLOW_THREADS
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int Check_started(CheckObject *self) {
+    if (self->check == NULL) {
+        PyErr_SetString(PyExc_ValueError, "check not started or already released");
+        return 0;
+    }
+    return 1;
+}
+
+/* Return (offset, total, running). */
+static PyObject *Check_progress(CheckObject *self, PyObject *unused) {
+    long long offset, total;
+    if (!Check_started(self))
         return NULL;
+    const int running = mediaCheckProgress(self->check, &offset, &total);
+    return Py_BuildValue("(LLO)", offset, total, running ? Py_True : Py_False);
+}
 
-    rc = implantISOFile(isofile, supported, forceit, 1, &errstr);
+/* Return a descriptor that becomes readable once the check is done. */
+static PyObject *Check_fileno(CheckObject *self, PyObject *unused) {
+    if (!Check_started(self))
+        return NULL;
+    return Py_BuildValue("i", mediaCheckEventFD(self->check));
+}
+
+static PyObject *Check_cancel(CheckObject *self, PyObject *unused) {
+    if (self->check)
+        mediaCheckCancel(self->check);
+    Py_RETURN_NONE;
+}
 
+/* Return the result, ISOMD5SUM_CHECK_RUNNING (3) while the check runs. */
+static PyObject *Check_result(CheckObject *self, PyObject *unused) {
+    if (self->check == NULL)
+        return Py_BuildValue("i", self->result);
+    const int rc = mediaCheckWait(self->check, 0);
+    if (rc == ISOMD5SUM_CHECK_WAIT_ERROR)
+        return PyErr_SetFromErrno(PyExc_OSError);
     return Py_BuildValue("i", rc);
 }
 
+/* Cancel the check if it still runs, wait for its thread and return the result. */
+static PyObject *Check_release(CheckObject *self, PyObject *unused) {
+    if (self->check) {
+        int rc;
+        Py_BEGIN_ALLOW_THREADS
+        rc = mediaCheckRelease(self->check);
+        Py_END_ALLOW_THREADS
+        self->check = NULL;
+        self->result = rc;
+    }
+    return Py_BuildValue("i", self->result);
+}
+
+static PyMethodDef CheckMethods[] = {
+    { "progress", (PyCFunction) Check_progress, METH_NOARGS, NULL },
+    { "fileno", (PyCFunction) Check_fileno, METH_NOARGS, NULL },
+    { "cancel", (PyCFunction) Check_cancel, METH_NOARGS, NULL },
+    { "result", (PyCFunction) Check_result, METH_NOARGS, NULL },
+    { "release", (PyCFunction) Check_release, METH_NOARGS, NULL },
+    { NULL }
+};
+
+static PyTypeObject CheckType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pyisomd5sum.Check",
+    .tp_basicsize = sizeof(CheckObject),
+    .tp_dealloc = (destructor) Check_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = CheckMethods,
+    .tp_init = (initproc) Check_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* Add the types to module, return -1 on failure. */
+static int addTypes(PyObject *module) {
+    PyTypeObject *const types[] = { &HasherType, &CheckType };
+    const char *const names[] = { "Hasher", "Check" };
+    for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++) {
+        if (PyType_Ready(types[i]) < 0)
+            return -1;
+        Py_INCREF(types[i]);
+        if (PyModule_AddObject(module, names[i], (PyObject *) types[i]) < 0) {
+            Py_DECREF(types[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 #ifdef PYTHON_ABI_VERSION
 static struct PyModuleDef pyisomd5sum = {
     PyModuleDef_HEAD_INIT,
@@ -97,10 +548,19 @@ static struct PyModuleDef pyisomd5sum = {
 };
 
 PyMODINIT_FUNC PyInit_pyisomd5sum(void) {
-    return PyModule_Create(&pyisomd5sum);
+    PyObject *module = PyModule_Create(&pyisomd5sum);
+    if (module == NULL)
+        return NULL;
+    if (addTypes(module) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }
 #else
 void initpyisomd5sum(void) {
-    (void) Py_InitModule("pyisomd5sum", isomd5sumMethods);
+    PyObject *module = Py_InitModule("pyisomd5sum", isomd5sumMethods);
+    if (module != NULL)
+        addTypes(module);
 }
 #endif
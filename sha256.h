@@ -0,0 +1,21 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+struct SHA256Context {
+	uint32_t state[8];
+	uint64_t bytes;
+	unsigned char in[64];
+};
+
+void SHA256_Init(struct SHA256Context *);
+void SHA256_Update(struct SHA256Context *, const unsigned char *, size_t);
+void SHA256_Final(unsigned char digest[SHA256_DIGEST_SIZE], struct SHA256Context *);
+
+typedef struct SHA256Context SHA256_CTX;
+
+#endif				/* SHA256_H */
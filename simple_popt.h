@@ -50,7 +50,7 @@ static inline poptContext poptGetContext(const char *name, int argc, const char
     return ctx;
 }
 
-static inline int poptGetNextOpt(poptContext ctx) {
+static inline int poptGetNextOneOpt(poptContext ctx) {
     if (ctx->current >= ctx->argc) {
         return -1;
     }
@@ -75,22 +75,44 @@ static inline int poptGetNextOpt(poptContext ctx) {
     }
     
     const char *optName = isLong ? arg + 2 : arg + 1;
+    /* Long options may carry their argument as --name=value */
+    const char *value = isLong ? strchr(optName, '=') : NULL;
+    size_t nameLen = value ? (size_t)(value - optName) : strlen(optName);
     
     /* Search for matching option */
     for (const struct poptOption *opt = ctx->options; opt->longName || opt->shortName; opt++) {
         int match = 0;
         
-        if (isLong && opt->longName && strcmp(optName, opt->longName) == 0) {
+        if (isLong && opt->longName && strlen(opt->longName) == nameLen &&
+            strncmp(optName, opt->longName, nameLen) == 0) {
             match = 1;
         } else if (!isLong && opt->shortName && optName[0] == opt->shortName && optName[1] == '\0') {
             match = 1;
         }
         
         if (match) {
-            if (opt->argInfo == POPT_ARG_NONE && opt->arg) {
-                *(int *)opt->arg = 1;
-            }
             ctx->current++;
+            if (opt->argInfo == POPT_ARG_NONE) {
+                if (opt->arg)
+                    *(int *)opt->arg = 1;
+                return opt->val;
+            }
+            if (value) {
+                value++;
+            } else if (ctx->current < ctx->argc) {
+                value = ctx->argv[ctx->current++];
+            } else {
+                ctx->badOption = arg;
+                return -2;
+            }
+            if (opt->arg) {
+                if (opt->argInfo == POPT_ARG_STRING)
+                    *(const char **)opt->arg = value;
+                else if (opt->argInfo == POPT_ARG_INT)
+                    *(int *)opt->arg = atoi(value);
+                else if (opt->argInfo == POPT_ARG_LONG)
+                    *(long *)opt->arg = atol(value);
+            }
             return opt->val;
         }
     }
@@ -100,6 +122,14 @@ static inline int poptGetNextOpt(poptContext ctx) {
     return -2;  /* Bad option */
 }
 
+/* Like popt, consume options until one has a non-zero val or none are left */
+static inline int poptGetNextOpt(poptContext ctx) {
+    int rc;
+    while ((rc = poptGetNextOneOpt(ctx)) == 0) {
+    }
+    return rc;
+}
+
 static inline const char **poptGetArgs(poptContext ctx) {
     if (ctx->current >= ctx->argc) {
         return NULL;
@@ -0,0 +1,39 @@
+# Shared setup of the test scripts, sourced after set -e. The directory
+# holding the tools is the first argument of the sourcing script, or the
+# top of the source tree.
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+TOOLS_DIR="${1:-${SCRIPT_DIR}/..}"
+# Scripts change into their work directory, so keep the path absolute.
+if [ -d "$TOOLS_DIR" ]; then
+    TOOLS_DIR="$(cd "$TOOLS_DIR" && pwd)"
+fi
+IMPLANT_TOOL="${TOOLS_DIR}/implantisomd5"
+CHECK_TOOL="${TOOLS_DIR}/checkisomd5"
+
+TESTS_RUN=0
+TESTS_FAILED=0
+
+log_success() {
+    echo "[PASS] $*"
+}
+
+log_error() {
+    echo "[FAIL] $*"
+}
+
+# Run a command and count it as passed if it succeeds, showing its output
+# if it doesn't.
+expect_success() {
+    local description=$1
+    shift
+    TESTS_RUN=$((TESTS_RUN + 1))
+    local output
+    if output=$("$@" 2>&1); then
+        log_success "$description"
+    else
+        log_error "$description"
+        echo "$output"
+        TESTS_FAILED=$((TESTS_FAILED + 1))
+    fi
+}
@@ -17,6 +17,8 @@ PVD_SECTOR = 16
 TEST_SIZES = {
     'tiny': 1024 * 512,           # 512 KB - Small test
     'small': 1024 * 1024,         # 1 MB - Minimum viable
+    'medium': 16 * 1024 * 1024,   # 16 MB - Several read buffers
+    'large': 64 * 1024 * 1024,    # 64 MB - Fragments longer than cache intervals
     'cd': 700 * 1024 * 1024,      # 700 MB - CD-ROM
     'dvd': int(4.5 * 1024 * 1024 * 1024),   # 4.5 GB - DVD
     'dvd_dl': int(8.5 * 1024 * 1024 * 1024), # 8.5 GB - DVD Dual Layer
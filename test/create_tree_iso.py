@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+Create a small ISO9660 image with a directory tree for the per-file manifest
+tests. Files carry Rock Ridge NM names, one split over two NM entries, next
+to a file with a plain ISO9660 name. The path, offset and size of every file
+are printed, one per line.
+"""
+
+import os
+import struct
+import sys
+
+from create_synthetic_iso import (SECTOR_SIZE, PVD_SECTOR, create_primary_volume_descriptor,
+                                  create_volume_set_terminator)
+
+SIZE_IN_SECTORS = 512
+FLAG_DIRECTORY = 1 << 1
+
+
+def both32(value):
+    return struct.pack('<I', value) + struct.pack('>I', value)
+
+
+def nm_entries(name):
+    """RRIP NM entries for name, split in two with the CONTINUE flag if it has a '-'."""
+    parts = name.split('-', 1)
+    if len(parts) == 1:
+        parts = [name]
+    else:
+        parts = [parts[0] + '-', parts[1]]
+    entries = b''
+    for i, part in enumerate(parts):
+        flags = 1 if i < len(parts) - 1 else 0
+        data = part.encode()
+        entries += b'NM' + bytes([5 + len(data), 1, flags]) + data
+    return entries
+
+
+def directory_record(identifier, sector, length, flags=0, name=None):
+    """A directory record according to ECMA-119 9.1."""
+    record = bytearray(33)
+    record[2:10] = both32(sector)
+    record[10:18] = both32(length)
+    record[25] = flags
+    record[28:32] = struct.pack('<H', 1) + struct.pack('>H', 1)
+    record[32] = len(identifier)
+    record += identifier
+    if len(identifier) % 2 == 0:
+        record += b'\0'
+    if name is not None:
+        record += nm_entries(name)
+    if len(record) % 2:
+        record += b'\0'
+    record[0] = len(record)
+    return bytes(record)
+
+
+def directory(own, parent, children):
+    data = directory_record(b'\0', own, SECTOR_SIZE, FLAG_DIRECTORY)
+    data += directory_record(b'\1', parent, SECTOR_SIZE, FLAG_DIRECTORY)
+    for child in children:
+        data += child
+    return data.ljust(SECTOR_SIZE, b'\0')
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: create_tree_iso.py <output_file>")
+        return 1
+
+    root, isolinux, images = 18, 19, 20
+    files = [
+        ('isolinux/vmlinuz', 24, os.urandom(100000)),
+        ('readme.txt', 80, b'Read me\n'),
+        ('images/install-image.img', 96, os.urandom(200000)),
+    ]
+
+    def record(path, sector, data, identifier, nm=True):
+        return directory_record(identifier, sector, len(data), name=os.path.basename(path) if nm else None)
+
+    sectors = {
+        root: directory(root, root, [
+            directory_record(b'IMAGES', images, SECTOR_SIZE, FLAG_DIRECTORY, name='images'),
+            directory_record(b'ISOLINUX', isolinux, SECTOR_SIZE, FLAG_DIRECTORY, name='isolinux'),
+            record(*files[1], b'README.TXT;1', nm=False),
+        ]),
+        isolinux: directory(isolinux, root, [record(*files[0], b'VMLINUZ.;1')]),
+        images: directory(images, root, [record(*files[2], b'INSTALL_.IMG;1')]),
+    }
+
+    pvd = bytearray(create_primary_volume_descriptor(SIZE_IN_SECTORS))
+    pvd[156:156 + 34] = directory_record(b'\0', root, SECTOR_SIZE, FLAG_DIRECTORY)
+    sectors[PVD_SECTOR] = bytes(pvd)
+    sectors[PVD_SECTOR + 1] = create_volume_set_terminator()
+
+    with open(sys.argv[1], 'wb') as f:
+        f.truncate(SIZE_IN_SECTORS * SECTOR_SIZE)
+        for sector, data in list(sectors.items()) + [(sector, data) for _, sector, data in files]:
+            f.seek(sector * SECTOR_SIZE)
+            f.write(data)
+
+    for path, sector, data in files:
+        print(path, sector * SECTOR_SIZE, len(data))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+Talk to isomd5d the way mediaCheckFileDaemon and implantISOFileDaemon do and
+run one scenario against it. Exit with 0 if the daemon behaved as expected.
+
+  daemon_client.py <socket> dedup <image>
+  daemon_client.py <socket> disconnect <large image> <small image>
+  daemon_client.py <socket> queued <large image> <small image>
+  daemon_client.py <socket> implant <image>
+  daemon_client.py <socket> abandon-implant <large image> <small image>
+  daemon_client.py <socket> pipe <small image>
+"""
+
+import os
+import select
+import socket
+import sys
+import time
+
+FILE_NOT_FOUND = -2
+CHECK_PASSED = 1
+
+
+class Client:
+    def __init__(self, path, request, image, flags=os.O_RDONLY):
+        """Pass image, a path or an open descriptor, with request."""
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        fd = image if isinstance(image, int) else os.open(image, flags)
+        try:
+            socket.send_fds(self.sock, [request.encode() + b'\n'], [fd])
+        finally:
+            if fd is not image:
+                os.close(fd)
+        self.lines = self.sock.makefile('r')
+
+    def next_line(self):
+        return self.lines.readline().split()
+
+    def result(self):
+        """Skip progress lines and return the status of the result."""
+        while True:
+            line = self.next_line()
+            if not line:
+                raise EOFError('connection closed before the result')
+            if line[0] == 'RESULT':
+                return int(line[1])
+
+    def close(self):
+        self.lines.close()
+        self.sock.close()
+
+
+def dedup(path, image):
+    # With one worker a second job would only start after the first ended.
+    first = Client(path, 'CHECK', image)
+    assert first.next_line()[0] == 'PROGRESS'
+    second = Client(path, 'CHECK', image)
+    line = second.next_line()
+    assert line[0] == 'PROGRESS' and int(line[1]) > 0, line
+    assert second.result() == CHECK_PASSED
+    assert first.result() == CHECK_PASSED
+
+
+def disconnect(path, large, small):
+    first = Client(path, 'CHECK', large)
+    assert first.next_line()[0] == 'PROGRESS'
+    first.close()
+    # The only worker is free again as soon as the abandoned check aborts.
+    start = time.monotonic()
+    second = Client(path, 'CHECK', small)
+    assert second.result() == CHECK_PASSED
+    assert time.monotonic() - start < 1.0
+
+
+def queued(path, large, small):
+    # With one connection slot the second client is only served afterwards,
+    # although a worker is free for it.
+    first = Client(path, 'CHECK', large)
+    assert first.next_line()[0] == 'PROGRESS'
+    second = Client(path, 'CHECK', small)
+    assert not select.select([second.sock], [], [], 0.5)[0]
+    assert first.result() == CHECK_PASSED
+    assert second.result() == CHECK_PASSED
+
+
+def implant(path, image):
+    client = Client(path, 'IMPLANT 0 1', image, os.O_RDWR)
+    assert client.result() == 0
+
+
+def abandon_implant(path, large, small):
+    first = Client(path, 'IMPLANT 0 1', large, os.O_RDWR)
+    assert first.next_line()[0] == 'PROGRESS'
+    first.close()
+    start = time.monotonic()
+    second = Client(path, 'CHECK', small)
+    assert second.result() == CHECK_PASSED
+    assert time.monotonic() - start < 1.0
+
+
+def pipe(path, small):
+    # Nothing is ever written to the pipe, a worker reading it would hang.
+    rfd, wfd = os.pipe()
+    try:
+        client = Client(path, 'CHECK', rfd)
+        assert client.result() == FILE_NOT_FOUND
+        second = Client(path, 'CHECK', small)
+        assert second.result() == CHECK_PASSED
+    finally:
+        os.close(rfd)
+        os.close(wfd)
+
+
+def main():
+    scenarios = {'dedup': dedup, 'disconnect': disconnect, 'queued': queued, 'implant': implant,
+                 'abandon-implant': abandon_implant, 'pipe': pipe}
+    if len(sys.argv) < 4 or sys.argv[2] not in scenarios:
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+    scenarios[sys.argv[2]](sys.argv[1], *sys.argv[3:])
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
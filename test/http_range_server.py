@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""Serve a directory over HTTP with support for single byte ranges.
+
+    http_range_server.py [--no-ranges] <directory> <port file>
+
+The port the server listens on is written to the port file. With
+--no-ranges the Range header is ignored like by simple servers.
+"""
+
+import functools
+import http.server
+import os
+import re
+import sys
+
+
+class RangeHandler(http.server.SimpleHTTPRequestHandler):
+    ranges = True
+
+    def log_message(self, format, *args):
+        pass
+
+    def send_head(self):
+        match = re.fullmatch(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if not self.ranges or match is None:
+            return super().send_head()
+        path = self.translate_path(self.path)
+        try:
+            f = open(path, "rb")
+        except OSError:
+            self.send_error(404)
+            return None
+        size = os.fstat(f.fileno()).st_size
+        start = int(match.group(1))
+        end = min(int(match.group(2) or size - 1), size - 1)
+        if start >= size:
+            f.close()
+            self.send_response(416)
+            self.send_header("Content-Range", "bytes */%d" % size)
+            self.end_headers()
+            return None
+        f.seek(start)
+        self.send_response(206)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        self.send_header("Content-Length", str(end - start + 1))
+        self.end_headers()
+        self.remaining = end - start + 1
+        return f
+
+    def copyfile(self, source, outputfile):
+        remaining = getattr(self, "remaining", None)
+        if remaining is None:
+            return super().copyfile(source, outputfile)
+        while remaining > 0:
+            data = source.read(min(remaining, 65536))
+            if not data:
+                break
+            outputfile.write(data)
+            remaining -= len(data)
+
+
+def main():
+    args = sys.argv[1:]
+    if args and args[0] == "--no-ranges":
+        RangeHandler.ranges = False
+        args = args[1:]
+    directory, port_file = args
+    handler = functools.partial(RangeHandler, directory=directory)
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), handler)
+    with open(port_file + ".tmp", "w") as f:
+        f.write(str(server.server_address[1]))
+    os.rename(port_file + ".tmp", port_file)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# Implant variants of an image with and without the MD5 state cache: the
+# results must not depend on it, changes in a cached prefix must still be
+# hashed, checks must not take a cache, and damaged, foreign or untrusted
+# cache files must not be used.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+# Print the bytes a run left to the cache according to --stats=json.
+cached_bytes() {
+    local tool=$1
+    shift
+    "$tool" --stats=json "$@" < /dev/null 2> /dev/null | sed -n 's/.*"cached_bytes": \([0-9]*\).*/\1/p'
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5cache-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+CACHE="$WORK_DIR/cache"
+
+# Variants of 64 MB, so fragments span several cache intervals, share their
+# first 12 MB and differ near the end.
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" large "$WORK_DIR/base.iso" > /dev/null
+head -c $((12 * 1024 * 1024)) /dev/urandom | dd of="$WORK_DIR/base.iso" bs=2048 seek=20 conv=notrunc 2> /dev/null
+for variant in first second; do
+    cp "$WORK_DIR/base.iso" "$WORK_DIR/$variant.iso"
+    head -c 100000 /dev/urandom | dd of="$WORK_DIR/$variant.iso" bs=2048 seek=30000 conv=notrunc 2> /dev/null
+done
+cp "$WORK_DIR/second.iso" "$WORK_DIR/uncached.iso"
+
+"$IMPLANT_TOOL" --force --cache "$CACHE" "$WORK_DIR/first.iso" > /dev/null
+SKIPPED=$(cached_bytes "$IMPLANT_TOOL" --force --cache "$CACHE" "$WORK_DIR/second.iso")
+"$IMPLANT_TOOL" --force "$WORK_DIR/uncached.iso" > /dev/null
+expect_success "implanting a variant uses the cache" test "${SKIPPED:-0}" -gt 0
+expect_success "cached and uncached implants are identical" cmp "$WORK_DIR/second.iso" "$WORK_DIR/uncached.iso"
+
+expect_success "cached implant passes the check" "$CHECK_TOOL" "$WORK_DIR/second.iso" < /dev/null
+expect_success "checks take no cache" bash -c "! '$CHECK_TOOL' --cache '$CACHE' '$WORK_DIR/second.iso' < /dev/null"
+
+# Changing the cached prefix of a variant must not leave its old md5 state in use.
+cp "$WORK_DIR/uncached.iso" "$WORK_DIR/changed.iso"
+printf 'X' | dd of="$WORK_DIR/changed.iso" bs=1 seek=$((2 * 1024 * 1024)) conv=notrunc 2> /dev/null
+cp "$WORK_DIR/changed.iso" "$WORK_DIR/changed-uncached.iso"
+"$IMPLANT_TOOL" --force --cache "$CACHE" "$WORK_DIR/changed.iso" > /dev/null
+"$IMPLANT_TOOL" --force "$WORK_DIR/changed-uncached.iso" > /dev/null
+expect_success "change in a cached prefix is hashed" cmp "$WORK_DIR/changed.iso" "$WORK_DIR/changed-uncached.iso"
+
+# A record cut in half at the end of the file is left out.
+truncate -s $(($(stat -c %s "$CACHE") - 20)) "$CACHE"
+cp "$WORK_DIR/uncached.iso" "$WORK_DIR/truncated.iso"
+"$IMPLANT_TOOL" --force --cache "$CACHE" "$WORK_DIR/truncated.iso" > /dev/null
+expect_success "truncated cache implants the same" cmp "$WORK_DIR/truncated.iso" "$WORK_DIR/uncached.iso"
+
+head -c 100000 /dev/urandom > "$CACHE"
+cp "$CACHE" "$WORK_DIR/foreign"
+SKIPPED=$(cached_bytes "$IMPLANT_TOOL" --force --cache "$CACHE" "$WORK_DIR/second.iso")
+expect_success "foreign cache file is ignored" test "$SKIPPED" = 0
+expect_success "foreign cache file is left alone" cmp "$CACHE" "$WORK_DIR/foreign"
+
+rm "$CACHE"
+"$IMPLANT_TOOL" --force --cache "$CACHE" "$WORK_DIR/first.iso" > /dev/null
+chmod 666 "$CACHE"
+expect_success "cache writable by others is refused" \
+    bash -c "'$IMPLANT_TOOL' --force --cache '$CACHE' '$WORK_DIR/second.iso' 2>&1 | grep -q 'Not using cache'"
+chmod 644 "$CACHE"
+if [ "$(id -u)" -eq 0 ] && id nobody > /dev/null 2>&1; then
+    chown nobody "$CACHE"
+    expect_success "cache of another user is refused" \
+        bash -c "'$IMPLANT_TOOL' --force --cache '$CACHE' '$WORK_DIR/second.iso' 2>&1 | grep -q 'Not using cache'"
+fi
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Check images against published SHA-256 CHECKSUM files with
+# checkisomd5 --checksum-file, in the BSD and the sha256sum format.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+# Run a check and compare its exit status and SHA-256 line with the expected.
+expect_check() {
+    local description=$1 status=$2 result=$3
+    shift 3
+    TESTS_RUN=$((TESTS_RUN + 1))
+    local output rc=0
+    output=$("$CHECK_TOOL" "$@" < /dev/null 2>&1) || rc=$?
+    if [ "$rc" -eq "$status" ] && grep -q "SHA-256 $result\$" <<< "$output"; then
+        log_success "$description"
+    else
+        log_error "$description (exit $rc)"
+        echo "$output"
+        TESTS_FAILED=$((TESTS_FAILED + 1))
+    fi
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5checksum-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+cd "$WORK_DIR"
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" small image.iso > /dev/null
+head -c 100000 /dev/urandom | dd of=image.iso bs=2048 seek=100 conv=notrunc 2> /dev/null
+"$IMPLANT_TOOL" --force image.iso > /dev/null
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" small other.iso > /dev/null
+cp image.iso corrupt.iso
+printf 'X' | dd of=corrupt.iso bs=1 seek=300000 conv=notrunc 2> /dev/null
+# Only the implanted md5sum is wrong, so the check reads the whole image.
+python3 - image.iso badsum.iso <<'PY'
+import sys
+data = bytearray(open(sys.argv[1], "rb").read())
+at = data.index(b"ISO MD5SUM = ") + len(b"ISO MD5SUM = ")
+data[at] = ord("1") if data[at] == ord("0") else ord("0")
+open(sys.argv[2], "wb").write(data)
+PY
+
+HASH=$(sha256sum image.iso | cut -c1-64)
+{
+    echo "# Published checksums"
+    echo "SHA256 (other.iso) = $(sha256sum other.iso | cut -c1-64)"
+    echo "SHA256 (image.iso) = $HASH"
+    echo "SHA256 (badsum.iso) = $(sha256sum badsum.iso | cut -c1-64)"
+} > CHECKSUM
+sha256sum other.iso image.iso > SHA256SUMS
+echo "SHA256 (image.iso) = ${HASH/?/0}" > WRONG
+echo "SHA256 (image.iso) = $HASH" > SINGLE
+
+expect_check "BSD entry matches" 0 OK --checksum-file CHECKSUM image.iso
+expect_check "sha256sum entry matches" 0 OK --checksum-file SHA256SUMS "$WORK_DIR/image.iso"
+expect_check "wrong checksum fails a passing md5sum" 1 FAILED --checksum-file WRONG image.iso
+expect_check "image without md5sum stays unverified" 1 OK --checksum-file CHECKSUM other.iso
+expect_success "image without md5sum reports NA" \
+    bash -c "'$CHECK_TOOL' --checksum-file CHECKSUM other.iso < /dev/null 2>&1 | grep -q 'result is: NA'"
+expect_check "failed md5sum still reports the checksum" 1 OK --checksum-file CHECKSUM badsum.iso
+expect_check "corrupt image is not hashed to the end" 1 "not computed" --checksum-file SINGLE corrupt.iso
+expect_success "missing entry is refused" bash -c "! '$CHECK_TOOL' --checksum-file CHECKSUM corrupt.iso < /dev/null"
+expect_success "stdin uses the only entry" \
+    bash -c "'$CHECK_TOOL' --checksum-file SINGLE - < image.iso | grep -q 'SHA-256 OK'"
+expect_success "stdin needs a name with several entries" bash -c "! '$CHECK_TOOL' --checksum-file CHECKSUM - < image.iso"
+expect_success "stdin uses the named entry" \
+    bash -c "'$CHECK_TOOL' --checksum-file CHECKSUM --checksum-name image.iso - < image.iso | grep -q 'SHA-256 OK'"
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
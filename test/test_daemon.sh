@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Start isomd5d on a private socket and check through it: two clients
+# checking one image share a job, a client hanging up aborts its check or
+# implant, pipes are refused, connections beyond --max-clients wait, implants
+# work, the socket gets the requested mode and SIGTERM removes it.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+DAEMON="${TOOLS_DIR}/isomd5d"
+CLIENT="${SCRIPT_DIR}/daemon_client.py"
+
+# Start the daemon with the given options and wait for its socket.
+start_daemon() {
+    "$DAEMON" --socket "$SOCKET" "$@" &
+    DAEMON_PID=$!
+    for _ in $(seq 50); do
+        [ -S "$SOCKET" ] && return 0
+        sleep 0.1
+    done
+    echo "isomd5d did not start" >&2
+    exit 1
+}
+
+stop_daemon() {
+    kill -TERM "$DAEMON_PID"
+    wait "$DAEMON_PID" || true
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ] || [ ! -x "$DAEMON" ]; then
+    echo "Usage: $0 [directory containing implantisomd5, checkisomd5 and isomd5d]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5daemon-XXXXXX")
+DAEMON_PID=
+trap '[ -z "$DAEMON_PID" ] || kill "$DAEMON_PID" 2> /dev/null; rm -rf "$WORK_DIR"' EXIT
+SOCKET="$WORK_DIR/isomd5d.sock"
+
+# At 8 MB/s the large image takes two seconds to check.
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" medium "$WORK_DIR/large.iso" > /dev/null
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" small "$WORK_DIR/small.iso" > /dev/null
+cp "$WORK_DIR/small.iso" "$WORK_DIR/plain.iso"
+"$IMPLANT_TOOL" --force "$WORK_DIR/large.iso" > /dev/null
+"$IMPLANT_TOOL" --force "$WORK_DIR/small.iso" > /dev/null
+
+start_daemon --workers 1 --max-rate 8 --socket-mode 0600
+expect_success "socket gets the requested mode" test "$(stat -c %a "$SOCKET")" = 600
+expect_success "concurrent checks of one image share a job" python3 "$CLIENT" "$SOCKET" dedup "$WORK_DIR/large.iso"
+expect_success "hanging up aborts the check" python3 "$CLIENT" "$SOCKET" disconnect "$WORK_DIR/large.iso" "$WORK_DIR/small.iso"
+expect_success "implant" python3 "$CLIENT" "$SOCKET" implant "$WORK_DIR/plain.iso"
+expect_success "implanted image passes" "$CHECK_TOOL" "$WORK_DIR/plain.iso"
+expect_success "hanging up aborts the implant" \
+    python3 "$CLIENT" "$SOCKET" abandon-implant "$WORK_DIR/large.iso" "$WORK_DIR/small.iso"
+expect_success "aborted implant keeps the old md5sum" "$CHECK_TOOL" "$WORK_DIR/large.iso"
+expect_success "pipes are refused" timeout 5 python3 "$CLIENT" "$SOCKET" pipe "$WORK_DIR/small.iso"
+stop_daemon
+expect_success "SIGTERM removes the socket" test ! -e "$SOCKET"
+
+start_daemon --workers 2 --max-rate 8 --max-clients 1
+expect_success "clients beyond --max-clients wait" python3 "$CLIENT" "$SOCKET" queued "$WORK_DIR/large.iso" "$WORK_DIR/small.iso"
+stop_daemon
+DAEMON_PID=
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# Check images served over HTTP by a local range-capable server, with and
+# without range support, and make sure corrupt and missing images fail.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+SERVERS=()
+
+cleanup() {
+    for pid in "${SERVERS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    rm -rf "$WORK_DIR"
+}
+
+# Start a server for $WORK_DIR and set URL to its address.
+start_server() {
+    local port_file="$WORK_DIR/port${#SERVERS[@]}"
+    python3 "${SCRIPT_DIR}/http_range_server.py" "$@" "$WORK_DIR" "$port_file" > /dev/null 2>&1 &
+    SERVERS+=($!)
+    for _ in $(seq 50); do
+        [ -f "$port_file" ] && break
+        sleep 0.1
+    done
+    URL="http://127.0.0.1:$(cat "$port_file")"
+}
+
+# Run checkisomd5 on a URL and compare its exit status.
+expect() {
+    local expected=$1
+    local description=$2
+    shift 2
+    local status=0
+    "$CHECK_TOOL" "$@" < /dev/null > /dev/null 2>&1 || status=$?
+    TESTS_RUN=$((TESTS_RUN + 1))
+    if [ "$status" -eq "$expected" ]; then
+        log_success "$description"
+    else
+        log_error "$description: exit status $status instead of $expected"
+        TESTS_FAILED=$((TESTS_FAILED + 1))
+    fi
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5http-XXXXXX")
+trap cleanup EXIT
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" cd "$WORK_DIR/good.iso" > /dev/null
+"$IMPLANT_TOOL" --force "$WORK_DIR/good.iso" > /dev/null
+cp "$WORK_DIR/good.iso" "$WORK_DIR/bad.iso"
+printf 'corrupt' | dd of="$WORK_DIR/bad.iso" bs=1 seek=$((300 * 1024 * 1024)) conv=notrunc 2> /dev/null
+cp "$WORK_DIR/good.iso" "$WORK_DIR/short.iso"
+truncate -s $((500 * 1024 * 1024)) "$WORK_DIR/short.iso"
+
+if ! "$CHECK_TOOL" --connections 1 http://127.0.0.1:1/ < /dev/null 2>&1 | grep -q "File not found"; then
+    echo "checkisomd5 was built without HTTP support, skipping"
+    exit 0
+fi
+
+start_server
+expect 0 "passing image" "$URL/good.iso"
+expect 0 "passing image, 1 connection" --connections 1 "$URL/good.iso"
+expect 0 "passing image, 8 connections" --connections 8 "$URL/good.iso"
+expect 1 "corrupt image" "$URL/bad.iso"
+expect 1 "truncated image" "$URL/short.iso"
+expect 1 "missing image" "$URL/missing.iso"
+
+start_server --no-ranges
+expect 0 "passing image without range support" "$URL/good.iso"
+expect 1 "corrupt image without range support" "$URL/bad.iso"
+
+echo "$((TESTS_RUN - TESTS_FAILED)) of $TESTS_RUN tests passed"
+[ "$TESTS_FAILED" -eq 0 ]
@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Implant a file manifest into a small image with a directory tree and check
+# single files of it with checkisomd5 --files: matching files, Rock Ridge
+# names, corrupt extents, patterns matching nothing and missing manifests.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+# Check the files matching patterns and compare the result with the expected
+# PASS, FAIL or NA.
+expect_files() {
+    local description=$1 result=$2
+    shift 2
+    TESTS_RUN=$((TESTS_RUN + 1))
+    local output
+    output=$("$CHECK_TOOL" "$@" < /dev/null 2>&1) || true
+    if grep -q "the result is: $result\." <<< "$output"; then
+        log_success "$description"
+    else
+        log_error "$description"
+        echo "$output"
+        TESTS_FAILED=$((TESTS_FAILED + 1))
+    fi
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5manifest-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+IMAGE="$WORK_DIR/tree.iso"
+
+python3 "${SCRIPT_DIR}/create_tree_iso.py" "$IMAGE" > "$WORK_DIR/files"
+expect_success "implant with a manifest next to the image" "$IMPLANT_TOOL" --force --manifest "$IMAGE"
+expect_success "manifest lists the Rock Ridge names" \
+    bash -c "diff <(cut -c35- '$IMAGE.manifest') <(cut -d' ' -f1 '$WORK_DIR/files' | sort)"
+
+expect_files "plain ISO9660 name" PASS --files readme.txt "$IMAGE"
+expect_files "name in a subdirectory" PASS --files vmlinuz "$IMAGE"
+expect_files "name split over NM entries" PASS --files 'images/*-image.img' "$IMAGE"
+expect_files "several patterns" PASS --files 'README.TXT,isolinux/*' "$IMAGE"
+expect_files "pattern matching nothing" NA --files initrd.img "$IMAGE"
+
+read -r _ OFFSET _ < <(grep '^isolinux/vmlinuz ' "$WORK_DIR/files")
+cp "$IMAGE" "$WORK_DIR/corrupt.iso"
+cp "$IMAGE.manifest" "$WORK_DIR/corrupt.iso.manifest"
+printf 'X' | dd of="$WORK_DIR/corrupt.iso" bs=1 seek=$((OFFSET + 5000)) conv=notrunc 2> /dev/null
+expect_files "corrupt extent" FAIL --files vmlinuz "$WORK_DIR/corrupt.iso"
+expect_files "other files of a corrupt image" PASS --files readme.txt "$WORK_DIR/corrupt.iso"
+
+expect_files "missing manifest" NA --files vmlinuz --manifest "$WORK_DIR/missing.manifest" "$IMAGE"
+sed 's/^./0/' "$IMAGE.manifest" > "$WORK_DIR/altered.manifest"
+expect_files "altered manifest" FAIL --files vmlinuz --manifest "$WORK_DIR/altered.manifest" "$IMAGE"
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Implant and check images with --metrics writing to one .prom file, one run
+# after the other and several at once, and check that the counters of the
+# runs add up in it.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+# Compare the value of a sample in the metrics file with the expected one.
+expect_metric() {
+    local description=$1 sample=$2 value=$3
+    TESTS_RUN=$((TESTS_RUN + 1))
+    local found
+    found=$(grep -F "$sample " "$METRICS" | cut -d' ' -f2)
+    if [ "$found" = "$value" ]; then
+        log_success "$description"
+    else
+        log_error "$description ($sample is '$found', not '$value')"
+        TESTS_FAILED=$((TESTS_FAILED + 1))
+    fi
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5metrics-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+IMAGE="$WORK_DIR/image.iso"
+METRICS="$WORK_DIR/isomd5sum.prom"
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" small "$IMAGE" > /dev/null
+"$IMPLANT_TOOL" --force --metrics "$METRICS" "$IMAGE" > /dev/null
+cp "$IMAGE" "$WORK_DIR/corrupt.iso"
+printf 'X' | dd of="$WORK_DIR/corrupt.iso" bs=1 seek=300000 conv=notrunc 2> /dev/null
+BYTES=$(grep -F 'isomd5sum_bytes_hashed_total{tool="implantisomd5"} ' "$METRICS" | cut -d' ' -f2)
+
+"$CHECK_TOOL" --metrics "$METRICS" "$IMAGE" < /dev/null > /dev/null 2>&1
+"$CHECK_TOOL" --metrics "$METRICS" "$IMAGE" < /dev/null > /dev/null 2>&1
+# A failing check stops early, so only its result can be told beforehand.
+"$CHECK_TOOL" --metrics "$METRICS" "$WORK_DIR/corrupt.iso" < /dev/null > /dev/null 2>&1 || true
+
+expect_metric "implant is kept next to the checks" 'isomd5sum_runs_total{tool="implantisomd5",status="implanted"}' 1
+expect_metric "passed checks are counted" 'isomd5sum_runs_total{tool="checkisomd5",status="passed"}' 2
+expect_metric "failed check is counted" 'isomd5sum_runs_total{tool="checkisomd5",status="failed"}' 1
+expect_metric "durations of all checks are counted" 'isomd5sum_run_duration_seconds_count{tool="checkisomd5"}' 3
+expect_metric "all checks fall in the +Inf bucket" 'isomd5sum_run_duration_seconds_bucket{tool="checkisomd5",le="+Inf"}' 3
+expect_success "every family is described once" \
+    bash -c "[ -z \"\$(grep '^# TYPE ' '$METRICS' | sort | uniq -d)\" ]"
+CHECKED=$(grep -F 'isomd5sum_bytes_hashed_total{tool="checkisomd5"} ' "$METRICS" | cut -d' ' -f2)
+expect_success "bytes of the checks add up" test "$CHECKED" -gt $((2 * BYTES)) -a "$CHECKED" -lt $((3 * BYTES))
+expect_success "file ends with # EOF" bash -c "[ \"\$(tail -n 1 '$METRICS')\" = '# EOF' ]"
+
+# Runs at the same time must not overwrite each other's counters.
+for i in 1 2 3 4; do
+    "$CHECK_TOOL" --metrics "$METRICS" "$IMAGE" < /dev/null > /dev/null 2>&1 &
+done
+wait
+expect_metric "concurrent checks all add up" 'isomd5sum_runs_total{tool="checkisomd5",status="passed"}' 6
+expect_metric "concurrent bytes all add up" 'isomd5sum_bytes_hashed_total{tool="checkisomd5"}' $((CHECKED + 4 * BYTES))
+
+mkdir "$WORK_DIR/tree"
+cp "$IMAGE" "$WORK_DIR/tree/a.iso"
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" small "$WORK_DIR/tree/b.iso" > /dev/null
+"$CHECK_TOOL" --scan "$WORK_DIR/tree" --metrics "$METRICS" > /dev/null
+"$CHECK_TOOL" --scan "$WORK_DIR/tree" --metrics "$METRICS" > /dev/null
+expect_metric "scans add their images up" 'isomd5sum_scanned_images_total{tool="checkisomd5",result="implanted"}' 2
+expect_metric "check counters survive a scan" 'isomd5sum_runs_total{tool="checkisomd5",status="passed"}' 6
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# Check an image with --profile=csv and compare the region, fragment and
+# latency rows with the reads counted by --stats=json.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5profile-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+IMAGE="$WORK_DIR/image.iso"
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" medium "$IMAGE" > /dev/null
+"$IMPLANT_TOOL" --force "$IMAGE" > /dev/null
+"$CHECK_TOOL" --stats=json --profile=csv --profile-region 4 "$IMAGE" < /dev/null > "$WORK_DIR/output" 2> /dev/null
+
+python3 - "$WORK_DIR/output" << 'EOF'
+import csv, json, sys
+
+with open(sys.argv[1]) as f:
+    lines = f.read().splitlines()
+stats = json.loads(next(line for line in lines if line.startswith('{')))
+rows = list(csv.DictReader(lines[lines.index('kind,index,offset,bytes,reads,seconds,mb_per_s,max_latency_us'):]))
+region_size = 4 * 1024 * 1024
+run = failed = 0
+
+def expect(description, condition):
+    global run, failed
+    run += 1
+    print('[%s] %s' % ('PASS' if condition else 'FAIL', description))
+    failed += not condition
+
+def rows_of(kind):
+    return [row for row in rows if row['kind'] == kind]
+
+regions, fragments, latency = rows_of('region'), rows_of('fragment'), rows_of('latency')
+reads, size = stats['read_calls'], stats['bytes_read']
+expect('one row per region', len(regions) == (size + region_size - 1) // region_size)
+expect('one row per fragment', len(fragments) == 21)
+expect('regions add up to the bytes read', sum(int(row['bytes']) for row in regions) == size)
+expect('regions add up to the reads', sum(int(row['reads']) for row in regions) == reads)
+expect('fragments add up to the reads', sum(int(row['reads']) for row in fragments) == reads)
+expect('histogram adds up to the reads', sum(int(row['reads']) for row in latency) == reads)
+print('%d tests, %d failed' % (run, failed))
+sys.exit(failed != 0)
+EOF
@@ -0,0 +1,70 @@
+#!/bin/bash
+#
+# Scan a directory tree of implanted, corrupt, unimplanted and non-ISO files
+# with checkisomd5 --scan, with one and with several jobs, and compare the
+# JSON lines with each other and with the md5sums implanted.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5scan-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+TREE="$WORK_DIR/tree"
+mkdir -p "$TREE/a/b" "$TREE/c"
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" small "$TREE/plain.iso" > /dev/null
+for image in a/good.iso a/b/second.ISO c/corrupt.iso; do
+    cp "$TREE/plain.iso" "$TREE/$image"
+    head -c 100000 /dev/urandom | dd of="$TREE/$image" bs=2048 seek=40 conv=notrunc 2> /dev/null
+    "$IMPLANT_TOOL" --force "$TREE/$image" | sed -n "s|^md5 = |$TREE/$image |p" >> "$WORK_DIR/implanted"
+done
+# The scan only reads the metadata, so corruption after implanting goes unseen.
+printf 'X' | dd of="$TREE/c/corrupt.iso" bs=1 seek=100000 conv=notrunc 2> /dev/null
+echo "not an image" > "$TREE/c/notes.iso"
+cp "$TREE/a/good.iso" "$TREE/a/good.img"
+ln -s ../a/good.iso "$TREE/c/link.iso"
+
+"$CHECK_TOOL" --scan "$TREE" --jobs 1 > "$WORK_DIR/jobs1"
+"$CHECK_TOOL" --scan "$TREE" --jobs 4 > "$WORK_DIR/jobs4"
+
+expect_success "every image is listed once" test "$(wc -l < "$WORK_DIR/jobs1")" -eq 6
+expect_success "one and four jobs find the same" diff <(sort "$WORK_DIR/jobs1") <(sort "$WORK_DIR/jobs4")
+expect_success "scan reports the implanted md5sums" python3 - "$WORK_DIR/jobs4" "$WORK_DIR/implanted" "$TREE" << 'EOF'
+import json, sys
+
+results = {}
+with open(sys.argv[1]) as f:
+    for line in f:
+        result = json.loads(line)
+        results[result['path']] = result
+with open(sys.argv[2]) as f:
+    implanted = dict(line.split() for line in f)
+tree = sys.argv[3]
+
+for path, hashsum in implanted.items():
+    assert results[path]['hashsum'] == hashsum, path
+    assert results[path]['size'] == 1024 * 1024, path
+    assert results[path]['supported'] is False, path
+assert results[tree + '/c/link.iso']['hashsum'] == implanted[tree + '/a/good.iso']
+assert results[tree + '/plain.iso']['hashsum'] is None
+assert results[tree + '/c/notes.iso']['hashsum'] is None
+assert tree + '/a/good.img' not in results
+EOF
+
+if [ "$(id -u)" -ne 0 ]; then
+    chmod 000 "$TREE/a/good.iso"
+    expect_success "unreadable images report an error" \
+        bash -c "'$CHECK_TOOL' --scan '$TREE' --jobs 4 | grep -q '\"path\": \"$TREE/a/good.iso\", \"error\"'"
+    chmod 644 "$TREE/a/good.iso"
+fi
+expect_success "missing directory fails" bash -c "! '$CHECK_TOOL' --scan '$WORK_DIR/missing'"
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Check that --max-rate limits whole image checks and --files checks to
+# about the given rate, and that --adaptive pauses once reads from a pipe
+# become slow.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+# Count a condition evaluated by awk as passed if it holds.
+expect_true() {
+    local description=$1 condition=$2
+    TESTS_RUN=$((TESTS_RUN + 1))
+    if awk "BEGIN { exit !($condition) }"; then
+        log_success "$description"
+    else
+        log_error "$description ($condition)"
+        TESTS_FAILED=$((TESTS_FAILED + 1))
+    fi
+}
+
+# Run a check, require it to pass and store its run time in ELAPSED and the
+# throttle_seconds of --stats=json, if given, in THROTTLED.
+timed_check() {
+    local output start=$EPOCHREALTIME
+    output=$("$CHECK_TOOL" "$@" 2> /dev/null) || { echo "checkisomd5 $* failed" >&2; exit 1; }
+    ELAPSED=$(awk "BEGIN { print $EPOCHREALTIME - $start }")
+    THROTTLED=$(sed -n 's/.*"throttle_seconds": \([0-9.]*\).*/\1/p' <<< "$output")
+}
+
+# Write the image to stdout, its last 2 MiB in 32 KiB pieces every 10 ms.
+slow_tail() {
+    python3 - "$1" << 'PYEOF'
+import sys, time
+
+data = open(sys.argv[1], 'rb').read()
+out = sys.stdout.buffer
+tail = len(data) - 2 * 1024 * 1024
+out.write(data[:tail])
+out.flush()
+for start in range(tail, len(data), 32768):
+    time.sleep(0.01)
+    out.write(data[start:start + 32768])
+    out.flush()
+PYEOF
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5throttle-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+IMAGE="$WORK_DIR/image.iso"
+TREE="$WORK_DIR/tree.iso"
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" medium "$IMAGE" > /dev/null
+"$IMPLANT_TOOL" --force "$IMAGE" > /dev/null
+SIZE=$(stat -c %s "$IMAGE")
+python3 "${SCRIPT_DIR}/create_tree_iso.py" "$TREE" > /dev/null
+"$IMPLANT_TOOL" --force --manifest "$TREE" > /dev/null
+
+timed_check --stats=json "$IMAGE" < /dev/null
+expect_true "unlimited check is fast" "$ELAPSED < 1"
+
+# The first tenth of a second worth of bytes is read without waiting.
+timed_check --max-rate 8 --stats=json "$IMAGE" < /dev/null
+EXPECTED=$(awk "BEGIN { print ($SIZE - 800000) / 8000000 }")
+expect_true "--max-rate 8 takes as long as the rate implies" "$ELAPSED > 0.9 * $EXPECTED && $ELAPSED < 1.5 * $EXPECTED"
+expect_true "--stats=json accounts the time to the throttle" "$THROTTLED > 0.9 * $EXPECTED"
+
+# 300000 bytes of files after a burst of 100000 at 1 MB/s.
+timed_check --max-rate 1 --files 'vmlinuz,*.img' "$TREE" < /dev/null
+expect_true "--files keeps to --max-rate" "$ELAPSED > 0.18"
+
+timed_check --stats=json - < <(slow_tail "$IMAGE")
+expect_true "slow reads alone don't pause" "$THROTTLED < 0.05"
+timed_check --adaptive --stats=json - < <(slow_tail "$IMAGE")
+expect_true "--adaptive pauses while reads are slow" "$THROTTLED > 0.2"
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
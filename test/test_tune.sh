@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# Check an image with --auto-tune twice: the first run samples read sizes
+# and writes the best one to the profiles file, the second one reads it
+# back and uses it.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+# Drop the image from the page cache, where auto-tuning wouldn't look at
+# the device.
+evict() {
+    python3 - "$1" << 'EOF'
+import os, sys
+
+fd = os.open(sys.argv[1], os.O_RDONLY)
+os.fsync(fd)
+os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+os.close(fd)
+EOF
+}
+
+# Check the image with --auto-tune and set READ_SIZE, DEVICE and SOURCE
+# from the line printed about it, and PEAK from --stats=json.
+tuned_check() {
+    evict "$IMAGE"
+    local output
+    output=$("$CHECK_TOOL" --verbose --auto-tune --tune-profiles "$PROFILES" --stats=json "$IMAGE" < /dev/null 2> /dev/null)
+    local line
+    line=$(grep '^Reading ' <<< "$output")
+    READ_SIZE=$(sed -n 's/^Reading \([0-9]*\) KiB at a time from .* (.*)$/\1/p' <<< "$line")
+    DEVICE=$(sed -n 's/^Reading [0-9]* KiB at a time from \(.*\) (.*)$/\1/p' <<< "$line")
+    SOURCE=$(sed -n 's/^Reading .* (\(.*\))$/\1/p' <<< "$line")
+    PEAK=$(sed -n 's/.*"peak_buffer": \([0-9]*\).*/\1/p' <<< "$output")
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5tune-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+IMAGE="$WORK_DIR/image.iso"
+PROFILES="$WORK_DIR/profiles"
+
+# Images under 80 MB are too small to sample 4 MB with each read size.
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" large "$IMAGE" > /dev/null
+python3 - "$IMAGE" $((96 * 1024 * 1024)) << 'EOF'
+import sys
+
+with open(sys.argv[1], 'r+b') as f:
+    sectors = int(sys.argv[2]) // 2048
+    f.seek(16 * 2048 + 80)
+    f.write(sectors.to_bytes(4, 'little') + sectors.to_bytes(4, 'big'))
+    f.truncate(int(sys.argv[2]))
+EOF
+"$IMPLANT_TOOL" --force "$IMAGE" > /dev/null
+echo "65536 10.0 some other device" > "$PROFILES"
+
+tuned_check
+if [ "$SOURCE" = "page cache" ]; then
+    # tmpfs and the like keep the image in memory.
+    echo "$IMAGE can't be dropped from the page cache, skipping"
+    exit 0
+fi
+expect_success "unknown device is sampled" test "$SOURCE" = sampled
+expect_success "sampled read size is written back" grep -qx "$((READ_SIZE * 1024)) [0-9.]* $DEVICE" "$PROFILES"
+expect_success "other devices are kept" grep -qx "65536 10.0 some other device" "$PROFILES"
+
+# A read size none of the samples would pick.
+sed -i "s/^[0-9]* \([0-9.]* $DEVICE\)\$/327680 \1/" "$PROFILES"
+tuned_check
+expect_success "stored profile is loaded" test "$SOURCE" = stored
+expect_success "stored read size is used" test "$READ_SIZE" = 320 -a "$PEAK" = 327680
+expect_success "loading leaves the profiles alone" test "$(wc -l < "$PROFILES")" -eq 2
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
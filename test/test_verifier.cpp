@@ -0,0 +1,111 @@
+/*
+ * Check images with every combination of the C++ reader and hasher policies,
+ * and in memory as a whole and in segments, and compare the results with
+ * mediaCheckFile. Images may be given more than once, to check that nothing
+ * carries over between checks.
+ *
+ *   test_verifier image.iso...
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "isomd5sum.hpp"
+
+using namespace isomd5sum;
+
+static int failures = 0;
+
+static void expect(const char *path, const char *what, const Result &result, int expected) {
+    const int status = static_cast<int>(result.status());
+    if (status != expected) {
+        std::printf("FAIL %s: %s returned %d instead of %d\n", path, what, status, expected);
+        failures++;
+    }
+}
+
+template <class Reader, class Hasher>
+static void check_with(const char *path, const char *what, int expected) {
+    const Verifier<Reader, Hasher> verifier;
+    expect(path, what, verifier.check(path), expected);
+}
+
+int main(int argc, char **argv) {
+    hasher::Sha256 abc;
+    abc.update(Bytes(reinterpret_cast<const unsigned char *>("abc"), 3));
+    if (abc.sha256() != "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") {
+        std::printf("FAIL SHA-256 of \"abc\": %s\n", abc.sha256().c_str());
+        failures++;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char *const path = argv[i];
+        const int expected = mediaCheckFile(path, nullptr, nullptr);
+        const int previous_failures = failures;
+
+        check_with<reader::Read, hasher::Md5Fragments>(path, "Read/Md5Fragments", expected);
+        check_with<reader::Pread, hasher::Md5Fragments>(path, "Pread/Md5Fragments", expected);
+        check_with<reader::Mmap, hasher::Md5Fragments>(path, "Mmap/Md5Fragments", expected);
+        /* Md5 only compares the md5sum of the whole image. */
+        if (expected != ISOMD5SUM_CHECK_FAILED)
+            check_with<reader::Mmap, hasher::Md5>(path, "Mmap/Md5", expected);
+        check_with<reader::Pread, hasher::Multi<hasher::Md5Fragments, hasher::Sha256>>(path, "Pread/Multi", expected);
+
+        if (expected != ISOMD5SUM_FILE_NOT_FOUND) {
+            std::ifstream file(path, std::ios::binary);
+            const std::vector<unsigned char> image((std::istreambuf_iterator<char>(file)),
+                                                   std::istreambuf_iterator<char>());
+            expect(path, "memory",
+                   Verifier<reader::Read, hasher::Md5Fragments>::check(Bytes(image.data(), image.size())), expected);
+
+            /* Segments of odd sizes, splitting blocks and the appdata. */
+            static const size_t sizes[] = { 1, 883, 2047, 32768, 40000, 512, 100000, 3 };
+            std::vector<iovec> segments;
+            for (size_t offset = 0, i = 0; offset < image.size(); i++) {
+                const size_t len = std::min(sizes[i % std::size(sizes)], image.size() - offset);
+                segments.push_back({ const_cast<unsigned char *>(image.data()) + offset, len });
+                offset += len;
+            }
+            expect(path, "segments",
+                   Result(static_cast<Status>(mediaCheckIOV(segments.data(), static_cast<int>(segments.size()),
+                                                            nullptr, nullptr))),
+                   expected);
+        }
+
+        if (expected == ISOMD5SUM_CHECK_PASSED) {
+            const Verifier<reader::Read, hasher::Md5Fragments> verifier;
+            long long calls = 0;
+            expect(path, "progress", verifier.check(path, [&calls](long long, long long) { return ++calls > 1; }),
+                   ISOMD5SUM_CHECK_ABORTED);
+            Result result = verifier.check(path);
+            const Result moved = std::move(result);
+            if (moved.md5sum().size() != 32) {
+                std::printf("FAIL %s: md5sum \"%s\"\n", path, moved.md5sum().c_str());
+                failures++;
+            }
+
+            /* The SHA-256 of the whole file, as the context computes it. */
+            hasher::Multi<hasher::Md5Fragments, hasher::Sha256> multi;
+            expect(path, "Read/Multi", Verifier<reader::Read, decltype(multi)>().check(path, multi), expected);
+            char sha256[65] = "";
+            isomd5sum_context *const ctx = isomd5sumContextNew();
+            const int fd = open(path, O_RDONLY);
+            if (ctx && fd >= 0 && isomd5sumContextEnableSha256(ctx, 1) == 0)
+                expect(path, "context", Result(static_cast<Status>(mediaCheckContext(ctx, fd, nullptr, nullptr))),
+                       expected);
+            if (ctx == nullptr || !isomd5sumContextSha256(ctx, sha256) || multi.get<1>().sha256() != sha256) {
+                std::printf("FAIL %s: SHA-256 \"%s\" instead of \"%s\"\n", path, multi.get<1>().sha256().c_str(),
+                            sha256);
+                failures++;
+            }
+            if (fd >= 0)
+                close(fd);
+            isomd5sumContextFree(ctx);
+        }
+        std::printf("%s %s: %d\n", failures > previous_failures ? "FAIL" : "PASS", path, expected);
+    }
+    return failures ? 1 : 0;
+}
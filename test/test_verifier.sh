@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Run test_verifier on passing, corrupt and unimplanted images, each given
+# twice so that state left over from the first check shows up.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+VERIFIER="${TOOLS_DIR}/test_verifier"
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$VERIFIER" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and test_verifier]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5verifier-XXXXXX")
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" medium "$WORK_DIR/plain.iso" > /dev/null
+head -c 500000 /dev/urandom | dd of="$WORK_DIR/plain.iso" bs=2048 seek=40 conv=notrunc 2> /dev/null
+cp "$WORK_DIR/plain.iso" "$WORK_DIR/implanted.iso"
+"$IMPLANT_TOOL" --force "$WORK_DIR/implanted.iso" > /dev/null
+cp "$WORK_DIR/implanted.iso" "$WORK_DIR/corrupt.iso"
+printf 'X' | dd of="$WORK_DIR/corrupt.iso" bs=1 seek=400000 conv=notrunc 2> /dev/null
+
+"$VERIFIER" "$WORK_DIR/implanted.iso" "$WORK_DIR/implanted.iso" \
+    "$WORK_DIR/corrupt.iso" "$WORK_DIR/corrupt.iso" \
+    "$WORK_DIR/plain.iso" "$WORK_DIR/plain.iso" "$WORK_DIR/missing.iso"
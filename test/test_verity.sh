@@ -0,0 +1,140 @@
+#!/bin/bash
+#
+# Implant dm-verity hash trees, appended and as a sidecar, and recompute them
+# independently of the tools. With root and veritysetup at hand the trees are
+# also verified by veritysetup on loop devices.
+#
+
+set -e
+
+source "$(dirname "${BASH_SOURCE[0]}")/common.sh"
+
+LOOPS=()
+
+cleanup() {
+    for loop in "${LOOPS[@]}"; do
+        losetup -d "$loop" 2>/dev/null || true
+    done
+    rm -rf "$WORK_DIR"
+}
+
+# Rebuild the tree of image from its appdata with hashlib and compare it with
+# the one stored in hashfile, or in the image itself if not given.
+verify_tree() {
+    python3 - "$@" << 'EOF'
+import hashlib, re, sys
+
+image = sys.argv[1]
+with open(image, 'rb') as f:
+    f.seek(16 * 2048)
+    while True:
+        pvd = f.read(2048)
+        if pvd[0] == 1 and pvd[1:6] == b'CD001':
+            break
+appdata = pvd[883:883 + 512].decode()
+fields = dict(re.findall(r'VERITY (\w+) = (\w+);', appdata))
+salt = bytes.fromhex(fields['SALT'])
+data_offset, blocks, hash_offset = (int(fields[k]) for k in ('DATA', 'BLOCKS', 'HASH'))
+hashfile = sys.argv[2] if len(sys.argv) > 2 else image
+if hashfile != image:
+    assert hash_offset == 0
+
+def digest(block):
+    return hashlib.sha256(salt + block).digest()
+
+with open(image, 'rb') as f:
+    f.seek(data_offset)
+    level = [digest(f.read(2048)) for _ in range(blocks)]
+tree = []
+while True:
+    hashes = b''.join(level)
+    hash_blocks = [hashes[i:i + 4096].ljust(4096, b'\0') for i in range(0, len(hashes), 4096)]
+    tree.insert(0, b''.join(hash_blocks))
+    level = [digest(block) for block in hash_blocks]
+    if len(level) == 1:
+        break
+tree = b''.join(tree)
+with open(hashfile, 'rb') as f:
+    f.seek(hash_offset)
+    stored = f.read()
+assert stored == tree, 'hash tree differs'
+assert level[0].hex() == fields['ROOT'], 'root hash differs'
+EOF
+}
+
+# Copy image to copy with the VERITY field set to value, in the free space
+# of the appdata, which the md5sum does not cover.
+set_verity_field() {
+    python3 - "$@" << 'EOF'
+import sys
+
+image, copy, field, value = sys.argv[1:]
+data = bytearray(open(image, 'rb').read())
+start = data.index(b'VERITY %s = ' % field.encode())
+end = data.index(b';', start)
+old = bytes(data[start:end])
+new = b'VERITY %s = %s' % (field.encode(), value.encode())
+pad = data.index(b'  ', end)
+data[start:pad + len(new) - len(old)] = new + data[end:pad]
+open(copy, 'wb').write(data)
+EOF
+}
+
+if [ ! -x "$IMPLANT_TOOL" ] || [ ! -x "$CHECK_TOOL" ]; then
+    echo "Usage: $0 [directory containing implantisomd5 and checkisomd5]" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/isomd5verity-XXXXXX")
+trap cleanup EXIT
+
+python3 "${SCRIPT_DIR}/create_synthetic_iso.py" cd "$WORK_DIR/image.iso" > /dev/null
+printf 'some data' | dd of="$WORK_DIR/image.iso" bs=1 seek=$((300 * 1024 * 1024)) conv=notrunc 2> /dev/null
+cp "$WORK_DIR/image.iso" "$WORK_DIR/sidecar.iso"
+
+expect_success "implant with an appended hash tree" "$IMPLANT_TOOL" --force --verity "$WORK_DIR/image.iso"
+expect_success "appended hash tree matches" verify_tree "$WORK_DIR/image.iso"
+expect_success "md5sum still passes" "$CHECK_TOOL" "$WORK_DIR/image.iso"
+SIZE=$(stat -c %s "$WORK_DIR/image.iso")
+expect_success "implant again over the old tree" "$IMPLANT_TOOL" --force --verity "$WORK_DIR/image.iso"
+expect_success "replaced hash tree matches" verify_tree "$WORK_DIR/image.iso"
+expect_success "image did not grow" test "$(stat -c %s "$WORK_DIR/image.iso")" -eq "$SIZE"
+
+expect_success "implant with a sidecar hash tree" \
+    "$IMPLANT_TOOL" --force --verity-file "$WORK_DIR/sidecar.hash" "$WORK_DIR/sidecar.iso"
+expect_success "sidecar hash tree matches" verify_tree "$WORK_DIR/sidecar.iso" "$WORK_DIR/sidecar.hash"
+expect_success "setup needs the sidecar" bash -c "! '$CHECK_TOOL' --verity-setup '$WORK_DIR/sidecar.iso'"
+expect_success "setup prints both tables" \
+    bash -c "'$CHECK_TOOL' --verity-setup --verity-file '$WORK_DIR/sidecar.hash' '$WORK_DIR/sidecar.iso' | grep -c '^dmsetup create' | grep -qx 2"
+
+# Offsets past 4 GiB are kept whole, negative ones make the tree unusable.
+DATA=$(grep -ao 'VERITY DATA = [0-9]*' "$WORK_DIR/sidecar.iso" | head -n 1 | cut -d' ' -f4)
+set_verity_field "$WORK_DIR/sidecar.iso" "$WORK_DIR/far.iso" DATA $(((1 << 33) + DATA))
+TABLES=$("$CHECK_TOOL" --verity-setup --verity-file "$WORK_DIR/sidecar.hash" "$WORK_DIR/far.iso" || true)
+expect_success "data offset past 4 GiB is parsed" grep -q " $((((1 << 33) + DATA) / 512))'\$" <<< "$TABLES"
+set_verity_field "$WORK_DIR/sidecar.iso" "$WORK_DIR/negative.iso" DATA "-$DATA"
+expect_success "negative data offset is refused" \
+    bash -c "! '$CHECK_TOOL' --verity-setup --verity-file '$WORK_DIR/sidecar.hash' '$WORK_DIR/negative.iso'"
+
+if [ "$(id -u)" -eq 0 ] && command -v veritysetup > /dev/null && command -v losetup > /dev/null; then
+    read -r DATA BLOCKS HASH ROOT SALT < <(python3 - "$WORK_DIR/image.iso" << 'EOF'
+import re, sys
+with open(sys.argv[1], 'rb') as f:
+    data = f.read(64 * 2048).decode('latin-1')
+fields = dict(re.findall(r'VERITY (\w+) = (\w+);', data))
+print(*(fields[k] for k in ('DATA', 'BLOCKS', 'HASH', 'ROOT', 'SALT')))
+EOF
+)
+    DATA_LOOP=$(losetup -f --show -r -o "$DATA" --sizelimit $((BLOCKS * 2048)) "$WORK_DIR/image.iso")
+    LOOPS+=("$DATA_LOOP")
+    HASH_LOOP=$(losetup -f --show -r "$WORK_DIR/image.iso")
+    LOOPS+=("$HASH_LOOP")
+    expect_success "veritysetup verifies the appended tree" \
+        veritysetup verify "$DATA_LOOP" "$HASH_LOOP" "$ROOT" --no-superblock --format 1 --hash sha256 \
+        --data-block-size 2048 --hash-block-size 4096 --data-blocks "$BLOCKS" --hash-offset "$HASH" --salt "$SALT"
+else
+    echo "veritysetup or root privileges missing, skipping veritysetup verify"
+fi
+
+echo "$TESTS_RUN tests, $TESTS_FAILED failed"
+[ "$TESTS_FAILED" -eq 0 ]
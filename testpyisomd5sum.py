@@ -1,10 +1,14 @@
 #!/usr/bin/python3
 
+import asyncio
 import os
+import select
 import subprocess
 import sys
 import tempfile
+import threading
 
+import aioisomd5sum
 import pyisomd5sum
 
 # Pass in the rc, the expected value and the pass_all state
@@ -61,6 +65,19 @@ print("Implanting again forcing -> %s" % rstr)
 (rstr, pass_all) = pass_fail(pyisomd5sum.checkisomd5sum("testiso.iso"), 1, pass_all)
 print("Checking -> %s" % rstr)
 
+def make_large_image(path, size):
+    """Grow a sparse copy of testiso.iso to size bytes, so checks of it run a while."""
+    with open("testiso.iso", "rb") as f:
+        head = bytearray(f.read())
+    sectors = size // 2048
+    head[16 * 2048 + 80:16 * 2048 + 88] = sectors.to_bytes(4, "little") + sectors.to_bytes(4, "big")
+    with open(path, "wb") as f:
+        f.write(head)
+        f.truncate(size)
+    return pyisomd5sum.implantisomd5sum(path, 1, 1)
+
+make_large_image("largeiso.iso", 256 * 1024 * 1024)
+
 def callback(offset, total):
     print("    %s - %s" % (offset, total))
 
@@ -70,16 +87,144 @@ print(rstr)
 
 def callback_abort(offset, total):
     print("    %s - %s" % (offset, total))
-    if offset > 100000:
-        return True
-    return False
+    # What the call at the start returns is not looked at.
+    return offset > 0
+
+print("Run with callback and abort on the first progress")
+(rstr, pass_all) = pass_fail(pyisomd5sum.checkisomd5sum("largeiso.iso", callback_abort), 2, pass_all)
+print(rstr)
+
+def callback_abort_later(offset, total):
+    print("    %s - %s" % (offset, total))
+    return offset > 100000
+
+print("Run with a callback after every read and abort after offset of 100000")
+(rstr, pass_all) = pass_fail(pyisomd5sum.checkisomd5sum("testiso.iso", callback_abort_later, interval=0), 2, pass_all)
+print(rstr)
+
+print("Run with an open file descriptor and a callback every 100ms")
+fd = os.open("testiso.iso", os.O_RDONLY)
+(rstr, pass_all) = pass_fail(pyisomd5sum.checkisomd5sum(fd=fd, callback=callback, interval=100), 1, pass_all)
+os.close(fd)
+print(rstr)
+
+async def check_async():
+    check = aioisomd5sum.check_async("testiso.iso")
+    async for offset, total in check:
+        print("    %s - %s" % (offset, total))
+    return await check
+
+print("Run on the asyncio event loop")
+(rstr, pass_all) = pass_fail(asyncio.run(check_async()), 1, pass_all)
+print(rstr)
+
+async def cancel_twice():
+    # The pipe stalls after the start, so the check thread sits in a read
+    # until the writer closes it.
+    rfd, wfd = os.pipe()
+    with open("testiso.iso", "rb") as f:
+        os.write(wfd, f.read(60 * 1024))
+    # Close from another thread, a stalled loop would never get to it.
+    closer = threading.Timer(0.5, os.close, [wfd])
+    closer.start()
+    loop = asyncio.get_running_loop()
+    check = aioisomd5sum.check_async(fd=rfd, interval=0.01)
+    async for progress in check:
+        break
+    gaps = []
+
+    async def heartbeat():
+        while True:
+            before = loop.time()
+            await asyncio.sleep(0.01)
+            gaps.append(loop.time() - before)
+
+    ticker = asyncio.ensure_future(heartbeat())
+    check.cancel()
+    # Let the task get to waiting for the thread before cancelling it again.
+    await asyncio.sleep(0.05)
+    check.cancel()
+    try:
+        await check
+        cancelled = False
+    except asyncio.CancelledError:
+        cancelled = True
+    # Let the heartbeat see a stall that ended just now.
+    await asyncio.sleep(0.05)
+    ticker.cancel()
+    closer.join()
+    os.close(rfd)
+    # Releasing the check on the loop would stall it until the pipe closes.
+    return cancelled and max(gaps) < 0.25
+
+print("Cancel a check on the event loop twice while its thread reads")
+(rstr, pass_all) = pass_fail(asyncio.run(cancel_twice()), True, pass_all)
+print(rstr)
+
+async def check_one_at_a_time():
+    order = []
+
+    async def run(name):
+        check = aioisomd5sum.check_async("largeiso.iso", interval=0.01)
+        async for progress in check:
+            order.append(name)
+        return await check
+
+    results = await asyncio.gather(run("first"), run("second"))
+    switches = sum(1 for a, b in zip(order, order[1:]) if a != b)
+    return results, switches
+
+print("Run checks one at a time with set_concurrency(1)")
+aioisomd5sum.set_concurrency(1)
+(rstr, pass_all) = pass_fail(asyncio.run(check_one_at_a_time()), ([1, 1], 1), pass_all)
+aioisomd5sum.set_concurrency(aioisomd5sum.DEFAULT_CONCURRENCY)
+print(rstr)
+
+print("Run a background check to its end")
+check = pyisomd5sum.Check("testiso.iso")
+select.select([check], [], [])
+(rstr, pass_all) = pass_fail((check.result(), check.progress()[2], check.release()), (1, False, 1), pass_all)
+print(rstr)
+
+print("Cancel a background check")
+check = pyisomd5sum.Check("largeiso.iso")
+running = check.progress()[2] and check.result() == 3
+check.cancel()
+select.select([check], [], [])
+(rstr, pass_all) = pass_fail((running, check.result(), check.release()), (True, 2, 2), pass_all)
+print(rstr)
+
+print("Release a background check while it runs")
+check = pyisomd5sum.Check("largeiso.iso")
+(rstr, pass_all) = pass_fail((check.release(), check.result(), check.release()), (2, 2, 2), pass_all)
+print(rstr)
+
+with open("testiso.iso", "rb") as f:
+    image = bytearray(f.read())
+
+print("Check the image held in memory")
+(rstr, pass_all) = pass_fail(pyisomd5sum.checkisomd5sum_buffer(image), 1, pass_all)
+print(rstr)
+
+print("Check the image passed to a hasher in pieces")
+hasher = pyisomd5sum.Hasher()
+for start in range(0, len(image), 10000):
+    hasher.update(memoryview(image)[start:start + 10000])
+(rstr, pass_all) = pass_fail(hasher.result(), 1, pass_all)
+print(rstr)
+
+print("Check the image read from a pipe")
+with subprocess.Popen(["cat", "testiso.iso"], stdout=subprocess.PIPE) as cat:
+    (rstr, pass_all) = pass_fail(pyisomd5sum.checkisomd5sum(fd=cat.stdout.fileno()), 1, pass_all)
+print(rstr)
 
-print("Run with callback and abort after offset of 100000")
-(rstr, pass_all) = pass_fail(pyisomd5sum.checkisomd5sum("testiso.iso", callback_abort), 2, pass_all)
+print("Implant into the image held in memory")
+(rstr, pass_all) = pass_fail(pyisomd5sum.implantisomd5sum_buffer(image, 1, 1), 0, pass_all)
 print(rstr)
 
 # clean up
 os.unlink("testiso.iso")
+os.unlink("largeiso.iso")
 
 if pass_all:
     exit(0)
@@ -16,57 +16,87 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <ctype.h>
 
 #ifdef _WIN32
 #include "win32_compat.h"
 #else
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #endif
 
 #include "md5.h"
+#include "midstate.h"
+#include "probes.h"
 
 #include "utilities.h"
 
-static unsigned char *read_primary_volume_descriptor(const int fd, int64_t *const offset) {
-    /*
-     * According to ECMA-119 8.1.1.
-     */
-    enum { BOOT_RECORD = 0,
-           PRIMARY = 1,
-           ADDITIONAL = 2,
-           PARTITION = 3,
-           SET_TERMINATOR = 255 };
+/*
+ * Volume descriptor types according to ECMA-119 8.1.1.
+ */
+enum { BOOT_RECORD = 0,
+       PRIMARY = 1,
+       ADDITIONAL = 2,
+       PARTITION = 3,
+       SET_TERMINATOR = 255 };
+
+/**
+ * Find the primary volume descriptor, reading the volume descriptors into
+ * sectors which holds VOLUME_DESCRIPTOR_BATCH of them. Return a pointer to it
+ * inside sectors and store its offset in the image.
+ */
+static const unsigned char *read_primary_volume_descriptor(const int fd, unsigned char *const sectors,
+                                                           int64_t *const offset) {
     int64_t nbyte = SYSTEM_AREA_SIZE;
-    /* Skip unused system area. */
-    if (lseek(fd, nbyte, SEEK_SET) == -1) {
-        return NULL;
-    }
-    unsigned char *sector_buffer;
-    sector_buffer = aligned_alloc((size_t) getpagesize(), SECTOR_SIZE * sizeof(*sector_buffer));
-    /* Read n volume descriptors. */
+    /* Read the volume descriptors in batches, one read covers most images. */
     for (;;) {
-        if (read(fd, sector_buffer, SECTOR_SIZE) == -1) {
-            aligned_free(sector_buffer);
+        /* Skip unused system area and descriptors seen so far. */
+        if (lseek(fd, nbyte, SEEK_SET) == -1)
             return NULL;
-        }
-        if (sector_buffer[0] == PRIMARY) {
-            break;
-        } else if (sector_buffer[0] == SET_TERMINATOR) {
-            aligned_free(sector_buffer);
+        const ssize_t nread = read(fd, sectors, DESCRIPTOR_BUFFER_SIZE);
+        if (nread < SECTOR_SIZE)
             return NULL;
+        for (ssize_t i = 0; i + SECTOR_SIZE <= nread; i += SECTOR_SIZE, nbyte += SECTOR_SIZE) {
+            if (sectors[i] == PRIMARY) {
+                *offset = nbyte;
+                return sectors + i;
+            } else if (sectors[i] == SET_TERMINATOR) {
+                return NULL;
+            }
         }
-        nbyte *= SECTOR_SIZE;
     }
-    *offset = nbyte;
-    return sector_buffer;
 }
 
-static int64_t isosize(const unsigned char *const buffer) {
+/**
+ * Find the primary volume descriptor in the first size bytes of an image held
+ * in memory. Return its offset, 0 if more of the image is needed to find it
+ * or -1 if there is none.
+ */
+int64_t find_primary_volume_descriptor(const unsigned char *const image, const size_t size) {
+    for (size_t i = SYSTEM_AREA_SIZE; i + SECTOR_SIZE <= size; i += SECTOR_SIZE) {
+        if (image[i] == PRIMARY)
+            return (int64_t) i;
+        else if (image[i] == SET_TERMINATOR)
+            return -1;
+    }
+    return 0;
+}
+
+static unsigned char *alloc_descriptor_buffer(void) {
+    return aligned_alloc((size_t) getpagesize(), DESCRIPTOR_BUFFER_SIZE);
+}
+
+int64_t isosize(const unsigned char *const buffer) {
     /*
      * Doing multiplications so that it can be guaranteed that the big endian
      * number is converted to the systems endianness without knowing the
@@ -93,40 +123,89 @@ static size_t starts_with(const char *const buffer, const char *const string) {
 }
 
 /**
- * Read and store number from buffer if the buffer starts with string.
+ * Copy the text after string up to the next semicolon to tmp if the buffer
+ * starts with string at index, and return the index of the semicolon.
  */
-static size_t matches_number(char *const buffer, size_t index,
-                             const char *const string, long int *const number) {
+static size_t matches_field(const char *const buffer, size_t index,
+                            const char *const string, char *const tmp) {
     size_t len = starts_with(buffer + index, string);
     index += len;
     if (len > 0UL && index < APPDATA_SIZE) {
-        char tmp[APPDATA_SIZE];
         /* The number should be every until the semicolon. */
         char *ptr = tmp;
         for (; index < APPDATA_SIZE && buffer[index] != ';';
              ptr++, index++)
             *ptr = buffer[index];
         *ptr = '\0';
-        char *endptr;
-        *number = strtol(tmp, &endptr, 10);
-        return endptr != NULL && *endptr != '\0' ? 0UL : index;
+        return index;
     }
     return 0UL;
 }
 
-int64_t primary_volume_size(const int isofd, int64_t *const offset) {
-    unsigned char *buffer = read_primary_volume_descriptor(isofd, offset);
-    if (buffer == NULL)
-        return 0;
-    int64_t tmp = isosize(buffer);
-    aligned_free(buffer);
-    return tmp;
+/**
+ * Read and store number from buffer if the buffer starts with string.
+ */
+static size_t matches_number(char *const buffer, size_t index,
+                             const char *const string, long int *const number) {
+    char tmp[APPDATA_SIZE];
+    if ((index = matches_field(buffer, index, string, tmp)) == 0UL)
+        return 0UL;
+    char *endptr;
+    *number = strtol(tmp, &endptr, 10);
+    return endptr != NULL && *endptr != '\0' ? 0UL : index;
+}
+
+/**
+ * Like matches_number, for offsets and sizes in the image, which don't fit
+ * a long on Windows. Negative or out of range numbers don't match.
+ */
+static size_t matches_offset(char *const buffer, size_t index,
+                             const char *const string, int64_t *const number) {
+    char tmp[APPDATA_SIZE];
+    if ((index = matches_field(buffer, index, string, tmp)) == 0UL)
+        return 0UL;
+    char *endptr;
+    errno = 0;
+    const long long value = strtoll(tmp, &endptr, 10);
+    if (endptr == tmp || *endptr != '\0' || errno == ERANGE || value < 0)
+        return 0UL;
+    *number = (int64_t) value;
+    return index;
+}
+
+int64_t primary_volume_size(const int isofd, unsigned char *const sectors, int64_t *const offset) {
+    const unsigned char *const buffer = read_primary_volume_descriptor(isofd, sectors, offset);
+    return buffer ? isosize(buffer) : 0;
 }
 
 /* Find the primary volume descriptor and return parsed information from it. */
 struct volume_info *const parsepvd(const int isofd) {
-    char buffer[APPDATA_SIZE];
+    unsigned char *const sectors = alloc_descriptor_buffer();
+    struct volume_info *result = malloc(sizeof(struct volume_info));
+    if (sectors == NULL || result == NULL || !read_volume_info(isofd, sectors, result)) {
+        free(result);
+        result = NULL;
+    }
+    aligned_free(sectors);
+    return result;
+}
+
+/**
+ * Find the primary volume descriptor, using sectors to read the volume
+ * descriptors, and store parsed information from it in result.
+ */
+bool read_volume_info(const int isofd, unsigned char *const sectors, struct volume_info *const result) {
     int64_t offset;
+    const unsigned char *const pvd = read_primary_volume_descriptor(isofd, sectors, &offset);
+    return pvd != NULL && parse_volume_info(pvd, offset, result);
+}
+
+/**
+ * Store parsed information from pvd, the primary volume descriptor at offset,
+ * in result. Return false if it holds no implanted md5sum.
+ */
+bool parse_volume_info(const unsigned char *const pvd, const int64_t offset, struct volume_info *const result) {
+    char buffer[APPDATA_SIZE];
 
     enum task_status {
         TASK_SUPPORTED = 1,
@@ -134,25 +213,32 @@ struct volume_info *const parsepvd(const int isofd) {
         TASK_FRAGSUM = 1 << 2,
         TASK_MD5 = 1 << 3,
         TASK_SKIP = 1 << 4,
-        TASK_DONE = (1 << 5) - 1
+        TASK_MANIFEST = 1 << 5,
+        TASK_VERITY_ROOT = 1 << 6,
+        TASK_VERITY_SALT = 1 << 7,
+        TASK_VERITY_DATA = 1 << 8,
+        TASK_VERITY_BLOCKS = 1 << 9,
+        TASK_VERITY_HASH = 1 << 10,
+        TASK_DONE = (1 << 11) - 1
     };
     enum task_status task = 0;
 
-    unsigned char *const aligned_buffer = read_primary_volume_descriptor(isofd, &offset);
-    if (aligned_buffer == NULL)
-        return NULL;
     /* Application data */
-    memcpy(buffer, aligned_buffer + APPDATA_OFFSET, APPDATA_SIZE);
+    memcpy(buffer, pvd + APPDATA_OFFSET, APPDATA_SIZE);
     buffer[APPDATA_SIZE - 1] = '\0';
 
-    struct volume_info *result = malloc(sizeof(struct volume_info));
     result->skipsectors = SKIPSECTORS;
     result->supported = 0;
     result->fragmentcount = FRAGMENT_COUNT;
     result->offset = offset;
-    result->isosize = isosize(aligned_buffer);
-
-    aligned_free(aligned_buffer);
+    result->isosize = isosize(pvd);
+    result->fragmentsums[0] = '\0';
+    result->manifestsum[0] = '\0';
+    result->verityroot[0] = '\0';
+    result->veritysalt[0] = '\0';
+    result->veritydata = 0;
+    result->verityblocks = 0;
+    result->verityhash = 0;
 
     for (size_t index = 0; index < APPDATA_SIZE;) {
         size_t len;
@@ -169,8 +255,7 @@ struct volume_info *const parsepvd(const int isofd) {
             for (char *p = buffer + index; index < APPDATA_SIZE && *p != ';';
                  p++, index++) {
             }
-        } else if ((len = matches_number(buffer, index,
-                                         "SKIPSECTORS = ", (long int *) &result->skipsectors))) {
+        } else if ((len = matches_offset(buffer, index, "SKIPSECTORS = ", &result->skipsectors))) {
             index = len;
             if (index >= APPDATA_SIZE)
                 goto fail;
@@ -193,6 +278,42 @@ struct volume_info *const parsepvd(const int isofd) {
         } else if ((len = matches_number(buffer, index, "FRAGMENT COUNT = ", (long int *) &result->fragmentcount))) {
             index = len;
             task |= TASK_FRAGCOUNT;
+        } else if ((len = starts_with(buffer + index, "FILE MANIFEST MD5SUM = "))) {
+            index += len;
+            if (index + HASH_SIZE >= APPDATA_SIZE)
+                goto fail;
+            memcpy(result->manifestsum, buffer + index, HASH_SIZE);
+            result->manifestsum[HASH_SIZE] = '\0';
+            task |= TASK_MANIFEST;
+            index += HASH_SIZE;
+            for (char *p = buffer + index; index < APPDATA_SIZE && *p != ';';
+                 p++, index++) {
+            }
+        } else if ((len = starts_with(buffer + index, "VERITY ROOT = "))) {
+            index += len;
+            if (index + VERITY_ROOT_HEX_SIZE >= APPDATA_SIZE)
+                goto fail;
+            memcpy(result->verityroot, buffer + index, VERITY_ROOT_HEX_SIZE);
+            result->verityroot[VERITY_ROOT_HEX_SIZE] = '\0';
+            task |= TASK_VERITY_ROOT;
+            index += VERITY_ROOT_HEX_SIZE;
+        } else if ((len = starts_with(buffer + index, "VERITY SALT = "))) {
+            index += len;
+            if (index + VERITY_SALT_HEX_SIZE >= APPDATA_SIZE)
+                goto fail;
+            memcpy(result->veritysalt, buffer + index, VERITY_SALT_HEX_SIZE);
+            result->veritysalt[VERITY_SALT_HEX_SIZE] = '\0';
+            task |= TASK_VERITY_SALT;
+            index += VERITY_SALT_HEX_SIZE;
+        } else if ((len = matches_offset(buffer, index, "VERITY DATA = ", &result->veritydata))) {
+            index = len;
+            task |= TASK_VERITY_DATA;
+        } else if ((len = matches_offset(buffer, index, "VERITY BLOCKS = ", &result->verityblocks))) {
+            index = len;
+            task |= TASK_VERITY_BLOCKS;
+        } else if ((len = matches_offset(buffer, index, "VERITY HASH = ", &result->verityhash))) {
+            index = len;
+            task |= TASK_VERITY_HASH;
         }
         /* Either something is wrong or it skips a semicolon. */
         index++;
@@ -200,12 +321,33 @@ struct volume_info *const parsepvd(const int isofd) {
             break;
     }
 
-    if (task < TASK_SKIP + TASK_MD5) {
+    /* A hash tree is only usable with all of its parameters. */
+    const enum task_status verity = TASK_VERITY_ROOT | TASK_VERITY_SALT | TASK_VERITY_DATA |
+                                    TASK_VERITY_BLOCKS | TASK_VERITY_HASH;
+    if ((task & verity) != verity)
+        result->verityroot[0] = '\0';
+
+    if ((task & (TASK_SKIP | TASK_MD5)) != (TASK_SKIP | TASK_MD5)) {
     fail:
-        free(result);
-        return NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Fill the part of the appdata at appdata_offset that lies in buffer, which
+ * holds size bytes of the image from offset, with spaces as it was when the
+ * md5sum was computed.
+ */
+void clear_appdata(unsigned char *const buffer, const size_t size, const int64_t appdata_offset, const int64_t offset) {
+    static const int64_t buffer_start = 0;
+    const int64_t difference = appdata_offset - offset;
+    if (-APPDATA_SIZE <= difference && difference <= (int64_t) size) {
+        const size_t clear_start = (size_t) MAX(buffer_start, difference);
+        const size_t clear_len = MIN(size, (size_t)(difference + APPDATA_SIZE)) - clear_start;
+        PROBE2(appdata__clear, offset + (int64_t) clear_start, clear_len);
+        memset(buffer + clear_start, ' ', clear_len);
     }
-    return result;
 }
 
 /**
@@ -255,3 +397,687 @@ void md5sum(char *const hashsum, MD5_CTX *const hashctx) {
         strncat(hashsum, tmp, 2);
     }
 }
+
+static uint32_t read_le32(const unsigned char *const buffer) {
+    return (uint32_t) buffer[0] | (uint32_t) buffer[1] << 8 |
+           (uint32_t) buffer[2] << 16 | (uint32_t) buffer[3] << 24;
+}
+
+/**
+ * Read size bytes at offset into a newly allocated buffer.
+ */
+static unsigned char *read_extent(const int fd, const int64_t offset, const size_t size) {
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        return NULL;
+    unsigned char *const buffer = malloc(size);
+    if (buffer == NULL)
+        return NULL;
+    for (size_t done = 0; done < size;) {
+        const ssize_t nread = read(fd, buffer + done, size - done);
+        if (nread <= 0) {
+            free(buffer);
+            return NULL;
+        }
+        done += (size_t) nread;
+    }
+    return buffer;
+}
+
+/**
+ * Store the name of a directory record in name. The Rock Ridge alternate name
+ * (RRIP NM entries in the system use area) is preferred. Otherwise the
+ * ISO9660 identifier is mapped the way the kernel does by default: the
+ * version suffix and a trailing dot are removed and it is lowercased.
+ */
+static void record_name(const unsigned char *const record, char *const name, const size_t size) {
+    /* According to ECMA-119 9.1. */
+    const size_t record_len = record[0];
+    const size_t name_len = record[32];
+    const char *const identifier = (const char *) record + 33;
+
+    size_t len = 0;
+    size_t index = 33 + name_len + (name_len % 2 == 0);
+    while (index + 4 <= record_len) {
+        const unsigned char *const entry = record + index;
+        const size_t entry_len = entry[2];
+        if (entry_len < 4 || index + entry_len > record_len)
+            break;
+        if (entry[0] == 'N' && entry[1] == 'M' && entry_len > 5) {
+            const size_t part = MIN(entry_len - 5, size - 1 - len);
+            memcpy(name + len, entry + 5, part);
+            len += part;
+            /* Stop unless the CONTINUE flag is set. */
+            if (!(entry[4] & 1))
+                break;
+        }
+        index += entry_len;
+    }
+    if (len > 0) {
+        name[len] = '\0';
+        return;
+    }
+
+    for (; len < name_len && len < size - 1 && identifier[len] != ';'; len++)
+        name[len] = (char) tolower((unsigned char) identifier[len]);
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    name[len] = '\0';
+}
+
+static int walk_directory(const int fd, const int64_t extent, const int64_t length,
+                          char *const path, const int depth, isoFileCallback cb, void *cbdata) {
+    /* According to ECMA-119 9.1.6. */
+    enum { FLAG_DIRECTORY = 1 << 1,
+           FLAG_MULTI_EXTENT = 1 << 7 };
+
+    /* Refuse absurd directory sizes rather than allocating them. */
+    if (length <= 0 || length > 64 * 1024 * 1024)
+        return -1;
+    unsigned char *const buffer = read_extent(fd, extent, (size_t) length);
+    if (buffer == NULL)
+        return -1;
+
+    const size_t pathlen = strlen(path);
+    struct iso_file file = { .size = 0 };
+    int rc = 0;
+    for (int64_t index = 0; rc == 0 && index < length;) {
+        const unsigned char *const record = buffer + index;
+        const size_t record_len = record[0];
+        if (record_len == 0) {
+            /* Records never span sectors, the rest of this one is padding. */
+            index = (index / SECTOR_SIZE + 1) * SECTOR_SIZE;
+            continue;
+        }
+        if (record_len < 34 || index + (int64_t) record_len > length ||
+            33 + (size_t) record[32] > record_len)
+            break;
+        index += record_len;
+
+        /* Skip the entries for the directory itself and its parent. */
+        if (record[32] == 1 && (record[33] == 0 || record[33] == 1))
+            continue;
+
+        char name[ISO_PATH_SIZE];
+        record_name(record, name, sizeof(name));
+        if (pathlen + 1 + strlen(name) >= ISO_PATH_SIZE)
+            continue;
+
+        const int64_t data_offset = (int64_t) read_le32(record + 2) * SECTOR_SIZE;
+        const int64_t data_length = read_le32(record + 10);
+        if (record[25] & FLAG_DIRECTORY) {
+            if (depth < MAX_DIRECTORY_DEPTH) {
+                snprintf(path + pathlen, ISO_PATH_SIZE - pathlen, "%s%s", pathlen ? "/" : "", name);
+                rc = walk_directory(fd, data_offset, data_length, path, depth + 1, cb, cbdata);
+                path[pathlen] = '\0';
+            }
+            continue;
+        }
+
+        /* Files larger than 4 GiB are recorded as consecutive extents. */
+        if (file.size == 0) {
+            snprintf(file.path, ISO_PATH_SIZE, "%s%s%s", path, pathlen ? "/" : "", name);
+            file.offset = data_offset;
+        }
+        file.size += data_length;
+        if (!(record[25] & FLAG_MULTI_EXTENT)) {
+            rc = cb(cbdata, &file);
+            file.size = 0;
+        }
+    }
+    free(buffer);
+    return rc;
+}
+
+/**
+ * Call cb for every regular file in the directory tree of the image, in
+ * directory order. Paths are relative to the root and separated by '/'.
+ * Return 0 on success, -1 if the tree could not be read or the non-zero value
+ * returned by cb.
+ */
+int walk_iso_tree(const int isofd, isoFileCallback cb, void *cbdata) {
+    int64_t offset;
+    unsigned char *const sectors = alloc_descriptor_buffer();
+    if (sectors == NULL)
+        return -1;
+    const unsigned char *const buffer = read_primary_volume_descriptor(isofd, sectors, &offset);
+    if (buffer == NULL) {
+        aligned_free(sectors);
+        return -1;
+    }
+    const unsigned char *const root = buffer + ROOT_RECORD_OFFSET;
+    const int64_t extent = (int64_t) read_le32(root + 2) * SECTOR_SIZE;
+    const int64_t length = read_le32(root + 10);
+    aligned_free(sectors);
+
+    char path[ISO_PATH_SIZE] = "";
+    return walk_directory(isofd, extent, length, path, 0, cb, cbdata);
+}
+
+/**
+ * Shell style matching of string against pattern, where '*' matches any
+ * sequence including '/' and '?' any single character. ISO9660 names do not
+ * keep case, so letters match case-insensitively. A pattern without a '/' is
+ * also matched against the last component of string.
+ */
+bool match_pattern(const char *pattern, const char *string) {
+    const char *const base = strrchr(string, '/');
+    if (base != NULL && strchr(pattern, '/') == NULL && match_pattern(pattern, base + 1))
+        return true;
+
+    const char *star = NULL;
+    const char *resume = NULL;
+    while (*string) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = string;
+        } else if (*pattern == '?' ||
+                   tolower((unsigned char) *pattern) == tolower((unsigned char) *string)) {
+            pattern++;
+            string++;
+        } else if (star != NULL) {
+            pattern = star + 1;
+            string = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+/**
+ * Nanoseconds since an arbitrary fixed point, for measuring intervals.
+ */
+int64_t monotonic_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (int64_t)((double) counter.QuadPart * 1e9 / (double) frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif
+}
+
+struct isomd5sum_context *isomd5sumContextNew(void) {
+    const size_t pagesize = (size_t) getpagesize();
+    /* The buffers lead the context, so they share its page alignment. */
+    const size_t size = (sizeof(struct isomd5sum_context) + pagesize - 1) / pagesize * pagesize;
+    struct isomd5sum_context *const ctx = aligned_alloc(pagesize, size);
+    if (ctx != NULL) {
+        /* Everything past the buffers starts out zero, so new fields do too. */
+        memset(&ctx->info, 0, sizeof(*ctx) - offsetof(struct isomd5sum_context, info));
+        ctx->throttle.saved_ioprio = -1;
+        ctx->progress_interval = PROGRESS_INTERVAL_NS;
+    }
+    return ctx;
+}
+
+void isomd5sumContextFree(struct isomd5sum_context *ctx) {
+    if (ctx != NULL) {
+        midstate_cache_close(ctx->cache);
+        free(ctx->profile.regions.items);
+        free(ctx->profile.fragments.items);
+        aligned_free(ctx->ahead.buffer);
+        digest_free(ctx->digest);
+    }
+    aligned_free(ctx);
+}
+
+void isomd5sumContextSetThrottle(struct isomd5sum_context *ctx, long long max_rate, int flags) {
+    ctx->throttle.max_rate = MAX(max_rate, 0LL);
+    ctx->throttle.flags = flags;
+}
+
+void isomd5sumContextSetProgressInterval(struct isomd5sum_context *ctx, int interval) {
+    ctx->progress_interval = (int64_t) MAX(interval, 0) * 1000000LL;
+}
+
+/**
+ * Return true if the progress callback should be called now. Between two
+ * callbacks the read loop only looks at the clock, which needs no syscall
+ * on most systems.
+ */
+bool progress_due(struct isomd5sum_context *const ctx) {
+    if (ctx->progress_interval == 0)
+        return true;
+    const int64_t now = monotonic_ns();
+    if (now < ctx->progress_due)
+        return false;
+    ctx->progress_due = now + ctx->progress_interval;
+    return true;
+}
+
+/* Longest adaptive pause before a single read. */
+#define MAX_PAUSE_NS 100000000LL
+/* Latency above twice the baseline plus this much means the device is busy. */
+#define LATENCY_SLACK_NS 500000LL
+
+#ifdef __linux__
+/* From linux/ioprio.h, which isn't installed everywhere. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+static void sleep_ns(const int64_t ns) {
+#ifdef _WIN32
+    Sleep((DWORD)((ns + 999999LL) / 1000000LL));
+#else
+    struct timespec delay = { .tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL };
+    while (nanosleep(&delay, &delay) && errno == EINTR) {
+    }
+#endif
+}
+
+/**
+ * Start reading an image: fill the token bucket, forget the latencies of the
+ * previous image and drop to the idle I/O priority if asked to. The priority
+ * is set for the calling thread only.
+ */
+void throttle_begin(struct io_throttle *const throttle) {
+    throttle->tokens = 0;
+    throttle->refilled = monotonic_ns();
+    throttle->baseline = 0;
+    throttle->latency = 0;
+    throttle->pause = 0;
+    throttle->saved_ioprio = -1;
+#ifdef __linux__
+    if (throttle->flags & ISOMD5SUM_THROTTLE_IDLE) {
+        const int saved = (int) syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+        if (saved >= 0 &&
+            syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0)
+            throttle->saved_ioprio = saved;
+    }
+#endif
+}
+
+void throttle_end(struct io_throttle *const throttle) {
+#ifdef __linux__
+    if (throttle->saved_ioprio >= 0)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, throttle->saved_ioprio);
+#endif
+    throttle->saved_ioprio = -1;
+}
+
+/**
+ * Wait until nbyte may be read. The bucket holds up to a tenth of a second
+ * worth of tokens, so a stalled reader can't burst afterwards.
+ */
+void throttle_wait(struct io_throttle *const throttle, const size_t nbyte) {
+    if (throttle->pause)
+        sleep_ns(throttle->pause);
+    if (throttle->max_rate == 0)
+        return;
+
+    const int64_t burst = MAX((int64_t) READ_BUFFER_SIZE, throttle->max_rate / 10);
+    const int64_t now = monotonic_ns();
+    const double earned = (double) (now - throttle->refilled) * (double) throttle->max_rate / 1e9;
+    throttle->tokens = (int64_t) MIN((double) burst, (double) throttle->tokens + earned);
+    throttle->refilled = now;
+
+    const int64_t missing = (int64_t) nbyte - throttle->tokens;
+    if (missing > 0) {
+        const int64_t delay = (int64_t) ((double) missing * 1e9 / (double) throttle->max_rate);
+        sleep_ns(delay);
+        /* Tokens earned while oversleeping are picked up by the next refill. */
+        throttle->tokens += missing;
+        throttle->refilled = now + delay;
+    }
+    throttle->tokens -= (int64_t) nbyte;
+}
+
+/**
+ * Feed the latency of a read to the adaptive mode. While reads are clearly
+ * slower than the baseline the pause doubles, otherwise it halves.
+ */
+void throttle_account(struct io_throttle *const throttle, const int64_t latency) {
+    if (!(throttle->flags & ISOMD5SUM_THROTTLE_ADAPTIVE))
+        return;
+    if (throttle->baseline == 0) {
+        throttle->baseline = throttle->latency = MAX(latency, 1LL);
+        return;
+    }
+    throttle->latency += (latency - throttle->latency) / 4;
+    if (throttle->latency > 2 * throttle->baseline + LATENCY_SLACK_NS) {
+        throttle->pause = MIN(MAX_PAUSE_NS, throttle->pause ? 2 * throttle->pause : throttle->latency);
+        /* Follow a lasting change of the device, if slowly. */
+        throttle->baseline += (latency - throttle->baseline) / 256;
+    } else {
+        throttle->pause /= 2;
+        throttle->baseline += (latency - throttle->baseline) / 64;
+    }
+}
+
+/* Add a read to bucket index, growing the table as the image goes on. */
+static void profile_account(struct profile_buckets *const buckets, const size_t index, const size_t nbyte,
+                            const int64_t latency) {
+    if (index >= buckets->capacity) {
+        const size_t capacity = MAX(index + 1, 2 * buckets->capacity);
+        struct profile_bucket *const items = realloc(buckets->items, capacity * sizeof(*items));
+        if (items == NULL)
+            return;
+        buckets->items = items;
+        buckets->capacity = capacity;
+    }
+    if (index >= buckets->count) {
+        memset(buckets->items + buckets->count, 0, (index + 1 - buckets->count) * sizeof(*buckets->items));
+        buckets->count = index + 1;
+    }
+    struct profile_bucket *const bucket = &buckets->items[index];
+    bucket->bytes += (int64_t) nbyte;
+    bucket->read_calls++;
+    bucket->read_ns += latency;
+    bucket->max_ns = MAX(bucket->max_ns, latency);
+}
+
+/* Return the histogram bucket of a read taking latency nanoseconds. */
+static size_t latency_bucket(const int64_t latency) {
+    size_t bucket = 0;
+    for (int64_t us = latency / 1000; us > 0 && bucket < ISOMD5SUM_LATENCY_BUCKETS - 1; us >>= 1)
+        bucket++;
+    return bucket;
+}
+
+/* Account a read starting at offset of the image to its region and fragment. */
+static void profile_read(struct read_profile *const profile, const int64_t offset, const ssize_t nread,
+                         const int64_t latency) {
+    const size_t nbyte = nread > 0 ? (size_t) nread : 0;
+    profile_account(&profile->regions, (size_t) (offset / profile->region_size), nbyte, latency);
+    if (profile->fragment_size > 0)
+        profile_account(&profile->fragments, (size_t) (offset / profile->fragment_size), nbyte, latency);
+    profile->histogram[latency_bucket(latency)]++;
+}
+
+/**
+ * Read nbyte at the current position, which is offset, into buffer, keeping
+ * to the rate limit of ctx and updating its statistics.
+ */
+static ssize_t device_read(struct isomd5sum_context *const ctx, const int isofd, const int64_t offset,
+                           unsigned char *const buffer, const size_t nbyte) {
+    struct io_throttle *const throttle = &ctx->throttle;
+    const bool timed = ctx->stats_enabled || ctx->profile.region_size > 0 || ctx->metrics ||
+                       (throttle->flags & ISOMD5SUM_THROTTLE_ADAPTIVE);
+
+    const int64_t waiting = ctx->stats_enabled ? monotonic_ns() : 0;
+    throttle_wait(throttle, nbyte);
+    const int64_t start = timed ? monotonic_ns() : 0;
+    PROBE2(read__start, offset, nbyte);
+    const ssize_t nread = read(isofd, buffer, nbyte);
+    PROBE2(read__done, offset, nread);
+    const int64_t latency = timed ? monotonic_ns() - start : 0;
+    throttle_account(throttle, latency);
+    if (ctx->profile.region_size > 0)
+        profile_read(&ctx->profile, offset, nread, latency);
+    if (ctx->metrics && nread > 0) {
+        ctx->metrics_bytes += nread;
+        metrics_read(ctx->metrics, (size_t) nread, latency);
+    }
+
+    if (ctx->stats_enabled) {
+        struct run_stats *const stats = &ctx->stats;
+        stats->throttle_ns += start - waiting;
+        stats->read_ns += latency;
+        stats->read_calls++;
+        if (nread > 0) {
+            stats->bytes_read += nread;
+            stats->peak_buffer = MAX(stats->peak_buffer, (int64_t) nread);
+            if ((size_t) nread < nbyte)
+                stats->short_reads++;
+        }
+    }
+    return nread;
+}
+
+/**
+ * Compute the md5sum of size bytes at offset and store it in hashsum in base 16.
+ * With ctx the extent is read into its buffer, keeping to its rate limit.
+ */
+bool md5sum_extent(struct isomd5sum_context *const ctx, const int isofd, const int64_t offset, const int64_t size,
+                   char *const hashsum) {
+    if (lseek(isofd, offset, SEEK_SET) == -1)
+        return false;
+
+    const size_t buffer_size = READ_BUFFER_SIZE;
+    unsigned char *buffer;
+    if (ctx != NULL)
+        buffer = ctx->buffer;
+    else
+        buffer = aligned_alloc((size_t) getpagesize(), buffer_size * sizeof(*buffer));
+    if (buffer == NULL)
+        return false;
+
+    MD5_CTX hashctx;
+    MD5_Init(&hashctx);
+    int64_t done = 0LL;
+    while (done < size) {
+        const size_t nbyte = MIN((size_t)(size - done), buffer_size);
+        const ssize_t nread = ctx ? device_read(ctx, isofd, offset + done, buffer, nbyte) : read(isofd, buffer, nbyte);
+        if (nread <= 0L)
+            break;
+        MD5_Update(&hashctx, buffer, (size_t) nread);
+        done += nread;
+    }
+    if (ctx == NULL)
+        aligned_free(buffer);
+    md5sum(hashsum, &hashctx);
+    return done == size;
+}
+
+/**
+ * Return up to nbyte of the image at offset, which is the current position
+ * unless it is held by the read-ahead, in *data. Without read-ahead they are
+ * read into the buffer of ctx.
+ */
+ssize_t context_read(struct isomd5sum_context *const ctx, const int isofd, const int64_t offset, const size_t nbyte,
+                     unsigned char **const data) {
+    struct read_ahead *const ahead = &ctx->ahead;
+    if (ahead->buffer == NULL) {
+        /* The digest thread may still be hashing the buffer. */
+        digest_wait(ctx->digest);
+        *data = ctx->buffer;
+        const ssize_t nread = device_read(ctx, isofd, offset, ctx->buffer, nbyte);
+        if (nread > 0)
+            digest_update(ctx->digest, offset, *data, (size_t) nread);
+        return nread;
+    }
+    if (offset < ahead->offset || offset >= ahead->offset + (int64_t) ahead->size) {
+        digest_wait(ctx->digest);
+        const ssize_t nread = device_read(ctx, isofd, offset, ahead->buffer, ahead->capacity);
+        if (nread <= 0)
+            return nread;
+        ahead->offset = offset;
+        ahead->size = (size_t) nread;
+    }
+    const size_t skip = (size_t) (offset - ahead->offset);
+    *data = ahead->buffer + skip;
+    const size_t size = MIN(nbyte, ahead->size - skip);
+    digest_update(ctx->digest, offset, *data, size);
+    return (ssize_t) size;
+}
+
+int isomd5sumContextSetReadSize(struct isomd5sum_context *ctx, long long read_size) {
+    const size_t blocks = (size_t) MIN(MAX(read_size, 0LL), (long long) MAX_READ_SIZE) / READ_BUFFER_SIZE;
+    aligned_free(ctx->ahead.buffer);
+    memset(&ctx->ahead, 0, sizeof(ctx->ahead));
+    if (blocks <= 1)
+        return 0;
+    ctx->ahead.capacity = blocks * READ_BUFFER_SIZE;
+    ctx->ahead.buffer = aligned_alloc((size_t) getpagesize(), ctx->ahead.capacity);
+    if (ctx->ahead.buffer == NULL) {
+        ctx->ahead.capacity = 0;
+        return -1;
+    }
+    return 0;
+}
+
+long long isomd5sumContextReadSize(struct isomd5sum_context *ctx) {
+    return ctx->ahead.buffer ? (long long) ctx->ahead.capacity : (long long) READ_BUFFER_SIZE;
+}
+
+void isomd5sumContextEnableStats(struct isomd5sum_context *ctx, int enable) {
+    ctx->stats_enabled = enable != 0;
+}
+
+int isomd5sumContextSetCache(struct isomd5sum_context *ctx, const char *path) {
+    struct midstate_cache *cache = NULL;
+    if (path != NULL && (cache = midstate_cache_open(path)) == NULL)
+        return -1;
+    midstate_cache_close(ctx->cache);
+    ctx->cache = cache;
+    return 0;
+}
+
+void isomd5sumContextStats(struct isomd5sum_context *ctx, struct isomd5sum_stats *stats) {
+    const struct run_stats *const run = &ctx->stats;
+    stats->bytes_read = run->bytes_read;
+    stats->read_calls = run->read_calls;
+    stats->short_reads = run->short_reads;
+    stats->peak_buffer = run->peak_buffer;
+    stats->read_seconds = (double) run->read_ns / 1e9;
+    stats->throttle_seconds = (double) run->throttle_ns / 1e9;
+    stats->hash_seconds = (double) run->hash_ns / 1e9;
+    stats->validate_seconds = (double) run->validate_ns / 1e9;
+    stats->callback_seconds = (double) run->callback_ns / 1e9;
+    stats->total_seconds = (double) run->total_ns / 1e9;
+    stats->cached_bytes = run->cached_bytes;
+    stats->engine = MD5_ENGINE;
+}
+
+void isomd5sumContextPrintStats(struct isomd5sum_context *ctx) {
+    struct isomd5sum_stats stats;
+    isomd5sumContextStats(ctx, &stats);
+    printf("{\"engine\": \"%s\", \"bytes_read\": %lld, \"read_calls\": %lld, \"short_reads\": %lld, "
+           "\"peak_buffer\": %lld, \"read_seconds\": %.6f, \"throttle_seconds\": %.6f, "
+           "\"hash_seconds\": %.6f, \"validate_seconds\": %.6f, \"callback_seconds\": %.6f, "
+           "\"total_seconds\": %.6f, \"cached_bytes\": %lld}\n",
+           stats.engine, stats.bytes_read, stats.read_calls, stats.short_reads, stats.peak_buffer,
+           stats.read_seconds, stats.throttle_seconds, stats.hash_seconds, stats.validate_seconds,
+           stats.callback_seconds, stats.total_seconds, stats.cached_bytes);
+    fflush(stdout);
+}
+
+void isomd5sumContextEnableProfile(struct isomd5sum_context *ctx, long long region_size) {
+    ctx->profile.region_size = MAX(region_size, 0LL);
+}
+
+static size_t copy_profile(const struct profile_buckets *const buckets, const int64_t size,
+                           struct isomd5sum_read_profile *const profile, const size_t count) {
+    for (size_t i = 0; i < MIN(count, buckets->count); i++) {
+        const struct profile_bucket *const bucket = &buckets->items[i];
+        profile[i].offset = (long long) ((int64_t) i * size);
+        profile[i].bytes = bucket->bytes;
+        profile[i].read_calls = bucket->read_calls;
+        profile[i].read_seconds = (double) bucket->read_ns / 1e9;
+        profile[i].max_latency_seconds = (double) bucket->max_ns / 1e9;
+    }
+    return buckets->count;
+}
+
+size_t isomd5sumContextRegionProfile(struct isomd5sum_context *ctx, struct isomd5sum_read_profile *profile,
+                                     size_t count) {
+    return copy_profile(&ctx->profile.regions, ctx->profile.region_size, profile, count);
+}
+
+size_t isomd5sumContextFragmentProfile(struct isomd5sum_context *ctx, struct isomd5sum_read_profile *profile,
+                                       size_t count) {
+    return copy_profile(&ctx->profile.fragments, ctx->profile.fragment_size, profile, count);
+}
+
+void isomd5sumContextLatencyHistogram(struct isomd5sum_context *ctx, long long *histogram) {
+    for (size_t i = 0; i < ISOMD5SUM_LATENCY_BUCKETS; i++)
+        histogram[i] = ctx->profile.histogram[i];
+}
+
+/* Upper bound in microseconds of a histogram bucket, -1 for the last one. */
+static long long latency_bucket_max(const size_t bucket) {
+    return bucket < ISOMD5SUM_LATENCY_BUCKETS - 1 ? 1LL << bucket : -1LL;
+}
+
+static double profile_rate(const struct profile_bucket *const bucket) {
+    return bucket->read_ns > 0 ? (double) bucket->bytes * 1e3 / (double) bucket->read_ns : 0.0;
+}
+
+static void print_buckets_json(const struct profile_buckets *const buckets, const int64_t size) {
+    for (size_t i = 0; i < buckets->count; i++) {
+        const struct profile_bucket *const bucket = &buckets->items[i];
+        printf("%s{\"offset\": %lld, \"bytes\": %lld, \"reads\": %lld, \"seconds\": %.6f, "
+               "\"mb_per_s\": %.3f, \"max_latency_us\": %lld}",
+               i ? ", " : "", (long long) ((int64_t) i * size), (long long) bucket->bytes,
+               (long long) bucket->read_calls, (double) bucket->read_ns / 1e9, profile_rate(bucket),
+               (long long) (bucket->max_ns / 1000));
+    }
+}
+
+static void print_buckets_csv(const struct profile_buckets *const buckets, const int64_t size,
+                              const char *const kind) {
+    for (size_t i = 0; i < buckets->count; i++) {
+        const struct profile_bucket *const bucket = &buckets->items[i];
+        printf("%s,%zu,%lld,%lld,%lld,%.6f,%.3f,%lld\n", kind, i, (long long) ((int64_t) i * size),
+               (long long) bucket->bytes, (long long) bucket->read_calls, (double) bucket->read_ns / 1e9,
+               profile_rate(bucket), (long long) (bucket->max_ns / 1000));
+    }
+}
+
+void isomd5sumContextPrintProfile(struct isomd5sum_context *ctx, int format) {
+    const struct read_profile *const profile = &ctx->profile;
+    if (format == ISOMD5SUM_PROFILE_CSV) {
+        printf("kind,index,offset,bytes,reads,seconds,mb_per_s,max_latency_us\n");
+        print_buckets_csv(&profile->regions, profile->region_size, "region");
+        print_buckets_csv(&profile->fragments, profile->fragment_size, "fragment");
+        /* Histogram rows use the columns of the slowest read and the count. */
+        for (size_t i = 0; i < ISOMD5SUM_LATENCY_BUCKETS; i++)
+            printf("latency,%zu,,,%lld,,,%lld\n", i, (long long) profile->histogram[i], latency_bucket_max(i));
+    } else {
+        printf("{\"region_size\": %lld, \"fragment_size\": %lld, \"regions\": [",
+               (long long) profile->region_size, (long long) profile->fragment_size);
+        print_buckets_json(&profile->regions, profile->region_size);
+        printf("], \"fragments\": [");
+        print_buckets_json(&profile->fragments, profile->fragment_size);
+        printf("], \"latency_histogram\": [");
+        for (size_t i = 0; i < ISOMD5SUM_LATENCY_BUCKETS; i++)
+            printf("%s{\"max_us\": %lld, \"reads\": %lld}", i ? ", " : "", latency_bucket_max(i),
+                   (long long) profile->histogram[i]);
+        printf("]}\n");
+    }
+    fflush(stdout);
+}
+
+/* Reset the statistics, the read profile and the read-ahead for a new run. */
+void stats_begin(struct isomd5sum_context *const ctx) {
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->ahead.offset = 0;
+    ctx->ahead.size = 0;
+    ctx->profile.fragment_size = 0;
+    ctx->profile.regions.count = 0;
+    ctx->profile.fragments.count = 0;
+    memset(ctx->profile.histogram, 0, sizeof(ctx->profile.histogram));
+    ctx->stats.total_ns = stats_start(ctx);
+}
+
+void stats_end(struct isomd5sum_context *const ctx) {
+    if (ctx->stats_enabled)
+        ctx->stats.total_ns = monotonic_ns() - ctx->stats.total_ns;
+}
+
+/* Start timing a step, without reading the clock if statistics are off. */
+int64_t stats_start(const struct isomd5sum_context *const ctx) {
+    return ctx->stats_enabled ? monotonic_ns() : 0;
+}
+
+void stats_stop(const struct isomd5sum_context *const ctx, int64_t *const counter, const int64_t start) {
+    if (ctx->stats_enabled)
+        *counter += monotonic_ns() - start;
+}
+
+/**
+ * Parse the volume info of isofd into ctx unless it has been loaded already.
+ */
+bool load_volume_info(struct isomd5sum_context *const ctx, const int isofd) {
+    if (!ctx->loaded)
+        ctx->loaded = read_volume_info(isofd, ctx->descriptors, &ctx->info);
+    return ctx->loaded;
+}
@@ -35,6 +35,7 @@
 #endif
 
 #include "md5.h"
+#include "libisomd5sum.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -49,6 +50,9 @@
 /* FRAGMENT_COUNT must be an integral divisor or FRAGMENT_SUM_SIZE */
 /* 60 => 2, 3, 4, 5, 6, 10, 12, 15, 20, or 30 */
 #define FRAGMENT_COUNT 20UL
+/* Length in characters of the dm-verity root hash and salt in the appdata. */
+#define VERITY_ROOT_HEX_SIZE 64
+#define VERITY_SALT_HEX_SIZE 32
 /* Size offset according to ECMA-119 8.4.8 volume space size in big endian
  * format. */
 #define SIZE_OFFSET 84
@@ -58,13 +62,34 @@
 #define SECTOR_SIZE 2048LL
 #define NUM_SYSTEM_SECTORS 16LL
 #define SYSTEM_AREA_SIZE (NUM_SYSTEM_SECTORS * SECTOR_SIZE)
+/* Number of volume descriptor sectors fetched with a single read. */
+#define VOLUME_DESCRIPTOR_BATCH 16
+#define DESCRIPTOR_BUFFER_SIZE (VOLUME_DESCRIPTOR_BATCH * SECTOR_SIZE)
+/* Default time between two progress callbacks. */
+#define PROGRESS_INTERVAL_NS 100000000LL
+/* Size of the buffer the image is read through. */
+#define READ_BUFFER_SIZE (NUM_SYSTEM_SECTORS * SECTOR_SIZE)
+/* Largest read size of isomd5sumContextSetReadSize. */
+#define MAX_READ_SIZE (16 * 1024 * 1024)
 /* According to ECMA-119 8.4.32 */
 #define APPDATA_OFFSET 883LL
 #define APPDATA_SIZE 512
+/* According to ECMA-119 8.4.18, root directory record in the PVD. */
+#define ROOT_RECORD_OFFSET 156LL
+/* Size of a path inside the image including the terminating null byte. */
+#define ISO_PATH_SIZE 256
+/* Deepest directory level followed when walking the image tree. */
+#define MAX_DIRECTORY_DEPTH 32
 
 struct volume_info {
     char hashsum[HASH_SIZE + 1];
     char fragmentsums[FRAGMENT_SUM_SIZE + 1];
+    char manifestsum[HASH_SIZE + 1];
+    char verityroot[VERITY_ROOT_HEX_SIZE + 1];  /* Empty without a hash tree */
+    char veritysalt[VERITY_SALT_HEX_SIZE + 1];
+    int64_t veritydata;   /* Image offset of the first block under the tree */
+    int64_t verityblocks; /* Number of 2048 byte blocks under the tree */
+    int64_t verityhash;   /* Offset of the tree in the image, 0 if kept apart */
     size_t supported;
     size_t fragmentcount;
     int64_t offset;       /* Use int64_t instead of off_t for Windows compatibility */
@@ -72,13 +97,200 @@ struct volume_info {
     int64_t skipsectors;  /* Use int64_t instead of off_t for Windows compatibility */
 };
 
-int64_t primary_volume_size(const int isofd, int64_t *const offset);
+/* Rate limit and back off state of the reads through a context. */
+struct io_throttle {
+    int64_t max_rate;       /* Bytes per second, 0 for no limit */
+    int flags;              /* Mask of isomd5sum_throttle_flags */
+    int64_t tokens;         /* Bytes that may be read without waiting */
+    int64_t refilled;       /* Time the tokens were last refilled at */
+    int64_t baseline;       /* Slow moving average of the read latency */
+    int64_t latency;        /* Fast moving average of the read latency */
+    int64_t pause;          /* Adaptive delay before each read */
+    int saved_ioprio;       /* I/O priority to restore, -1 for none */
+};
+
+/* Counters behind struct isomd5sum_stats, times in nanoseconds. */
+struct run_stats {
+    int64_t bytes_read;
+    int64_t read_calls;
+    int64_t short_reads;
+    int64_t peak_buffer;
+    int64_t read_ns;
+    int64_t throttle_ns;
+    int64_t hash_ns;
+    int64_t validate_ns;
+    int64_t callback_ns;
+    int64_t total_ns;
+    int64_t cached_bytes;
+};
+
+/* Reads of a region of the image, see struct isomd5sum_read_profile. */
+struct profile_bucket {
+    int64_t bytes;
+    int64_t read_calls;
+    int64_t read_ns;
+    int64_t max_ns;
+};
+
+struct profile_buckets {
+    struct profile_bucket *items;
+    size_t count;
+    size_t capacity;
+};
+
+/* Read latency per region and fragment, see isomd5sumContextEnableProfile. */
+struct read_profile {
+    int64_t region_size;    /* 0 while profiling is off */
+    int64_t fragment_size;  /* 0 until the size of the image is known */
+    struct profile_buckets regions;
+    struct profile_buckets fragments;
+    int64_t histogram[ISOMD5SUM_LATENCY_BUCKETS];
+};
+
+/* Reads larger than the context buffer, see isomd5sumContextSetReadSize. The
+ * loops still take the data in READ_BUFFER_SIZE slices, so fragment sums are
+ * computed at the same offsets whatever the read size. */
+struct read_ahead {
+    unsigned char *buffer;  /* NULL while reads go straight to the context buffer */
+    size_t capacity;
+    int64_t offset;         /* Offset of the image buffer starts at */
+    size_t size;            /* Bytes held in buffer */
+};
+
+struct midstate_cache;
+struct isomd5sum_metrics;
+struct image_digest;
+
+/* Buffers and parsed information reused across checks and implants. */
+struct isomd5sum_context {
+    /* The buffers lead the page aligned context, keeping them aligned. */
+    unsigned char buffer[READ_BUFFER_SIZE];
+    unsigned char descriptors[DESCRIPTOR_BUFFER_SIZE];
+    struct volume_info info;
+    /* Set once info holds the parsed volume info for the current image. */
+    bool loaded;
+    struct io_throttle throttle;
+    int64_t progress_interval;
+    /* Time the next progress callback is due at. */
+    int64_t progress_due;
+    bool stats_enabled;
+    struct run_stats stats;
+    /* Md5 states of the images hashed before, NULL unless enabled. */
+    struct midstate_cache *cache;
+    struct read_profile profile;
+    struct read_ahead ahead;
+    /* Metrics the runs are recorded in, NULL unless enabled. */
+    struct isomd5sum_metrics *metrics;
+    int64_t metrics_started;
+    int64_t metrics_bytes;  /* Bytes read in the current run */
+    /* SHA-256 of the image computed alongside checks, NULL unless enabled. */
+    struct image_digest *digest;
+};
+
+/* Hash state of an image passed in pieces, see isomd5sumHasherNew. */
+struct isomd5sum_hasher {
+    int mode;               /* enum isomd5sum_hasher_mode */
+    int status;             /* ISOMD5SUM_CHECK_RUNNING until the data is bad */
+    /* Set once info holds the volume info from the primary volume descriptor. */
+    bool loaded;
+    struct volume_info info;
+    /* Set if the appdata held anything but spaces when implanting. */
+    bool appdata_used;
+    MD5_CTX hashctx;
+    int64_t offset;         /* Bytes hashed so far */
+    int64_t total_size;
+    int64_t fragment_size;
+    size_t previous_fragment;
+    char fragmentsums[FRAGMENT_SUM_SIZE + 1];
+    /* Start of the image kept until the primary volume descriptor is found. */
+    unsigned char *head;
+    size_t head_size;
+    /* Bytes of the current block hashed so far. */
+    size_t pending;
+};
+
+/* A regular file found in the directory tree of the image. */
+struct iso_file {
+    char path[ISO_PATH_SIZE];
+    int64_t offset;
+    int64_t size;
+};
+
+/* For non-zero return value, the walk is stopped. */
+typedef int (*isoFileCallback)(void *, const struct iso_file *file);
+
+int64_t primary_volume_size(const int isofd, unsigned char *const sectors, int64_t *const offset);
+
+int64_t find_primary_volume_descriptor(const unsigned char *const image, const size_t size);
+
+int64_t isosize(const unsigned char *const buffer);
 
 struct volume_info *const parsepvd(const int isofd);
 
+bool read_volume_info(const int isofd, unsigned char *const sectors, struct volume_info *const result);
+
+bool parse_volume_info(const unsigned char *const pvd, const int64_t offset, struct volume_info *const result);
+
+bool load_volume_info(struct isomd5sum_context *const ctx, const int isofd);
+
+void clear_appdata(unsigned char *const buffer, const size_t size, const int64_t appdata_offset, const int64_t offset);
+
+bool hasher_md5sum(const struct isomd5sum_hasher *const hasher, char *const hashsum);
+
 bool validate_fragment(const MD5_CTX *const hashctx, const size_t fragment,
                        const size_t fragmentsize, const char *const fragmentsums, char *const hashsums);
 
 void md5sum(char *const hashsum, MD5_CTX *const hashctx);
 
+int walk_iso_tree(const int isofd, isoFileCallback cb, void *cbdata);
+
+bool match_pattern(const char *pattern, const char *string);
+
+int64_t monotonic_ns(void);
+
+bool md5sum_extent(struct isomd5sum_context *const ctx, const int isofd, const int64_t offset, const int64_t size,
+                   char *const hashsum);
+
+bool progress_due(struct isomd5sum_context *const ctx);
+
+void throttle_begin(struct io_throttle *const throttle);
+
+void throttle_end(struct io_throttle *const throttle);
+
+void throttle_wait(struct io_throttle *const throttle, const size_t nbyte);
+
+void throttle_account(struct io_throttle *const throttle, const int64_t latency);
+
+ssize_t context_read(struct isomd5sum_context *const ctx, const int isofd, const int64_t offset, const size_t nbyte,
+                     unsigned char **const data);
+
+void stats_begin(struct isomd5sum_context *const ctx);
+
+void metrics_begin(struct isomd5sum_context *const ctx);
+
+void metrics_read(struct isomd5sum_metrics *const metrics, const size_t nbyte, const int64_t latency);
+
+void metrics_run(struct isomd5sum_context *const ctx, const int isofd, const char *const status);
+
+const char *metrics_status(const int status);
+
+void device_name(const int isofd, char *const name, const size_t size);
+
+void digest_begin(struct isomd5sum_context *const ctx);
+
+void digest_update(struct image_digest *const digest, const int64_t offset,
+                   const unsigned char *const data, const size_t size);
+
+void digest_wait(struct image_digest *const digest);
+
+void digest_end(struct isomd5sum_context *const ctx, const int isofd, const int status);
+
+void digest_free(struct image_digest *const digest);
+
+void stats_end(struct isomd5sum_context *const ctx);
+
+int64_t stats_start(const struct isomd5sum_context *const ctx);
+
+void stats_stop(const struct isomd5sum_context *const ctx, int64_t *const counter, const int64_t start);
+
 #endif /* ISOMD5_UTILITIES_H */
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "win32_compat.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "verity.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static bool read_salt(unsigned char *const salt) {
+    const int fd = open("/dev/urandom", O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return false;
+    const bool ok = read(fd, salt, VERITY_SALT_SIZE) == VERITY_SALT_SIZE;
+    close(fd);
+    if (!ok)
+        errno = EIO;
+    return ok;
+}
+
+/* Write without moving the position the image is read from. */
+static bool write_at(const int fd, const unsigned char *data, size_t len, int64_t offset) {
+#ifdef _WIN32
+    const int64_t position = lseek(fd, 0, SEEK_CUR);
+    const bool ok = lseek(fd, offset, SEEK_SET) == offset && write(fd, data, (unsigned) len) == (int) len;
+    lseek(fd, position, SEEK_SET);
+    return ok;
+#else
+    while (len > 0) {
+        const ssize_t written = pwrite(fd, data, len, (off_t) offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        len -= (size_t) written;
+        offset += written;
+    }
+    return true;
+#endif
+}
+
+static void salted_digest(const struct verity_tree *const tree, const unsigned char *const block,
+                          const size_t size, unsigned char *const digest) {
+    SHA256_CTX hashctx;
+    SHA256_Init(&hashctx);
+    SHA256_Update(&hashctx, tree->salt, VERITY_SALT_SIZE);
+    SHA256_Update(&hashctx, block, size);
+    SHA256_Final(digest, &hashctx);
+}
+
+static void add_digest(struct verity_tree *const tree, const int level, const unsigned char *const digest);
+
+/* Write the block of level, padded with zeros, and hash it into the level above. */
+static void flush_level(struct verity_tree *const tree, const int level) {
+    unsigned char *const block = tree->level_block + (size_t) level * VERITY_HASH_BLOCK_SIZE;
+    memset(block + tree->level_fill[level], 0, VERITY_HASH_BLOCK_SIZE - tree->level_fill[level]);
+    const int64_t offset = tree->hash_offset +
+                           (tree->level_start[level] + tree->level_done[level]) * VERITY_HASH_BLOCK_SIZE;
+    if (!write_at(tree->fd, block, VERITY_HASH_BLOCK_SIZE, offset))
+        tree->failed = true;
+    tree->level_done[level]++;
+    tree->level_fill[level] = 0;
+
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    salted_digest(tree, block, VERITY_HASH_BLOCK_SIZE, digest);
+    add_digest(tree, level + 1, digest);
+}
+
+static void add_digest(struct verity_tree *const tree, const int level, const unsigned char *const digest) {
+    /* The digest of the single block on top is the root. */
+    if (level == tree->levels) {
+        memcpy(tree->root, digest, SHA256_DIGEST_SIZE);
+        return;
+    }
+    unsigned char *const block = tree->level_block + (size_t) level * VERITY_HASH_BLOCK_SIZE;
+    memcpy(block + tree->level_fill[level], digest, SHA256_DIGEST_SIZE);
+    tree->level_fill[level] += SHA256_DIGEST_SIZE;
+    if (tree->level_fill[level] == VERITY_HASH_BLOCK_SIZE)
+        flush_level(tree, level);
+}
+
+bool verity_begin(struct verity_tree *const tree, const int fd, const int64_t hash_offset,
+                  const int64_t data_offset, const int64_t data_end) {
+    memset(tree, 0, sizeof(*tree));
+    tree->fd = fd;
+    tree->hash_offset = hash_offset;
+    tree->data_offset = data_offset;
+    tree->position = data_offset;
+    tree->data_blocks = (data_end - data_offset) / VERITY_DATA_BLOCK_SIZE;
+    if (tree->data_blocks < 2) {
+        errno = EINVAL;
+        return false;
+    }
+
+    /* As veritysetup: as many levels as it takes to get to a single block,
+     * level i holding a digest of every 128^i data blocks, the top first. */
+    while (tree->levels < VERITY_MAX_LEVELS &&
+           ((tree->data_blocks - 1) >> (VERITY_HASH_BITS * tree->levels)) > 0)
+        tree->levels++;
+    int64_t position = 0;
+    for (int level = tree->levels - 1; level >= 0; level--) {
+        const int shift = VERITY_HASH_BITS * (level + 1);
+        tree->level_start[level] = position;
+        position += (tree->data_blocks + ((int64_t) 1 << shift) - 1) >> shift;
+    }
+
+    tree->level_block = calloc((size_t) tree->levels, VERITY_HASH_BLOCK_SIZE);
+    if (tree->level_block == NULL)
+        return false;
+    if (!read_salt(tree->salt)) {
+        free(tree->level_block);
+        tree->level_block = NULL;
+        return false;
+    }
+    return true;
+}
+
+void verity_update(struct verity_tree *const tree, const int64_t offset,
+                   const unsigned char *data, size_t len) {
+    const int64_t data_end = tree->data_offset + tree->data_blocks * VERITY_DATA_BLOCK_SIZE;
+    /* Only the part of the data region past the bytes already fed counts. */
+    if (offset + (int64_t) len <= tree->position || offset >= data_end)
+        return;
+    if (offset < tree->position) {
+        data += tree->position - offset;
+        len -= (size_t) (tree->position - offset);
+    }
+    if (data_end - tree->position < (int64_t) len)
+        len = (size_t) (data_end - tree->position);
+    tree->position += (int64_t) len;
+
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    while (len > 0) {
+        if (tree->data_fill == 0 && len >= VERITY_DATA_BLOCK_SIZE) {
+            salted_digest(tree, data, VERITY_DATA_BLOCK_SIZE, digest);
+            add_digest(tree, 0, digest);
+            data += VERITY_DATA_BLOCK_SIZE;
+            len -= VERITY_DATA_BLOCK_SIZE;
+            continue;
+        }
+        const size_t take = len < VERITY_DATA_BLOCK_SIZE - tree->data_fill ? len : VERITY_DATA_BLOCK_SIZE - tree->data_fill;
+        memcpy(tree->data + tree->data_fill, data, take);
+        tree->data_fill += take;
+        data += take;
+        len -= take;
+        if (tree->data_fill == VERITY_DATA_BLOCK_SIZE) {
+            salted_digest(tree, tree->data, VERITY_DATA_BLOCK_SIZE, digest);
+            add_digest(tree, 0, digest);
+            tree->data_fill = 0;
+        }
+    }
+}
+
+bool verity_end(struct verity_tree *const tree) {
+    /* Short of data, the tree would have a root that does not match. */
+    if (tree->position != tree->data_offset + tree->data_blocks * VERITY_DATA_BLOCK_SIZE)
+        tree->failed = true;
+    for (int level = 0; level < tree->levels && !tree->failed; level++) {
+        if (tree->level_fill[level] > 0)
+            flush_level(tree, level);
+    }
+    free(tree->level_block);
+    tree->level_block = NULL;
+    return !tree->failed;
+}
+
+int64_t verity_hash_size(const struct verity_tree *const tree) {
+    int64_t blocks = 0;
+    for (int level = 0; level < tree->levels; level++) {
+        const int shift = VERITY_HASH_BITS * (level + 1);
+        blocks += (tree->data_blocks + ((int64_t) 1 << shift) - 1) >> shift;
+    }
+    return blocks * VERITY_HASH_BLOCK_SIZE;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2001-2017 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef ISOMD5_VERITY_H
+#define ISOMD5_VERITY_H
+
+/*
+ * dm-verity hash tree over the image, built while it is read for the md5sum.
+ * The layout is the one of veritysetup format --no-superblock with format
+ * version 1, sha256, 2048 byte data blocks and 4096 byte hash blocks: the
+ * levels are stored from the root down, every hash block holds the digests
+ * of salt followed by a block of the level below, zero padded.
+ *
+ * The tree covers the image from the sector after the primary volume
+ * descriptor, since the root hash is stored in its application data.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+#define VERITY_DATA_BLOCK_SIZE 2048
+#define VERITY_HASH_BLOCK_SIZE 4096
+#define VERITY_SALT_SIZE 16
+/* log2 of the digests per hash block. */
+#define VERITY_HASH_BITS 7
+/* 128^8 data blocks are more than any image holds. */
+#define VERITY_MAX_LEVELS 8
+
+struct verity_tree {
+    int fd;                 /* Descriptor the hash blocks are written to */
+    int64_t hash_offset;    /* Offset of the tree in fd */
+    int64_t data_offset;    /* Image offset of the first data block */
+    int64_t data_blocks;
+    int levels;
+    int64_t level_start[VERITY_MAX_LEVELS]; /* First hash block of each level */
+    int64_t level_done[VERITY_MAX_LEVELS];  /* Hash blocks written per level */
+    size_t level_fill[VERITY_MAX_LEVELS];   /* Bytes used in the level block */
+    unsigned char *level_block;             /* One hash block per level */
+    unsigned char data[VERITY_DATA_BLOCK_SIZE];
+    size_t data_fill;
+    int64_t position;       /* Image offset of the next byte fed */
+    unsigned char salt[VERITY_SALT_SIZE];
+    unsigned char root[SHA256_DIGEST_SIZE];
+    bool failed;
+};
+
+/*
+ * Start a tree over the image bytes from data_offset to data_end, to be
+ * written to fd at hash_offset. Return false with errno set if no salt or
+ * buffers could be had.
+ */
+bool verity_begin(struct verity_tree *const tree, const int fd, const int64_t hash_offset,
+                  const int64_t data_offset, const int64_t data_end);
+
+/* Feed the len bytes of the image at offset, which follow the bytes fed before. */
+void verity_update(struct verity_tree *const tree, const int64_t offset,
+                   const unsigned char *data, size_t len);
+
+/* Write the remaining hash blocks and compute the root. Return false if a write failed. */
+bool verity_end(struct verity_tree *const tree);
+
+/* Size of the tree in bytes. */
+int64_t verity_hash_size(const struct verity_tree *const tree);
+
+#endif